@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+#include "BVH.h"
+#include "PathTracer.h"
+#include "ThreadPool.h"
+#include "bench_rand.h"
+
+#define BVH_NUM_BINS 32
+#define BVH_MAX_LEAF 8
+#define BVH_MAX_DEPTH 60
+#define BVH_TRAVERSAL_COST 1.0f // relative to one primitive test
+
+static inline void aabb_reset(AABB& box)
+{
+	box.bounds_min = glm::vec3(FLT_MAX);
+	box.bounds_max = glm::vec3(-FLT_MAX);
+}
+
+static inline void aabb_grow(AABB& box, const glm::vec3& p)
+{
+	box.bounds_min = glm::min(box.bounds_min, p);
+	box.bounds_max = glm::max(box.bounds_max, p);
+}
+
+static inline void aabb_grow(AABB& box, const AABB& b)
+{
+	box.bounds_min = glm::min(box.bounds_min, b.bounds_min);
+	box.bounds_max = glm::max(box.bounds_max, b.bounds_max);
+}
+
+static inline float aabb_half_area(const AABB& box)
+{
+	glm::vec3 e = box.bounds_max - box.bounds_min;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+struct BVHBin
+{
+	AABB bounds;
+	unsigned count;
+};
+
+struct BVHBins
+{
+	BVHBin bins[3][BVH_NUM_BINS];
+
+	void reset(int num_bins)
+	{
+		for (int a = 0; a < 3; a++)
+			for (int b = 0; b < num_bins; b++)
+			{
+				aabb_reset(bins[a][b].bounds);
+				bins[a][b].count = 0;
+			}
+	}
+
+	void merge(const BVHBins& o, int num_bins)
+	{
+		for (int a = 0; a < 3; a++)
+			for (int b = 0; b < num_bins; b++)
+			{
+				aabb_grow(bins[a][b].bounds, o.bins[a][b].bounds);
+				bins[a][b].count += o.bins[a][b].count;
+			}
+	}
+};
+
+// primitives are moved around together with their bounds, so the binning reads memory sequentially
+struct BVHPrimRef
+{
+	AABB bounds;
+	unsigned index;
+
+	glm::vec3 centroid() const { return (bounds.bounds_min + bounds.bounds_max) * 0.5f; }
+};
+
+// a node to be built: refs[begin, end)
+struct BVHTask
+{
+	unsigned begin;
+	unsigned end;
+	unsigned depth;
+	AABB bounds;
+	AABB centroid_bounds;
+
+	// small nodes are binned coarser, the fixed cost of the bins dominates otherwise
+	int num_bins() const
+	{
+		unsigned count = end - begin;
+		return count >= BVH_NUM_BINS ? BVH_NUM_BINS : (count < 4 ? 4 : (int)count);
+	}
+};
+
+struct BVHSplit
+{
+	int axis;
+	int bin;
+	float cost;
+	BVHTask left;
+	BVHTask right;
+};
+
+// maps centroids of a task to bins, shared by the binning and the partition so both agree exactly
+struct BVHBinMapping
+{
+	glm::vec3 origin;
+	glm::vec3 scale;
+	int num_bins;
+
+	BVHBinMapping(const BVHTask& task)
+	{
+		num_bins = task.num_bins();
+		origin = task.centroid_bounds.bounds_min;
+		glm::vec3 extent = task.centroid_bounds.bounds_max - task.centroid_bounds.bounds_min;
+		for (int a = 0; a < 3; a++)
+			scale[a] = extent[a] > 0.0f ? (float)num_bins / extent[a] : 0.0f;
+	}
+
+	int bin(int axis, const glm::vec3& c) const
+	{
+		int b = (int)((c[axis] - origin[axis]) * scale[axis]);
+		return b < 0 ? 0 : (b >= num_bins ? num_bins - 1 : b);
+	}
+};
+
+struct BVHBuilder
+{
+	BVHPrimRef* refs;
+	unsigned leaf_block;
+
+	// a leaf costs one test per block of leaf_block primitives
+	float leaf_cost(unsigned count) const
+	{
+		return (float)((count + leaf_block - 1) / leaf_block);
+	}
+
+	void bin_range(const BVHTask& task, unsigned begin, unsigned end, BVHBins& bins) const
+	{
+		BVHBinMapping mapping(task);
+		for (unsigned i = begin; i < end; i++)
+		{
+			const BVHPrimRef& ref = refs[i];
+			glm::vec3 c = ref.centroid();
+			for (int a = 0; a < 3; a++)
+			{
+				if (mapping.scale[a] == 0.0f) continue;
+				BVHBin& bin = bins.bins[a][mapping.bin(a, c)];
+				aabb_grow(bin.bounds, ref.bounds);
+				bin.count++;
+			}
+		}
+	}
+
+	// sweeps the bins of every axis, false if all centroids coincide
+	bool find_split(const BVHTask& task, const BVHBins& bins, BVHSplit& split) const
+	{
+		split.cost = FLT_MAX;
+		split.axis = -1;
+		BVHBinMapping mapping(task);
+		int num_bins = mapping.num_bins;
+		float inv_area = 1.0f / aabb_half_area(task.bounds);
+		for (int a = 0; a < 3; a++)
+		{
+			if (mapping.scale[a] == 0.0f) continue;
+			const BVHBin* b = bins.bins[a];
+
+			float right_area[BVH_NUM_BINS];
+			AABB box;
+			aabb_reset(box);
+			unsigned count = 0;
+			for (int i = num_bins - 1; i > 0; i--)
+			{
+				aabb_grow(box, b[i].bounds);
+				count += b[i].count;
+				right_area[i] = count > 0 ? aabb_half_area(box) * leaf_cost(count) : 0.0f;
+			}
+
+			aabb_reset(box);
+			count = 0;
+			for (int i = 0; i < num_bins - 1; i++)
+			{
+				aabb_grow(box, b[i].bounds);
+				count += b[i].count;
+				unsigned total = task.end - task.begin;
+				if (count == 0 || count == total) continue;
+				float cost = BVH_TRAVERSAL_COST + (aabb_half_area(box) * leaf_cost(count) + right_area[i + 1]) * inv_area;
+				if (cost < split.cost)
+				{
+					split.cost = cost;
+					split.axis = a;
+					split.bin = i + 1;
+				}
+			}
+		}
+		if (split.axis < 0) return false;
+
+		const BVHBin* b = bins.bins[split.axis];
+		BVHTask* children[2] = { &split.left, &split.right };
+		for (int k = 0; k < 2; k++)
+		{
+			BVHTask& child = *children[k];
+			aabb_reset(child.bounds);
+			int first = k == 0 ? 0 : split.bin;
+			int last = k == 0 ? split.bin : num_bins;
+			unsigned count = 0;
+			for (int i = first; i < last; i++)
+			{
+				aabb_grow(child.bounds, b[i].bounds);
+				count += b[i].count;
+			}
+			child.depth = task.depth + 1;
+			child.begin = k == 0 ? task.begin : task.begin + (split.left.end - split.left.begin);
+			child.end = child.begin + count;
+		}
+		return true;
+	}
+
+	// the split of last resort when the centroids coincide: halves by index
+	void median_split(const BVHTask& task, BVHSplit& split) const
+	{
+		unsigned mid = (task.begin + task.end) / 2;
+		BVHTask* children[2] = { &split.left, &split.right };
+		for (int k = 0; k < 2; k++)
+		{
+			BVHTask& child = *children[k];
+			child.begin = k == 0 ? task.begin : mid;
+			child.end = k == 0 ? mid : task.end;
+			child.depth = task.depth + 1;
+			aabb_reset(child.bounds);
+			aabb_reset(child.centroid_bounds);
+			for (unsigned i = child.begin; i < child.end; i++)
+			{
+				aabb_grow(child.bounds, refs[i].bounds);
+				aabb_grow(child.centroid_bounds, refs[i].centroid());
+			}
+		}
+		split.axis = -1;
+	}
+
+	// moves the references of the left child to the front, the centroid bounds of the children are
+	// collected on the way
+	void partition(const BVHTask& task, BVHSplit& split) const
+	{
+		if (split.axis < 0) return;
+		BVHBinMapping mapping(task);
+		int axis = split.axis;
+		int bin = split.bin;
+		aabb_reset(split.left.centroid_bounds);
+		aabb_reset(split.right.centroid_bounds);
+		unsigned i = task.begin;
+		unsigned j = task.end;
+		while (true)
+		{
+			while (i < j)
+			{
+				glm::vec3 c = refs[i].centroid();
+				if (mapping.bin(axis, c) >= bin) break;
+				aabb_grow(split.left.centroid_bounds, c);
+				i++;
+			}
+			while (i < j)
+			{
+				glm::vec3 c = refs[j - 1].centroid();
+				if (mapping.bin(axis, c) < bin) break;
+				aabb_grow(split.right.centroid_bounds, c);
+				j--;
+			}
+			if (i >= j) break;
+			std::swap(refs[i], refs[j - 1]);
+		}
+	}
+
+	// false: make a leaf
+	bool decide(const BVHTask& task, const BVHBins& bins, BVHSplit& split) const
+	{
+		unsigned count = task.end - task.begin;
+		unsigned max_leaf = leaf_block > BVH_MAX_LEAF ? leaf_block : BVH_MAX_LEAF;
+		if (count <= 1 || task.depth >= BVH_MAX_DEPTH) return false;
+		if (!find_split(task, bins, split))
+		{
+			if (count <= max_leaf) return false;
+			median_split(task, split);
+			return true;
+		}
+		return !(split.cost >= leaf_cost(count) && count <= max_leaf);
+	}
+
+	static void make_node(const BVHTask& task, bool leaf, BVHNode& node)
+	{
+		node.bounds_min = task.bounds.bounds_min;
+		node.bounds_max = task.bounds.bounds_max;
+		node.offset = leaf ? task.begin : 0;
+		node.count = leaf ? task.end - task.begin : 0;
+	}
+
+	void build_subtree(const BVHTask& task, std::vector<BVHNode>& nodes) const
+	{
+		unsigned index = (unsigned)nodes.size();
+		nodes.push_back(BVHNode());
+
+		BVHBins bins;
+		bins.reset(task.num_bins());
+		bin_range(task, task.begin, task.end, bins);
+
+		BVHSplit split;
+		bool inner = decide(task, bins, split);
+		make_node(task, !inner, nodes[index]);
+		if (!inner) return;
+
+		partition(task, split);
+		build_subtree(split.left, nodes);
+		nodes[index].offset = (unsigned)nodes.size();
+		build_subtree(split.right, nodes);
+	}
+};
+
+// node of the breadth-first top of the tree
+struct BVHTopNode
+{
+	BVHTask task;
+	bool leaf;
+	int children[2];
+	int subtree; // >= 0: built separately in phase 2
+};
+
+BVH::BVH()
+{
+	m_stats = {};
+}
+
+void BVH::build(const AABB* prim_bounds, unsigned num_prims, unsigned leaf_block)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	ThreadPool& pool = ThreadPool::get_pool();
+	unsigned num_threads = pool.num_threads();
+
+	m_nodes.clear();
+	m_prim_indices.resize(num_prims);
+	std::vector<BVHPrimRef> refs(num_prims);
+
+	BVHBuilder builder;
+	builder.refs = refs.data();
+	builder.leaf_block = leaf_block > 0 ? leaf_block : 1;
+
+	// references and root bounds
+	BVHTask root;
+	root.begin = 0;
+	root.end = num_prims;
+	root.depth = 0;
+	aabb_reset(root.bounds);
+	aabb_reset(root.centroid_bounds);
+	{
+		std::vector<BVHTask> partial(num_threads, root);
+		pool.parallel_for(num_prims, 16384, [&](size_t begin, size_t end, unsigned thread_id)
+		{
+			BVHTask& t = partial[thread_id];
+			for (size_t i = begin; i < end; i++)
+			{
+				refs[i].bounds = prim_bounds[i];
+				refs[i].index = (unsigned)i;
+				aabb_grow(t.bounds, prim_bounds[i]);
+				aabb_grow(t.centroid_bounds, refs[i].centroid());
+			}
+		});
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			aabb_grow(root.bounds, partial[i].bounds);
+			aabb_grow(root.centroid_bounds, partial[i].centroid_bounds);
+		}
+	}
+
+	// phase 1: split the top breadth-first until there is enough independent work for every thread
+	unsigned subtree_size = num_prims / (num_threads * 8);
+	if (subtree_size < 4096) subtree_size = 4096;
+
+	std::vector<BVHTopNode> top;
+	std::vector<int> subtrees;
+	std::vector<int> level;
+	if (num_prims > 0)
+	{
+		BVHTopNode node;
+		node.task = root;
+		node.leaf = false;
+		node.subtree = -1;
+		top.push_back(node);
+		level.push_back(0);
+	}
+
+	std::vector<BVHBins> thread_bins(num_threads);
+	while (level.size() > 0)
+	{
+		std::vector<int> to_split;
+		std::vector<BVHSplit> splits;
+		for (size_t k = 0; k < level.size(); k++)
+		{
+			int id = level[k];
+			const BVHTask task = top[id].task;
+			if (task.end - task.begin <= subtree_size)
+			{
+				top[id].subtree = (int)subtrees.size();
+				subtrees.push_back(id);
+				continue;
+			}
+
+			for (unsigned i = 0; i < num_threads; i++)
+				thread_bins[i].reset(BVH_NUM_BINS);
+			pool.parallel_for(task.end - task.begin, 16384, [&builder, &task, &thread_bins](size_t begin, size_t end, unsigned thread_id)
+			{
+				builder.bin_range(task, task.begin + (unsigned)begin, task.begin + (unsigned)end, thread_bins[thread_id]);
+			});
+			for (unsigned i = 1; i < num_threads; i++)
+				thread_bins[0].merge(thread_bins[i], BVH_NUM_BINS);
+
+			BVHSplit split;
+			if (!builder.decide(task, thread_bins[0], split))
+			{
+				top[id].leaf = true;
+				continue;
+			}
+			to_split.push_back(id);
+			splits.push_back(split);
+		}
+
+		pool.parallel_for(to_split.size(), 1, [&](size_t begin, size_t end, unsigned)
+		{
+			for (size_t k = begin; k < end; k++)
+				builder.partition(top[to_split[k]].task, splits[k]);
+		});
+
+		level.clear();
+		for (size_t k = 0; k < to_split.size(); k++)
+		{
+			const BVHTask* children[2] = { &splits[k].left, &splits[k].right };
+			for (int c = 0; c < 2; c++)
+			{
+				BVHTopNode node;
+				node.task = *children[c];
+				node.leaf = false;
+				node.subtree = -1;
+				top[to_split[k]].children[c] = (int)top.size();
+				level.push_back((int)top.size());
+				top.push_back(node);
+			}
+		}
+	}
+
+	// phase 2: the subtrees, largest first
+	std::vector<int> order(subtrees.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = (int)i;
+	std::sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		const BVHTask& ta = top[subtrees[a]].task;
+		const BVHTask& tb = top[subtrees[b]].task;
+		return ta.end - ta.begin > tb.end - tb.begin;
+	});
+
+	std::vector<std::vector<BVHNode>> subtree_nodes(subtrees.size());
+	pool.parallel_for(order.size(), 1, [&](size_t begin, size_t end, unsigned)
+	{
+		for (size_t k = begin; k < end; k++)
+		{
+			int s = order[k];
+			builder.build_subtree(top[subtrees[s]].task, subtree_nodes[s]);
+		}
+	});
+
+	pool.parallel_for(num_prims, 16384, [&](size_t begin, size_t end, unsigned)
+	{
+		for (size_t i = begin; i < end; i++)
+			m_prim_indices[i] = refs[i].index;
+	});
+
+	// phase 3: depth-first layout of the top nodes with the subtrees spliced in
+	m_nodes.reserve(2 * (size_t)num_prims);
+	std::vector<int> stack;
+	std::vector<unsigned> parent_slot; // node whose offset is the next second child
+	if (top.size() > 0)
+	{
+		stack.push_back(0);
+		parent_slot.push_back((unsigned)-1);
+	}
+	while (stack.size() > 0)
+	{
+		int id = stack.back();
+		unsigned parent = parent_slot.back();
+		stack.pop_back();
+		parent_slot.pop_back();
+
+		unsigned index = (unsigned)m_nodes.size();
+		if (parent != (unsigned)-1)
+			m_nodes[parent].offset = index;
+
+		const BVHTopNode& node = top[id];
+		if (node.subtree >= 0)
+		{
+			const std::vector<BVHNode>& sub = subtree_nodes[node.subtree];
+			for (size_t i = 0; i < sub.size(); i++)
+			{
+				BVHNode n = sub[i];
+				if (n.count == 0) n.offset += index;
+				m_nodes.push_back(n);
+			}
+			continue;
+		}
+
+		BVHNode n;
+		BVHBuilder::make_node(node.task, node.leaf, n);
+		m_nodes.push_back(n);
+		if (node.leaf) continue;
+
+		// the second child is patched in when it is popped, the first one follows immediately
+		stack.push_back(node.children[1]);
+		parent_slot.push_back(index);
+		stack.push_back(node.children[0]);
+		parent_slot.push_back((unsigned)-1);
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+	m_stats.num_prims = num_prims;
+	m_stats.num_nodes = (unsigned)m_nodes.size();
+	m_stats.num_leaves = 0;
+	m_stats.sah_cost = 0.0f;
+	m_stats.build_ms = ms;
+	if (m_nodes.size() > 0)
+	{
+		AABB root_box = { m_nodes[0].bounds_min, m_nodes[0].bounds_max };
+		double inv_root_area = 1.0 / (double)aabb_half_area(root_box);
+		double cost = 0.0;
+		for (size_t i = 0; i < m_nodes.size(); i++)
+		{
+			const BVHNode& n = m_nodes[i];
+			AABB box = { n.bounds_min, n.bounds_max };
+			double p = (double)aabb_half_area(box) * inv_root_area;
+			if (n.count > 0)
+			{
+				m_stats.num_leaves++;
+				cost += p * (double)builder.leaf_cost(n.count);
+			}
+			else
+			{
+				cost += p * BVH_TRAVERSAL_COST;
+			}
+		}
+		m_stats.sah_cost = (float)cost;
+	}
+}
+
+void BVH::build_triangles(const Vertex* vertices, const unsigned* indices, unsigned num_triangles)
+{
+	std::vector<AABB> bounds(num_triangles);
+	ThreadPool::get_pool().parallel_for(num_triangles, 16384, [&](size_t begin, size_t end, unsigned)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			AABB& box = bounds[i];
+			box.bounds_min = box.bounds_max = vertices[indices[3 * i]].Position;
+			aabb_grow(box, vertices[indices[3 * i + 1]].Position);
+			aabb_grow(box, vertices[indices[3 * i + 2]].Position);
+		}
+	});
+	build(bounds.data(), num_triangles);
+}
+
+void BVH::print_stats(const char* name) const
+{
+	printf("BVH %s: %u prims, %u nodes (%u leaves), SAH cost %.2f, built in %.2f ms, %.1f Mprims/s\n",
+		name, m_stats.num_prims, m_stats.num_nodes, m_stats.num_leaves, m_stats.sah_cost, m_stats.build_ms,
+		m_stats.build_ms > 0.0 ? (double)m_stats.num_prims / m_stats.build_ms * 1e-3 : 0.0);
+}
+
+void bvh_build_benchmark()
+{
+	const unsigned sizes[3] = { 10000, 100000, 1000000 };
+
+	BenchRand rng;
+
+	printf("--- BVH build, random triangles, %u threads ---\n", ThreadPool::get_pool().num_threads());
+	for (unsigned num_triangles : sizes)
+	{
+		std::vector<Vertex> vertices(3 * (size_t)num_triangles);
+		std::vector<unsigned> indices(3 * (size_t)num_triangles);
+		for (unsigned i = 0; i < num_triangles; i++)
+		{
+			glm::vec3 c = 100.0f * glm::vec3(rng.uniform(), rng.uniform(), rng.uniform());
+			for (unsigned k = 0; k < 3; k++)
+			{
+				vertices[3 * i + k].Position = c + glm::vec3(rng.uniform(), rng.uniform(), rng.uniform());
+				indices[3 * i + k] = 3 * i + k;
+			}
+		}
+
+		BVH bvh;
+		bvh.build_triangles(vertices.data(), indices.data(), num_triangles);
+		char name[32];
+		sprintf(name, "%u triangles", num_triangles);
+		bvh.print_stats(name);
+
+		std::vector<unsigned> seen(num_triangles, 0);
+		unsigned errors = 0;
+		for (const BVHNode& node : bvh.nodes())
+		{
+			for (unsigned k = 0; k < node.count; k++)
+			{
+				unsigned prim = bvh.prim_indices()[node.offset + k];
+				seen[prim]++;
+				for (unsigned j = 0; j < 3; j++)
+				{
+					glm::vec3 p = vertices[indices[3 * prim + j]].Position;
+					for (int a = 0; a < 3; a++)
+						if (p[a] < node.bounds_min[a] || p[a] > node.bounds_max[a]) errors++;
+				}
+			}
+		}
+		for (unsigned i = 0; i < num_triangles; i++)
+			if (seen[i] != 1) errors++;
+		if (errors > 0)
+			printf("BVH %u triangles: %u errors\n", num_triangles, errors);
+	}
+}
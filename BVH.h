@@ -0,0 +1,58 @@
+#pragma once
+
+#include <glm.hpp>
+#include <vector>
+
+struct Vertex;
+
+struct AABB
+{
+	glm::vec3 bounds_min;
+	glm::vec3 bounds_max;
+};
+
+// 32 bytes, two nodes per cache line. Nodes are stored depth-first, so the first child of an inner
+// node directly follows it and only the second child needs an index.
+struct BVHNode
+{
+	glm::vec3 bounds_min;
+	unsigned offset; // inner node: index of the second child, leaf: first entry of prim_indices()
+	glm::vec3 bounds_max;
+	unsigned count;  // number of primitives of a leaf, 0 for inner nodes
+};
+
+struct BVHBuildStats
+{
+	unsigned num_prims;
+	unsigned num_nodes;
+	unsigned num_leaves;
+	float sah_cost;   // expected traversal + intersection cost of a random ray hitting the root
+	double build_ms;
+};
+
+// Binned SAH builder. The top of the tree is split breadth-first with the binning of each node
+// spread over the ThreadPool, the remaining subtrees are then built concurrently.
+class BVH
+{
+public:
+	BVH();
+
+	// leaf_block: the primitives of a leaf are tested leaf_block at a time (SIMD), the SAH then
+	// costs a leaf by its number of blocks and leaves grow up to that many primitives
+	void build(const AABB* prim_bounds, unsigned num_prims, unsigned leaf_block = 1);
+	void build_triangles(const Vertex* vertices, const unsigned* indices, unsigned num_triangles);
+
+	const std::vector<BVHNode>& nodes() const { return m_nodes; }
+	const std::vector<unsigned>& prim_indices() const { return m_prim_indices; }
+	const BVHBuildStats& stats() const { return m_stats; }
+	void print_stats(const char* name) const;
+
+private:
+	std::vector<BVHNode> m_nodes;
+	std::vector<unsigned> m_prim_indices;
+	BVHBuildStats m_stats;
+};
+
+// Builds the BVH of 10k, 100k and 1M random triangles (a unit sized soup in a cube of edge 100), prints
+// the statistics of every build and checks that each triangle is in exactly one leaf that bounds it.
+void bvh_build_benchmark();
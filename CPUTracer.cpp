@@ -0,0 +1,1637 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
+#include "CPUTracer.h"
+#include "ThreadPool.h"
+#include "sobol.h"
+#include "cpu_features.h"
+#include "xorwow_kernels.h"
+#ifdef COUNT_ALLOCATIONS
+#include "alloc_counter.h"
+#endif
+
+// rand.shinc
+
+static inline unsigned rand_xorwow(RNGState& state)
+{
+	unsigned t;
+	t = (state.v.v0 ^ (state.v.v0 >> 2));
+	state.v.v0 = state.v.v1;
+	state.v.v1 = state.v.v2;
+	state.v.v2 = state.v.v3;
+	state.v.v3 = state.v.v4;
+	state.v.v4 = (state.v.v4 ^ (state.v.v4 << 4)) ^ (t ^ (t << 1));
+	state.d += 362437;
+	return state.v.v4 + state.d;
+}
+
+static inline float rand01(RNGState& state)
+{
+	unsigned long long urand = rand_xorwow(state);
+	return (float)urand / (float)(1ull << 32);
+}
+
+static inline glm::uvec4 pcg4d(glm::uvec4 v)
+{
+	v = v * 1664525u + 1013904223u;
+	v.x += v.y*v.w;
+	v.y += v.z*v.x;
+	v.z += v.x*v.y;
+	v.w += v.y*v.z;
+	v ^= v >> 16u;
+	v.x += v.y*v.w;
+	v.y += v.z*v.x;
+	v.z += v.x*v.y;
+	v.w += v.y*v.z;
+	return v;
+}
+
+static inline float rand01(glm::uvec4& counter)
+{
+	unsigned r = pcg4d(counter).x;
+	counter.w++;
+	return (float)(r >> 8) * (1.0f / 16777216.0f);
+}
+
+// sampler.shinc
+
+static inline unsigned bitfield_reverse(unsigned x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static inline unsigned hash_seed(unsigned a, unsigned b)
+{
+	return pcg4d(glm::uvec4(a, b, 0x9e3779b9u, 0x85ebca6bu)).x;
+}
+
+static inline unsigned nested_uniform_scramble(unsigned x, unsigned seed)
+{
+	x = bitfield_reverse(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return bitfield_reverse(x);
+}
+
+static inline unsigned sobol(const unsigned* dirs, unsigned index, int dim)
+{
+	unsigned x = 0;
+	for (int bit = 0; bit < 32; bit++)
+	{
+		unsigned mask = 0u - ((index >> bit) & 1u);
+		x ^= mask & dirs[dim * 32 + bit];
+	}
+	return x;
+}
+
+static inline float sobol_to_float(unsigned x)
+{
+	return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// the sampler globals of raygen.rgen
+struct PathSampler
+{
+	RandMode rand_mode;
+	Sampler sampler;
+	const unsigned* sobol_dirs;
+
+	unsigned ray_id;
+	unsigned sample_iter;
+	unsigned sample_dim;
+	RNGState rstate;
+	glm::uvec4 rcounter;
+
+	float rnd()
+	{
+		if (rand_mode == RandMode::XorWow) return rand01(rstate);
+		return rand01(rcounter);
+	}
+
+	float sample1()
+	{
+		if (sampler == Sampler::Independent) return rnd();
+		unsigned seed = hash_seed(ray_id, sample_dim++);
+		unsigned i = nested_uniform_scramble(sample_iter, seed);
+		return sobol_to_float(nested_uniform_scramble(bitfield_reverse(i), hash_seed(seed, 1u)));
+	}
+
+	glm::vec2 sample2()
+	{
+		if (sampler == Sampler::Independent)
+		{
+			float x = rnd();
+			return glm::vec2(x, rnd());
+		}
+		unsigned seed = hash_seed(ray_id, sample_dim++);
+		unsigned i = nested_uniform_scramble(sample_iter, seed);
+		unsigned x = nested_uniform_scramble(sobol(sobol_dirs, i, 0), hash_seed(seed, 1u));
+		unsigned y = nested_uniform_scramble(sobol(sobol_dirs, i, 1), hash_seed(seed, 2u));
+		return glm::vec2(sobol_to_float(x), sobol_to_float(y));
+	}
+
+	glm::vec3 sample_lambertian(const glm::vec3& normal)
+	{
+		glm::vec2 u = sample2();
+		float z = 1.0f - 2.0f * u.x;
+		float s = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+		float phi = 2.0f * 3.14159265f * u.y;
+		glm::vec3 d = normal + glm::vec3(s * cosf(phi), s * sinf(phi), z);
+		float len2 = glm::dot(d, d);
+		return len2 > 1e-12f ? d / sqrtf(len2) : normal;
+	}
+};
+
+// payload.shinc
+struct Payload
+{
+	glm::vec4 color_dis;
+	glm::vec4 normal;
+	glm::vec4 emission; // w: light of the hit emitter, -1 when not sampled
+};
+
+// closest candidate during traversal, the hit attributes of the shaders
+struct Hit
+{
+	int instance;
+	unsigned primitive;
+	float t;
+	glm::vec4 attribs; // barycentrics (triangles), or hitpoint and side (spheres: in object space, world spheres: relative to the center)
+	bool first_hit;    // shadow rays: the traversal ends at the first hit (gl_RayFlagsTerminateOnFirstHitNV)
+};
+
+static inline bool intersect_bounds(const glm::vec3& bmin, const glm::vec3& bmax, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax)
+{
+	for (int k = 0; k < 3; k++)
+	{
+		float inv = 1.0f / direction[k];
+		float t0 = (bmin[k] - origin[k]) * inv;
+		float t1 = (bmax[k] - origin[k]) * inv;
+		if (t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+		if (t0 > tmin) tmin = t0;
+		if (t1 < tmax) tmax = t1;
+		if (tmin > tmax) return false;
+	}
+	return true;
+}
+
+// front-to-back traversal of the wide BVH, calls leaf(node_index, node) for every leaf of the binary
+// BVH the ray enters before hit.t. The entered children of a node are pushed sorted far to near and
+// popped entries that start behind the current hit are dropped.
+template <class LeafFunc>
+static inline void traverse_bvh(const BVH& bvh, const WideBVH& wide, const glm::vec3& origin, const glm::vec3& direction, float tmin, Hit& hit, LeafFunc leaf)
+{
+	if (wide.nodes().empty()) return;
+	const WideBVHNode* nodes = wide.nodes().data();
+	const BVHNode* leaves = bvh.nodes().data();
+	WideNodeIntersect intersect = wide_node_kernels().intersect;
+	WideRay ray = make_wide_ray(origin, direction, tmin);
+
+	struct StackEntry
+	{
+		unsigned child;
+		float t;
+	};
+	StackEntry stack[WIDE_BVH_STACK_SIZE];
+	int sp = 0;
+	unsigned node = 0;
+	while (true)
+	{
+		float t_near[WIDE_BVH_WIDTH];
+		unsigned mask = intersect(nodes[node], ray, hit.t, t_near);
+		int first = sp;
+		while (mask != 0)
+		{
+			int i = lowest_bit(mask);
+			mask &= mask - 1;
+			StackEntry e = { nodes[node].child[i], t_near[i] };
+			int j = sp++;
+			while (j > first && stack[j - 1].t < e.t)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = e;
+		}
+
+		// leaves are intersected until the next inner node comes up
+		while (true)
+		{
+			if (sp == 0) return;
+			StackEntry e = stack[--sp];
+			if (e.t > hit.t) continue;
+			if ((e.child & WIDE_BVH_LEAF) == 0)
+			{
+				node = e.child;
+				break;
+			}
+			unsigned index = e.child & ~WIDE_BVH_LEAF;
+			leaf(index, leaves[index]);
+			if (hit.first_hit && hit.instance >= 0) return;
+		}
+	}
+}
+
+// bottom level: the BVH of a geometry in object space, the leaves are tested a block of triangles
+// at a time (Moller-Trumbore, both sides as the instances have VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV)
+static inline void intersect_triangles(const CPUGeometry& geometry, int instance, const glm::vec3& origin, const glm::vec3& direction, float tmin, Hit& hit)
+{
+	const TriangleBlock* blocks = geometry.blocks.data();
+	const unsigned* leaf_blocks = geometry.leaf_blocks.data();
+	TriBlockIntersect intersect = tri_kernels().intersect;
+	traverse_bvh(geometry.bvh, geometry.wide, origin, direction, tmin, hit, [&](unsigned node, const BVHNode& n)
+	{
+		unsigned first = leaf_blocks[node];
+		unsigned num_blocks = (n.count + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+		for (unsigned i = first; i < first + num_blocks; i++)
+		{
+			float t, u, v;
+			int lane = intersect(blocks[i], origin, direction, tmin, hit.t, t, u, v);
+			if (lane < 0) continue;
+			hit.instance = instance;
+			hit.primitive = blocks[i].prim[lane];
+			hit.t = t;
+			hit.attribs = glm::vec4(u, v, 0.0f, 0.0f);
+		}
+	});
+}
+
+// intersection_spheres.rint
+static inline void intersect_sphere(int instance, const glm::vec3& origin, const glm::vec3& direction, float tmin, Hit& hit)
+{
+	float tmax = hit.t;
+	const float a = glm::dot(direction, direction);
+	const float b = glm::dot(origin, direction);
+	const float c = glm::dot(origin, origin) - 1.0f;
+	const float discriminant = b * b - a * c;
+
+	if (discriminant >= 0.0f)
+	{
+		const float t1 = (-b - sqrtf(discriminant)) / a;
+		const float t2 = (-b + sqrtf(discriminant)) / a;
+
+		if (tmin <= t1 && t1 < tmax)
+		{
+			hit.instance = instance;
+			hit.t = t1;
+			hit.attribs = glm::vec4(origin + direction * t1, 1.0f);
+		}
+		else if (tmin <= t2 && t2 < tmax)
+		{
+			hit.instance = instance;
+			hit.t = t2;
+			hit.attribs = glm::vec4(origin + direction * t2, -1.0f);
+		}
+	}
+}
+
+static inline void intersect_sphere_block(const CPUSpheres& spheres, int first_instance, const SphereBlock& block, SphereBlockIntersect intersect, const glm::vec3& origin, const glm::vec3& direction, float tmin, Hit& hit)
+{
+	float t, side;
+	int lane = intersect(block, origin, direction, tmin, hit.t, t, side);
+	if (lane < 0) return;
+	unsigned sphere = block.prim[lane];
+	hit.instance = first_instance + (int)sphere;
+	hit.primitive = 0;
+	hit.t = t;
+	hit.attribs = glm::vec4(origin + direction * t - spheres.centers[sphere], side);
+}
+
+// the uniformly scaled spheres, in world space a block at a time
+static inline void intersect_world_spheres(const CPUSpheres& spheres, int first_instance, const glm::vec3& origin, const glm::vec3& direction, float tmin, Hit& hit)
+{
+	const SphereBlock* blocks = spheres.blocks.data();
+	const unsigned* leaf_blocks = spheres.leaf_blocks.data();
+	SphereBlockIntersect intersect = sphere_kernels().intersect;
+	traverse_bvh(spheres.bvh, spheres.wide, origin, direction, tmin, hit, [&](unsigned node, const BVHNode& n)
+	{
+		unsigned first = leaf_blocks[node];
+		unsigned num_blocks = (n.count + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+		for (unsigned i = first; i < first + num_blocks; i++)
+			intersect_sphere_block(spheres, first_instance, blocks[i], intersect, origin, direction, tmin, hit);
+	});
+}
+
+// traceNV() without the shaders: closest hit of a single ray, or any hit with first_hit
+static void intersect_ray(const CPUScene& scene, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, Hit& hit, bool first_hit = false)
+{
+	const std::vector<CPUInstance>& instances = scene.instances;
+	hit.instance = -1;
+	hit.t = tmax;
+	hit.first_hit = first_hit;
+
+	// top level: the world space bounds of the instances, the ray is then moved into object space
+	// like gl_ObjectRayOriginNV/gl_ObjectRayDirectionNV
+	const unsigned* tlas_prims = scene.tlas.prim_indices().data();
+	traverse_bvh(scene.tlas, scene.wide_tlas, origin, direction, tmin, hit, [&](unsigned, const BVHNode& n)
+	{
+		for (unsigned k = 0; k < n.count && !(first_hit && hit.instance >= 0); k++)
+		{
+			unsigned i = tlas_prims[n.offset + k];
+			const CPUInstance& inst = instances[i];
+			glm::vec3 o = glm::vec3(inst.world_to_object * glm::vec4(origin, 1.0f));
+			glm::vec3 d = glm::vec3(inst.world_to_object * glm::vec4(direction, 0.0f));
+			if (!intersect_bounds(inst.bounds_min, inst.bounds_max, o, d, tmin, hit.t)) continue;
+			if (inst.mesh != nullptr)
+				intersect_triangles(*inst.geometry, (int)i, o, d, tmin, hit);
+			else
+				intersect_sphere((int)i, o, d, tmin, hit);
+		}
+	});
+	if (first_hit && hit.instance >= 0) return;
+	intersect_world_spheres(scene.spheres, (int)instances.size(), origin, direction, tmin, hit);
+}
+
+// sky.shinc: the environment map when there is one, otherwise the gradient of miss.rmiss and a
+// sampling density proportional to its luminance
+
+static glm::vec3 sky_radiance(const CPUScene& scene, const glm::vec3& direction)
+{
+	if (scene.environment != nullptr) return scene.environment->radiance(direction);
+	float t = 0.5f * (direction.y + 1.0f);
+	return (1.0f - t)*glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+}
+
+#define SKY_LUM_TOP (0.2126f * 0.5f + 0.7152f * 0.7f + 0.0722f * 1.0f)
+#define SKY_LUM_C0 (0.5f * (1.0f + SKY_LUM_TOP))
+#define SKY_LUM_C1 (0.5f * (SKY_LUM_TOP - 1.0f))
+
+static float sky_pdf(const CPUScene& scene, const glm::vec3& direction)
+{
+	if (scene.environment != nullptr) return scene.environment->pdf(direction);
+	return (SKY_LUM_C0 + SKY_LUM_C1 * direction.y) / (4.0f * 3.14159265f * SKY_LUM_C0);
+}
+
+static glm::vec3 sample_sky(const CPUScene& scene, const glm::vec2& u)
+{
+	if (scene.environment != nullptr) return scene.environment->sample(u);
+	float c = SKY_LUM_C0 - 0.5f * SKY_LUM_C1 - 2.0f * SKY_LUM_C0 * u.x;
+	float y = -2.0f * c / (SKY_LUM_C0 + sqrtf(fmaxf(0.0f, SKY_LUM_C0 * SKY_LUM_C0 - 2.0f * SKY_LUM_C1 * c)));
+	y = fminf(fmaxf(y, -1.0f), 1.0f);
+	float s = sqrtf(fmaxf(0.0f, 1.0f - y * y));
+	float phi = 2.0f * 3.14159265f * u.y;
+	return glm::vec3(s * cosf(phi), y, s * sinf(phi));
+}
+
+// the closest-hit and miss shaders
+static void shade(const CPUScene& scene, const Hit& hit, const glm::vec3& direction, Payload& payload)
+{
+	if (hit.instance < 0)
+	{
+		// miss.rmiss
+		payload.color_dis = glm::vec4(sky_radiance(scene, direction), -1.0f);
+		payload.emission = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+		return;
+	}
+
+	if (hit.instance >= (int)scene.instances.size())
+	{
+		// closesthit_spheres.rchit, the normal matrix of a uniform scale keeps the direction from the center
+		glm::vec3 normal = glm::normalize(glm::vec3(hit.attribs)) * hit.attribs.w;
+		payload.color_dis = glm::vec4(scene.spheres.colors[hit.instance - (int)scene.instances.size()], hit.t);
+		payload.normal = glm::vec4(normal, 0.0f);
+		payload.emission = scene.spheres.emissions[hit.instance - (int)scene.instances.size()];
+		return;
+	}
+
+	const CPUInstance& inst = scene.instances[hit.instance];
+	glm::vec3 normal;
+	payload.emission = inst.emission;
+	if (inst.mesh != nullptr)
+	{
+		// closesthit_triangles.rchit
+		const Vertex* vertices = inst.mesh->vertices().data();
+		const unsigned* ind = inst.mesh->indices().data() + 3 * hit.primitive;
+		glm::vec3 barycentrics = glm::vec3(1.0f - hit.attribs.x - hit.attribs.y, hit.attribs.x, hit.attribs.y);
+		normal = vertices[ind[0]].Normal * barycentrics.x + vertices[ind[1]].Normal * barycentrics.y + vertices[ind[2]].Normal * barycentrics.z;
+		normal = glm::normalize(inst.normal_mat * normal);
+		if (inst.emission.w >= 0.0f) payload.emission.w = inst.emission.w + (float)hit.primitive;
+	}
+	else
+	{
+		// closesthit_spheres.rchit
+		normal = glm::normalize(inst.normal_mat * glm::vec3(hit.attribs)) * hit.attribs.w;
+	}
+	payload.color_dis = glm::vec4(inst.color, hit.t);
+	payload.normal = glm::vec4(normal, 0.0f);
+}
+
+// traceNV() with the hit groups and miss shader 0 of the pipeline
+static void trace_ray(const CPUScene& scene, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, Payload& payload)
+{
+	Hit hit;
+	intersect_ray(scene, origin, direction, tmin, tmax, hit);
+	shade(scene, hit, direction, payload);
+}
+
+// traceNV() of a shadow ray, with gl_RayFlagsTerminateOnFirstHitNV | gl_RayFlagsSkipClosestHitShaderNV
+// and miss shader 1: isShadowed stays true unless miss_shadow.rmiss runs
+static bool occluded(const CPUScene& scene, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax)
+{
+	Hit hit;
+	intersect_ray(scene, origin, direction, tmin, tmax, hit, true);
+	return hit.instance >= 0;
+}
+
+#define PACKET_TILE 8
+#define PACKET_RAYS (PACKET_TILE * PACKET_TILE)
+static_assert(PACKET_RAYS <= TRI_PACKET_RAYS, "a tile must fit in a TriRayPacket");
+
+// camera rays of a tile of pixels, traced together down to their first hit
+struct RayPacket
+{
+	int num_rays;
+	glm::vec3 origin; // common to all rays
+	glm::vec3 direction[PACKET_RAYS];
+	Hit hit[PACKET_RAYS];
+};
+
+// Interval bounds of the reciprocal directions of rays with a common origin. Per axis, every ray
+// enters a slab no earlier than the smaller endpoint product and leaves it no later than the larger
+// one, so a box no ray can enter is rejected with one test for the whole packet. Axes on which
+// the directions change sign or have infinite reciprocals are left out of the test.
+struct PacketFrustum
+{
+	glm::vec3 origin;
+	glm::vec3 inv_lo;
+	glm::vec3 inv_hi;
+	int sign[3];
+	bool use[3];
+	float tmin;
+};
+
+static void make_frustum(const glm::vec3& origin, const glm::vec3* direction, const int* rays, int num_rays, float tmin, PacketFrustum& f)
+{
+	f.origin = origin;
+	f.tmin = tmin;
+	for (int k = 0; k < 3; k++)
+	{
+		float lo = FLT_MAX;
+		float hi = -FLT_MAX;
+		bool neg = false;
+		bool pos = false;
+		for (int j = 0; j < num_rays; j++)
+		{
+			float inv = 1.0f / direction[rays[j]][k];
+			lo = inv < lo ? inv : lo;
+			hi = inv > hi ? inv : hi;
+			if (inv < 0.0f) neg = true;
+			else pos = true;
+		}
+		f.inv_lo[k] = lo;
+		f.inv_hi[k] = hi;
+		f.sign[k] = neg ? 1 : 0;
+		f.use[k] = !(neg && pos) && fabsf(lo) <= FLT_MAX && fabsf(hi) <= FLT_MAX;
+	}
+}
+
+// lower bound of the entry distances of the packet into child i of a wide node, FLT_MAX when no ray
+// of the packet enters it before tmax
+static inline float packet_enter(const PacketFrustum& f, const WideBVHNode& node, int i, float tmax)
+{
+	float enter = f.tmin;
+	float exit = tmax;
+	for (int k = 0; k < 3; k++)
+	{
+		if (!f.use[k]) continue;
+		float n = node.bounds[f.sign[k]][k][i] - f.origin[k];
+		float x = node.bounds[1 - f.sign[k]][k][i] - f.origin[k];
+		float n0 = n * f.inv_lo[k];
+		float n1 = n * f.inv_hi[k];
+		float x0 = x * f.inv_lo[k];
+		float x1 = x * f.inv_hi[k];
+		float near = n0 < n1 ? n0 : n1;
+		float far = x0 > x1 ? x0 : x1;
+		enter = near > enter ? near : enter;
+		exit = far < exit ? far : exit;
+	}
+	return enter <= exit ? enter : FLT_MAX;
+}
+
+// traverse_bvh() for a whole packet. leaf(node_index, node) returns the largest hit distance of the
+// packet after the leaf, entries behind it are dropped.
+template <class LeafFunc>
+static inline void traverse_packet(const BVH& bvh, const WideBVH& wide, const PacketFrustum& f, float tmax, LeafFunc leaf)
+{
+	if (wide.nodes().empty()) return;
+	const WideBVHNode* nodes = wide.nodes().data();
+	const BVHNode* leaves = bvh.nodes().data();
+
+	struct StackEntry
+	{
+		unsigned child;
+		float t;
+	};
+	StackEntry stack[WIDE_BVH_STACK_SIZE];
+	int sp = 0;
+	unsigned node = 0;
+	while (true)
+	{
+		int first = sp;
+		for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+		{
+			float t = packet_enter(f, nodes[node], i, tmax);
+			if (t == FLT_MAX) continue;
+			StackEntry e = { nodes[node].child[i], t };
+			int j = sp++;
+			while (j > first && stack[j - 1].t < e.t)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = e;
+		}
+
+		while (true)
+		{
+			if (sp == 0) return;
+			StackEntry e = stack[--sp];
+			if (e.t > tmax) continue;
+			if ((e.child & WIDE_BVH_LEAF) == 0)
+			{
+				node = e.child;
+				break;
+			}
+			unsigned index = e.child & ~WIDE_BVH_LEAF;
+			tmax = leaf(index, leaves[index]);
+		}
+	}
+}
+
+static inline float packet_tmax(const RayPacket& packet, const int* rays, int num_rays)
+{
+	float tmax = -FLT_MAX;
+	for (int j = 0; j < num_rays; j++)
+		tmax = packet.hit[rays[j]].t > tmax ? packet.hit[rays[j]].t : tmax;
+	return tmax;
+}
+
+// intersect_ray() for all rays of a packet: the packet walks the TLAS and the world space spheres as
+// a whole, and the BLAS of every instance with the rays that enter its object space bounds. Only
+// leaves are tested per ray.
+static void intersect_packet(const CPUScene& scene, float tmin, float tmax, RayPacket& packet)
+{
+	const std::vector<CPUInstance>& instances = scene.instances;
+	int all_rays[PACKET_RAYS];
+	for (int j = 0; j < packet.num_rays; j++)
+	{
+		packet.hit[j].instance = -1;
+		packet.hit[j].t = tmax;
+		all_rays[j] = j;
+	}
+
+	PacketFrustum frustum;
+	make_frustum(packet.origin, packet.direction, all_rays, packet.num_rays, tmin, frustum);
+
+	const unsigned* tlas_prims = scene.tlas.prim_indices().data();
+	traverse_packet(scene.tlas, scene.wide_tlas, frustum, tmax, [&](unsigned, const BVHNode& n)
+	{
+		for (unsigned k = 0; k < n.count; k++)
+		{
+			unsigned i = tlas_prims[n.offset + k];
+			const CPUInstance& inst = instances[i];
+			glm::vec3 o = glm::vec3(inst.world_to_object * glm::vec4(packet.origin, 1.0f));
+			glm::vec3 d[PACKET_RAYS];
+			int rays[PACKET_RAYS];
+			int num_rays = 0;
+			for (int j = 0; j < packet.num_rays; j++)
+			{
+				d[j] = glm::vec3(inst.world_to_object * glm::vec4(packet.direction[j], 0.0f));
+				if (intersect_bounds(inst.bounds_min, inst.bounds_max, o, d[j], tmin, packet.hit[j].t))
+					rays[num_rays++] = j;
+			}
+			if (num_rays == 0) continue;
+
+			if (inst.mesh == nullptr)
+			{
+				for (int j = 0; j < num_rays; j++)
+					intersect_sphere((int)i, o, d[rays[j]], tmin, packet.hit[rays[j]]);
+				continue;
+			}
+
+			// the rays in object space, SIMD across the rays in the leaves
+			TriRayPacket soa;
+			soa.origin = o;
+			soa.num_rays = num_rays;
+			for (int j = 0; j < num_rays; j++)
+			{
+				for (int k = 0; k < 3; k++)
+					soa.dir[k][j] = d[rays[j]][k];
+				soa.t[j] = packet.hit[rays[j]].t;
+			}
+			for (int j = num_rays; j < ((num_rays + TRI_PACKET_PAD - 1) & ~(TRI_PACKET_PAD - 1)); j++)
+			{
+				for (int k = 0; k < 3; k++)
+					soa.dir[k][j] = 0.0f;
+				soa.t[j] = -FLT_MAX;
+			}
+
+			const CPUGeometry& geometry = *inst.geometry;
+			const TriangleBlock* blocks = geometry.blocks.data();
+			const unsigned* leaf_blocks = geometry.leaf_blocks.data();
+			TriBlockIntersectPacket intersect = tri_kernels().intersect_packet;
+			PacketFrustum object_frustum;
+			make_frustum(o, d, rays, num_rays, tmin, object_frustum);
+			traverse_packet(geometry.bvh, geometry.wide, object_frustum, packet_tmax(packet, rays, num_rays), [&](unsigned node, const BVHNode& leaf)
+			{
+				unsigned first = leaf_blocks[node];
+				for (unsigned j = 0; j < leaf.count; j += TRI_BLOCK_SIZE)
+				{
+					int num_triangles = leaf.count - j < TRI_BLOCK_SIZE ? (int)(leaf.count - j) : TRI_BLOCK_SIZE;
+					intersect(blocks[first + j / TRI_BLOCK_SIZE], num_triangles, soa, tmin);
+				}
+				float tmax_soa = -FLT_MAX;
+				for (int j = 0; j < num_rays; j++)
+					tmax_soa = soa.t[j] > tmax_soa ? soa.t[j] : tmax_soa;
+				return tmax_soa;
+			});
+
+			for (int j = 0; j < num_rays; j++)
+			{
+				Hit& hit = packet.hit[rays[j]];
+				if (!(soa.t[j] < hit.t)) continue;
+				hit.instance = (int)i;
+				hit.primitive = soa.prim[j];
+				hit.t = soa.t[j];
+				hit.attribs = glm::vec4(soa.u[j], soa.v[j], 0.0f, 0.0f);
+			}
+		}
+		return packet_tmax(packet, all_rays, packet.num_rays);
+	});
+
+	const CPUSpheres& spheres = scene.spheres;
+	const SphereBlock* sphere_blocks = spheres.blocks.data();
+	const unsigned* sphere_leaf_blocks = spheres.leaf_blocks.data();
+	SphereBlockIntersect intersect_spheres = sphere_kernels().intersect;
+	traverse_packet(spheres.bvh, spheres.wide, frustum, packet_tmax(packet, all_rays, packet.num_rays), [&](unsigned node, const BVHNode& n)
+	{
+		unsigned first = sphere_leaf_blocks[node];
+		unsigned num_blocks = (n.count + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+		for (unsigned i = first; i < first + num_blocks; i++)
+			for (int j = 0; j < packet.num_rays; j++)
+				intersect_sphere_block(spheres, (int)instances.size(), sphere_blocks[i], intersect_spheres, packet.origin, packet.direction[j], tmin, packet.hit[j]);
+		return packet_tmax(packet, all_rays, packet.num_rays);
+	});
+}
+
+// the sampler state raygen.rgen starts every sample with
+static void begin_sample(PathSampler& sampler, unsigned sample_iter)
+{
+	sampler.sample_iter = sample_iter;
+	sampler.rcounter = glm::uvec4(sampler.ray_id, sample_iter, 0u, 0u);
+	sampler.sample_dim = 0;
+}
+
+// The pixel jitter, the first sample2() of every sample, of n independent xorwow samplers at once.
+// All of them draw the same two uniforms here, so the generators step in lockstep in SIMD lanes;
+// after the camera ray the paths consume different amounts and continue with the scalar generator.
+static void camera_jitter_lanes(PathSampler* samplers, int n, glm::vec2* jitter)
+{
+	const XorwowKernels& kernels = xorwow_kernels();
+	RNGState states[XORWOW_LANES];
+	RNGStateLanes lanes;
+	float u[2 * XORWOW_LANES];
+	for (int base = 0; base < n; base += XORWOW_LANES)
+	{
+		int count = n - base < XORWOW_LANES ? n - base : XORWOW_LANES;
+		for (int j = 0; j < count; j++)
+			states[j] = samplers[base + j].rstate;
+		rng_lanes_load(lanes, states, count);
+		kernels.uniforms(lanes, 2, u);
+		rng_lanes_store(lanes, states, count);
+		for (int j = 0; j < count; j++)
+		{
+			samplers[base + j].rstate = states[j];
+			jitter[base + j] = glm::vec2(u[j], u[XORWOW_LANES + j]);
+		}
+	}
+}
+
+// the camera ray of raygen.rgen for this sample
+static glm::vec3 camera_direction(const CPUTraceParams& params, int x, int y, const glm::vec2& jitter)
+{
+	float fx = (float)x + jitter.x;
+	float fy = (float)y + jitter.y;
+
+	glm::vec3 pos_pix = params.upper_left + fx * params.ux + fy * params.uy;
+	return glm::normalize(pos_pix - params.origin);
+}
+
+#define RAY_TMIN 0.0001f
+#define RAY_TMAX 10000.0f
+
+// a path of the wavefront and regeneration modes: the ray of its next segment and, after the extend
+// stage of the wavefront mode, its closest hit
+struct CPUPath
+{
+	glm::vec3 origin;
+	glm::vec3 direction;
+	glm::vec3 f_att;
+	glm::vec3 color;  // radiance, once the path has ended
+	int depth;        // segments traced so far
+	float bsdf_pdf;   // density of the bounce that started the current segment, for MIS with the sky and light samples
+	glm::vec3 normal; // normal at its origin
+	Hit hit;
+};
+
+// Scratch memory of one pool thread: the camera ray packet and path states of the block being traced
+// and the counters of the thread. Allocated with the tracer and reused by every tile, so that trace()
+// does not touch the heap. The traversal stacks are fixed arrays on the call stack.
+struct CPUWorker
+{
+	PathSampler samplers[PACKET_RAYS];
+	glm::vec3 colors[PACKET_RAYS];
+	glm::vec2 jitter[PACKET_RAYS];
+	int xs[PACKET_RAYS];
+	int ys[PACKET_RAYS];
+	RayPacket packet;
+	int samples[PACKET_RAYS];    // samples traced per pixel of the block
+	CPUPath paths[PACKET_RAYS];  // PathSchedule::Regeneration: the path in flight of every lane
+	unsigned long long segments;
+	unsigned long long camera_ns;
+	unsigned long long num_samples; // PathSchedule::Regeneration: samples traced, lanes of the passes over
+	unsigned long long lane_passes; // the blocks and the lanes tracing a segment in them
+	unsigned long long busy_lanes;
+	char pad[64]; // the counters of neighbouring workers stay on separate cache lines
+};
+
+#define WAVEFRONT_STATS_DEPTH 16
+
+// State of the wavefront mode. Every iteration starts one path per pixel, the paths of the pixels of a
+// PACKET_TILE x PACKET_TILE tile having consecutive slots. The live paths are listed by slot in two
+// queues: extend and shade read queues[depth & 1], shade compacts the paths that continue into the
+// other one.
+struct CPUWavefront
+{
+	std::vector<PathSampler> samplers;
+	std::vector<CPUPath> paths;
+	std::vector<unsigned> queues[2];
+	std::atomic<unsigned> queue_size[2];
+	unsigned long long live[WAVEFRONT_STATS_DEPTH]; // paths entering the extend stage per depth, summed over the iterations
+	double stage_ms[4];                              // generate, extend, shade, accumulate
+};
+
+// Pixels [x0, x1) x [y0, y1) of a tile of the wavefront mode, and the slot of its first path. The tiles
+// are in row-major order, and so are the pixels of a tile.
+static void wavefront_tile(int width, int height, size_t tile, int& x0, int& y0, int& x1, int& y1, unsigned& first_slot)
+{
+	int tiles_x = (width + PACKET_TILE - 1) / PACKET_TILE;
+	x0 = (int)(tile % tiles_x) * PACKET_TILE;
+	y0 = (int)(tile / tiles_x) * PACKET_TILE;
+	x1 = x0 + PACKET_TILE < width ? x0 + PACKET_TILE : width;
+	y1 = y0 + PACKET_TILE < height ? y0 + PACKET_TILE : height;
+	first_slot = (unsigned)(y0 * width + x0 * (y1 - y0));
+}
+
+// power heuristic weight of the strategy with density pdf_a against the one with pdf_b
+static inline float mis_power(float pdf_a, float pdf_b)
+{
+	float a = pdf_a * pdf_a;
+	return a / (a + pdf_b * pdf_b);
+}
+
+// sample_direct() of next_event.shinc: a sky sample and its shadow ray from a diffuse vertex,
+// weighted against the cosine-distributed bounce that may reach the same direction
+static glm::vec3 sample_direct(const CPUScene& scene, const glm::vec3& position, const glm::vec3& normal, PathSampler& sampler)
+{
+	glm::vec3 direction = sample_sky(scene, sampler.sample2());
+	float cos_theta = glm::dot(normal, direction);
+	if (cos_theta <= 0.0f) return glm::vec3(0.0f, 0.0f, 0.0f);
+	if (occluded(scene, position, direction, RAY_TMIN, RAY_TMAX)) return glm::vec3(0.0f, 0.0f, 0.0f);
+	float pdf_light = sky_pdf(scene, direction);
+	float pdf_bsdf = cos_theta / 3.14159265f;
+	return sky_radiance(scene, direction) * (pdf_bsdf / pdf_light * mis_power(pdf_light, pdf_bsdf));
+}
+
+// sample_lights() of next_event.shinc: a light of the light BVH and its shadow ray, stopping short of
+// the light. The uniforms are only drawn when the scene has emitters.
+static glm::vec3 sample_lights(const CPUScene& scene, const CPUTraceParams& params, const glm::vec3& position, const glm::vec3& normal, PathSampler& sampler)
+{
+	if (scene.lights->lights().size() == 0) return glm::vec3(0.0f, 0.0f, 0.0f);
+	float pmf;
+	int index = scene.lights->pick(position, normal, params.light_selection == LightSelection::Power, sampler.sample1(), pmf);
+	glm::vec2 u = sampler.sample2();
+	if (index < 0) return glm::vec3(0.0f, 0.0f, 0.0f);
+
+	const Light& light = scene.lights->lights()[index];
+	glm::vec3 direction;
+	float dist, pdf_point;
+	if (!light_sample_point(light, position, u, direction, dist, pdf_point)) return glm::vec3(0.0f, 0.0f, 0.0f);
+	float cos_theta = glm::dot(normal, direction);
+	if (cos_theta <= 0.0f) return glm::vec3(0.0f, 0.0f, 0.0f);
+	if (occluded(scene, position, direction, RAY_TMIN, dist * 0.999f)) return glm::vec3(0.0f, 0.0f, 0.0f);
+	float pdf_light = pmf * pdf_point;
+	float pdf_bsdf = cos_theta / 3.14159265f;
+	return light.emission * (pdf_bsdf / pdf_light * mis_power(pdf_light, pdf_bsdf));
+}
+
+// emitter_weight() of next_event.shinc: the MIS weight of the bounce that hit a light at distance t
+static float emitter_weight(const CPUScene& scene, const CPUTraceParams& params, const CPUPath& path, float t, int index)
+{
+	if (index < 0) return 1.0f;
+	bool power_only = params.light_selection == LightSelection::Power;
+	float pdf_light = scene.lights->pick_pmf(path.origin, path.normal, power_only, (unsigned)index) * light_pdf_point(scene.lights->lights()[index], path.origin, path.direction, t);
+	return mis_power(path.bsdf_pdf, pdf_light);
+}
+
+// The rest of a loop iteration of trace_path() in raygen.rgen once the segment ending at path.depth
+// has been traced. Returns false when the path ends, the radiance it gathered then being in
+// path.color. Otherwise path.origin and path.direction are the next segment.
+static bool continue_path(const CPUScene& scene, const CPUTraceParams& params, const Payload& payload, CPUPath& path, PathSampler& sampler)
+{
+	float t = payload.color_dis.w;
+	if (t <= 0.0f)
+	{
+		// with next-event estimation, a bounce reaching the sky shares it with the sky sample of the vertex it left
+		float w = params.next_event && path.depth > 1 ? mis_power(path.bsdf_pdf, sky_pdf(scene, path.direction)) : 1.0f;
+		path.color += glm::vec3(payload.color_dis) * path.f_att * w;
+		return false;
+	}
+
+	glm::vec3 emission = glm::vec3(payload.emission);
+	if (emission.x > 0.0f || emission.y > 0.0f || emission.z > 0.0f)
+	{
+		// likewise a bounce reaching an emitter with the light sample
+		float w = params.next_event && path.depth > 1 ? emitter_weight(scene, params, path, t, (int)payload.emission.w) : 1.0f;
+		path.color += emission * path.f_att * w;
+	}
+
+	path.origin += path.direction*t;
+	path.f_att *= glm::vec3(payload.color_dis);
+	glm::vec3 normal = glm::vec3(payload.normal);
+
+	if (params.next_event && path.depth < params.max_depth)
+	{
+		path.color += path.f_att * sample_direct(scene, path.origin, normal, sampler);
+		path.color += path.f_att * sample_lights(scene, params, path.origin, normal, sampler);
+	}
+
+	if (path.depth >= params.min_depth)
+	{
+		float p = fminf(fmaxf(path.f_att.x, fmaxf(path.f_att.y, path.f_att.z)), 0.95f);
+		if (sampler.sample1() >= p) return false;
+		path.f_att /= p;
+	}
+
+	path.direction = sampler.sample_lambertian(normal);
+	path.bsdf_pdf = fmaxf(glm::dot(normal, path.direction), 0.0f) / 3.14159265f;
+	path.normal = normal;
+	return true;
+}
+
+// trace_path() of raygen.rgen, continuing from the already intersected camera ray
+static glm::vec3 trace_path(const CPUScene& scene, const CPUTraceParams& params, glm::vec3 direction, const Hit& camera_hit, PathSampler& sampler, unsigned long long& segments)
+{
+	CPUPath path;
+	path.origin = params.origin;
+	path.direction = direction;
+	path.f_att = glm::vec3(1.0f, 1.0f, 1.0f);
+	path.color = glm::vec3(0.0f, 0.0f, 0.0f);
+	path.depth = 0;
+	Payload payload;
+	while (path.depth < params.max_depth)
+	{
+		sampler.rcounter.z = (unsigned)(path.depth + 1);
+		sampler.rcounter.w = 0;
+
+		if (path.depth == 0)
+			shade(scene, camera_hit, path.direction, payload);
+		else
+			trace_ray(scene, path.origin, path.direction, RAY_TMIN, RAY_TMAX, payload);
+		path.depth++;
+
+		if (!continue_path(scene, params, payload, path, sampler)) break;
+	}
+	segments += path.depth;
+	return path.color;
+}
+
+// FNV-1a over the vertex and index data, to find meshes that share a geometry
+static unsigned long long hash_mesh(const TriangleMesh& mesh)
+{
+	unsigned long long h = 14695981039346656037ull;
+	const unsigned char* data[2] = { (const unsigned char*)mesh.vertices().data(), (const unsigned char*)mesh.indices().data() };
+	size_t size[2] = { mesh.vertices().size() * sizeof(Vertex), mesh.indices().size() * sizeof(unsigned) };
+	for (int k = 0; k < 2; k++)
+	{
+		for (size_t i = 0; i < size[k]; i++)
+		{
+			h ^= data[k][i];
+			h *= 1099511628211ull;
+		}
+		h ^= size[k];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static bool same_mesh(const TriangleMesh& a, const TriangleMesh& b)
+{
+	if (a.vertices().size() != b.vertices().size() || a.indices().size() != b.indices().size()) return false;
+	return memcmp(a.vertices().data(), b.vertices().data(), a.vertices().size() * sizeof(Vertex)) == 0 &&
+		memcmp(a.indices().data(), b.indices().data(), a.indices().size() * sizeof(unsigned)) == 0;
+}
+
+// SoA copies of the triangles of every leaf, in the order of prim_indices()
+static void build_blocks(const TriangleMesh& mesh, CPUGeometry& geometry)
+{
+	const Vertex* vertices = mesh.vertices().data();
+	const unsigned* indices = mesh.indices().data();
+	const std::vector<BVHNode>& nodes = geometry.bvh.nodes();
+	const unsigned* prims = geometry.bvh.prim_indices().data();
+	geometry.leaf_blocks.assign(nodes.size(), 0);
+	geometry.blocks.clear();
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].count == 0) continue;
+		geometry.leaf_blocks[i] = (unsigned)geometry.blocks.size();
+		for (unsigned j = 0; j < nodes[i].count; j++)
+		{
+			if (j % TRI_BLOCK_SIZE == 0)
+			{
+				geometry.blocks.push_back(TriangleBlock());
+				tri_block_clear(geometry.blocks.back());
+			}
+			unsigned prim = prims[nodes[i].offset + j];
+			const unsigned* ind = indices + 3 * prim;
+			tri_block_set(geometry.blocks.back(), j % TRI_BLOCK_SIZE, vertices[ind[0]].Position, vertices[ind[1]].Position, vertices[ind[2]].Position, prim);
+		}
+	}
+}
+
+// world space box around the 8 transformed corners of an object space box
+static AABB world_bounds(const glm::mat4x4& model, const glm::vec3& bmin, const glm::vec3& bmax)
+{
+	AABB box;
+	box.bounds_min = glm::vec3(FLT_MAX);
+	box.bounds_max = glm::vec3(-FLT_MAX);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = glm::vec3((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 4) ? bmax.z : bmin.z);
+		glm::vec3 p = glm::vec3(model * glm::vec4(corner, 1.0f));
+		box.bounds_min = glm::min(box.bounds_min, p);
+		box.bounds_max = glm::max(box.bounds_max, p);
+	}
+	return box;
+}
+
+// SoA copies of the spheres of every leaf, in the order of prim_indices()
+static void build_sphere_blocks(const std::vector<float>& radii, CPUSpheres& spheres)
+{
+	const std::vector<BVHNode>& nodes = spheres.bvh.nodes();
+	const unsigned* prims = spheres.bvh.prim_indices().data();
+	spheres.leaf_blocks.assign(nodes.size(), 0);
+	spheres.blocks.clear();
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].count == 0) continue;
+		spheres.leaf_blocks[i] = (unsigned)spheres.blocks.size();
+		for (unsigned j = 0; j < nodes[i].count; j++)
+		{
+			if (j % SPHERE_BLOCK_SIZE == 0)
+			{
+				spheres.blocks.push_back(SphereBlock());
+				sphere_block_clear(spheres.blocks.back());
+			}
+			unsigned prim = prims[nodes[i].offset + j];
+			sphere_block_set(spheres.blocks.back(), j % SPHERE_BLOCK_SIZE, spheres.centers[prim], radii[prim], prim);
+		}
+	}
+}
+
+CPUTracer::CPUTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres, const LightBVH* lights, const PathTracerOptions& options)
+{
+	m_options = options;
+	m_target = target;
+	m_avg_path_length = 0.0f;
+	m_avg_samples = 0.0f;
+	m_scene.environment = nullptr;
+	m_scene.lights = lights;
+
+	// one BVH per unique geometry, meshes with the same vertices and indices share it
+	std::vector<int> geometry_of_mesh(triangle_meshes.size());
+	std::vector<const TriangleMesh*> geometries;
+	std::unordered_map<unsigned long long, std::vector<int>> geometry_buckets;
+	for (size_t i = 0; i < triangle_meshes.size(); i++)
+	{
+		const TriangleMesh* mesh = triangle_meshes[i];
+		std::vector<int>& bucket = geometry_buckets[hash_mesh(*mesh)];
+		int geometry = -1;
+		for (size_t j = 0; j < bucket.size() && geometry < 0; j++)
+			if (same_mesh(*geometries[bucket[j]], *mesh)) geometry = bucket[j];
+		if (geometry < 0)
+		{
+			geometry = (int)geometries.size();
+			geometries.push_back(mesh);
+			bucket.push_back(geometry);
+		}
+		geometry_of_mesh[i] = geometry;
+	}
+
+	m_scene.geometries.resize(geometries.size());
+	unsigned long long total_triangles = 0;
+	double total_ms = 0.0;
+	size_t total_bytes = 0;
+	for (size_t i = 0; i < geometries.size(); i++)
+	{
+		CPUGeometry& geometry = m_scene.geometries[i];
+		geometry.bvh.build_triangles(geometries[i]->vertices().data(), geometries[i]->indices().data(), (unsigned)geometries[i]->indices().size() / 3);
+		geometry.wide.build(geometry.bvh);
+		build_blocks(*geometries[i], geometry);
+		total_triangles += geometry.bvh.stats().num_prims;
+		total_ms += geometry.bvh.stats().build_ms;
+		total_bytes += geometry.bvh.nodes().size() * sizeof(BVHNode) + geometry.wide.nodes().size() * sizeof(WideBVHNode) + geometry.blocks.size() * sizeof(TriangleBlock) + geometry.leaf_blocks.size() * sizeof(unsigned);
+	}
+
+	std::vector<AABB> instance_bounds;
+	for (size_t i = 0; i < triangle_meshes.size(); i++)
+	{
+		const TriangleMesh* mesh = triangle_meshes[i];
+		const CPUGeometry& geometry = m_scene.geometries[geometry_of_mesh[i]];
+		if (geometry.bvh.nodes().size() == 0) continue;
+
+		CPUInstance inst;
+		inst.world_to_object = glm::inverse(mesh->model());
+		inst.normal_mat = glm::mat3x3(mesh->norm());
+		inst.color = mesh->color();
+		inst.emission = glm::vec4(mesh->emission(), (float)lights->mesh_first_light(i));
+		inst.mesh = geometries[geometry_of_mesh[i]];
+		inst.geometry = &geometry;
+		inst.bounds_min = geometry.bvh.nodes()[0].bounds_min;
+		inst.bounds_max = geometry.bvh.nodes()[0].bounds_max;
+		m_scene.instances.push_back(inst);
+		instance_bounds.push_back(world_bounds(mesh->model(), inst.bounds_min, inst.bounds_max));
+	}
+
+	// spheres that stay spheres in world space go to their own BVH, the others are TLAS instances
+	CPUSpheres& world_spheres = m_scene.spheres;
+	std::vector<AABB> sphere_bounds;
+	std::vector<float> radii;
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		glm::vec3 center;
+		float radius;
+		if (uniform_sphere(spheres[i]->model(), center, radius))
+		{
+			AABB box = { center - glm::vec3(radius), center + glm::vec3(radius) };
+			sphere_bounds.push_back(box);
+			radii.push_back(radius);
+			world_spheres.centers.push_back(center);
+			world_spheres.colors.push_back(spheres[i]->color());
+			world_spheres.emissions.push_back(glm::vec4(spheres[i]->emission(), (float)lights->sphere_light(i)));
+			continue;
+		}
+
+		CPUInstance inst;
+		inst.world_to_object = glm::inverse(spheres[i]->model());
+		inst.normal_mat = glm::mat3x3(spheres[i]->norm());
+		inst.color = spheres[i]->color();
+		inst.emission = glm::vec4(spheres[i]->emission(), (float)lights->sphere_light(i));
+		inst.mesh = nullptr;
+		inst.geometry = nullptr;
+		inst.bounds_min = glm::vec3(-1.0f);
+		inst.bounds_max = glm::vec3(1.0f);
+		m_scene.instances.push_back(inst);
+		instance_bounds.push_back(world_bounds(spheres[i]->model(), inst.bounds_min, inst.bounds_max));
+	}
+
+	m_scene.tlas.build(instance_bounds.data(), (unsigned)instance_bounds.size());
+	m_scene.wide_tlas.build(m_scene.tlas);
+
+	world_spheres.bvh.build(sphere_bounds.data(), (unsigned)sphere_bounds.size(), SPHERE_BLOCK_SIZE);
+	world_spheres.wide.build(world_spheres.bvh);
+	build_sphere_blocks(radii, world_spheres);
+
+	if (m_options.verbose)
+	{
+		if (geometries.size() > 0)
+			printf("BLAS: %u meshes, %u unique, %llu triangles, %.1f KB, built in %.2f ms, %s triangle kernel, %s node kernel\n", (unsigned)triangle_meshes.size(), (unsigned)geometries.size(), total_triangles, (double)total_bytes / 1024.0, total_ms, tri_kernels().isa, wide_node_kernels().isa);
+		m_scene.tlas.print_stats("TLAS");
+	}
+	if (m_options.verbose && sphere_bounds.size() > 0)
+	{
+		size_t sphere_bytes = world_spheres.bvh.nodes().size() * sizeof(BVHNode) + world_spheres.wide.nodes().size() * sizeof(WideBVHNode) + world_spheres.blocks.size() * sizeof(SphereBlock) + world_spheres.leaf_blocks.size() * sizeof(unsigned);
+		printf("world space spheres: %u of %u, %u blocks (%.1f spheres per block), %.1f KB, %s sphere kernel\n", (unsigned)sphere_bounds.size(), (unsigned)spheres.size(),
+			(unsigned)world_spheres.blocks.size(), (double)sphere_bounds.size() / (double)world_spheres.blocks.size(), (double)sphere_bytes / 1024.0, sphere_kernels().isa);
+		world_spheres.bvh.print_stats("spheres");
+	}
+
+	if (m_options.rand_mode == RandMode::XorWow)
+		m_rand_states.resize((size_t)m_target->width() * m_target->height());
+	sobol_directions_2d(m_sobol_dirs);
+
+	// everything trace() writes to is allocated here
+	m_target->host_data();
+	unsigned num_threads = ThreadPool::get_pool().num_threads();
+	m_workers = new CPUWorker[num_threads];
+	m_wavefront = nullptr;
+	if (m_options.path_schedule == PathSchedule::Wavefront)
+	{
+		size_t num_paths = (size_t)m_target->width() * m_target->height();
+		m_wavefront = new CPUWavefront;
+		m_wavefront->samplers.resize(num_paths);
+		m_wavefront->paths.resize(num_paths);
+		m_wavefront->queues[0].resize(num_paths);
+		m_wavefront->queues[1].resize(num_paths);
+	}
+	m_thread_stats.reserve(num_threads);
+	m_pass_stats.reserve(num_threads);
+}
+
+CPUTracer::~CPUTracer()
+{
+	delete m_wavefront;
+	delete[] m_workers;
+}
+
+// PathSchedule::Regeneration, regen.rgen over the n pixels of a block, its lanes taking the place of a
+// subgroup: every pass traces one segment of the path of each lane, and a lane whose path has ended
+// starts the next sample of its pixel while a lane of the block has started fewer than
+// iter_end - iter_begin samples. Samples are numbered per pixel from the count in its alpha channel.
+// The camera rays of the samples started in a pass are intersected first, as one packet when all lanes
+// start together. worker.colors and worker.samples get the sum and number of the samples per pixel,
+// whose ratio has the O(1/samples) bias described in regen.rgen.
+void CPUTracer::_regenerate_block(const CPUTraceParams& params, int n, int iter_begin, int iter_end, CPUWorker& worker)
+{
+	const float* pixels = m_target->host_data();
+	int quota = iter_end - iter_begin;
+	PathSampler* samplers = worker.samplers;
+	CPUPath* paths = worker.paths;
+	int* samples = worker.samples;
+	RayPacket& packet = worker.packet;
+
+	unsigned first_sample[PACKET_RAYS];
+	bool alive[PACKET_RAYS];
+	int started[PACKET_RAYS];
+	for (int j = 0; j < n; j++)
+	{
+		first_sample[j] = iter_begin > 0 ? (unsigned)pixels[4 * (size_t)samplers[j].ray_id + 3] : 0u;
+		samples[j] = 0;
+		alive[j] = false;
+	}
+
+	std::chrono::steady_clock::duration camera_time(0);
+	Payload payload;
+	while (true)
+	{
+		bool need = false;
+		for (int j = 0; j < n; j++)
+			need = need || samples[j] < quota;
+		int num_started = 0;
+		for (int j = 0; j < n && need; j++)
+			if (!alive[j]) started[num_started++] = j;
+
+		if (num_started > 0)
+		{
+			for (int k = 0; k < num_started; k++)
+			{
+				int j = started[k];
+				begin_sample(samplers[j], first_sample[j] + (unsigned)samples[j]);
+				samples[j]++;
+			}
+			if (num_started == n && m_options.rand_mode == RandMode::XorWow && m_options.sampler == Sampler::Independent)
+				camera_jitter_lanes(samplers, n, worker.jitter);
+			else
+				for (int k = 0; k < num_started; k++)
+					worker.jitter[started[k]] = samplers[started[k]].sample2();
+			for (int k = 0; k < num_started; k++)
+			{
+				int j = started[k];
+				CPUPath& path = paths[j];
+				path.origin = params.origin;
+				path.direction = camera_direction(params, worker.xs[j], worker.ys[j], worker.jitter[j]);
+				path.f_att = glm::vec3(1.0f, 1.0f, 1.0f);
+				path.color = glm::vec3(0.0f, 0.0f, 0.0f);
+				path.depth = 0;
+				packet.direction[j] = path.direction;
+				alive[j] = true;
+			}
+
+			auto c0 = std::chrono::steady_clock::now();
+			if (num_started == n && m_options.cpu_packets)
+				intersect_packet(m_scene, RAY_TMIN, RAY_TMAX, packet);
+			else
+				for (int k = 0; k < num_started; k++)
+					intersect_ray(m_scene, packet.origin, packet.direction[started[k]], RAY_TMIN, RAY_TMAX, packet.hit[started[k]]);
+			camera_time += std::chrono::steady_clock::now() - c0;
+		}
+
+		int busy = 0;
+		for (int j = 0; j < n; j++)
+		{
+			if (!alive[j]) continue;
+			busy++;
+
+			CPUPath& path = paths[j];
+			PathSampler& sampler = samplers[j];
+			sampler.rcounter.z = (unsigned)(path.depth + 1);
+			sampler.rcounter.w = 0;
+
+			if (path.depth == 0)
+				shade(m_scene, packet.hit[j], path.direction, payload);
+			else
+				trace_ray(m_scene, path.origin, path.direction, RAY_TMIN, RAY_TMAX, payload);
+			path.depth++;
+
+			alive[j] = continue_path(m_scene, params, payload, path, sampler) && path.depth < params.max_depth;
+			if (!alive[j])
+			{
+				worker.colors[j] += path.color;
+				worker.segments += path.depth;
+			}
+		}
+		if (busy == 0) break;
+		worker.lane_passes += n;
+		worker.busy_lanes += busy;
+	}
+
+	for (int j = 0; j < n; j++)
+		worker.num_samples += samples[j];
+	worker.camera_ns += (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(camera_time).count();
+}
+
+// Traces iterations [iter_begin, iter_end) of the pixels of a tile, PACKET_TILE x PACKET_TILE at a time:
+// per iteration the camera rays are intersected first, as one packet or one by one, then every path
+// continues on its own. The pixels hold the sum and the number of the samples until the last iteration.
+void CPUTracer::_trace_tile(const CPUTraceParams& params, int x0, int y0, int tile_size, int iter_begin, int iter_end, CPUWorker& worker)
+{
+	int width = m_target->width();
+	int height = m_target->height();
+	int x1 = x0 + tile_size < width ? x0 + tile_size : width;
+	int y1 = y0 + tile_size < height ? y0 + tile_size : height;
+	float* pixels = m_target->host_data();
+
+	PathSampler* samplers = worker.samplers;
+	glm::vec3* colors = worker.colors;
+	glm::vec2* jitter = worker.jitter;
+	int* xs = worker.xs;
+	int* ys = worker.ys;
+	RayPacket& packet = worker.packet;
+	packet.origin = params.origin;
+
+	std::chrono::steady_clock::duration camera_time(0);
+	for (int by = y0; by < y1; by += PACKET_TILE)
+		for (int bx = x0; bx < x1; bx += PACKET_TILE)
+		{
+			int n = 0;
+			for (int y = by; y < by + PACKET_TILE && y < y1; y++)
+				for (int x = bx; x < bx + PACKET_TILE && x < x1; x++, n++)
+				{
+					xs[n] = x;
+					ys[n] = y;
+					PathSampler& sampler = samplers[n];
+					sampler.rand_mode = m_options.rand_mode;
+					sampler.sampler = m_options.sampler;
+					sampler.sobol_dirs = m_sobol_dirs;
+					sampler.ray_id = (unsigned)(x + y * width);
+					if (m_options.rand_mode == RandMode::XorWow) sampler.rstate = m_rand_states[sampler.ray_id];
+					colors[n] = glm::vec3(0.0f, 0.0f, 0.0f);
+				}
+			packet.num_rays = n;
+
+			if (m_options.path_schedule == PathSchedule::Regeneration)
+				_regenerate_block(params, n, iter_begin, iter_end, worker);
+			else
+			{
+				for (int i = iter_begin; i < iter_end; i++)
+				{
+					for (int j = 0; j < n; j++)
+						begin_sample(samplers[j], (unsigned)i);
+					if (m_options.rand_mode == RandMode::XorWow && m_options.sampler == Sampler::Independent)
+						camera_jitter_lanes(samplers, n, jitter);
+					else
+						for (int j = 0; j < n; j++)
+							jitter[j] = samplers[j].sample2();
+					for (int j = 0; j < n; j++)
+						packet.direction[j] = camera_direction(params, xs[j], ys[j], jitter[j]);
+
+					auto c0 = std::chrono::steady_clock::now();
+					if (m_options.cpu_packets)
+						intersect_packet(m_scene, RAY_TMIN, RAY_TMAX, packet);
+					else
+						for (int j = 0; j < n; j++)
+							intersect_ray(m_scene, packet.origin, packet.direction[j], RAY_TMIN, RAY_TMAX, packet.hit[j]);
+					camera_time += std::chrono::steady_clock::now() - c0;
+
+					for (int j = 0; j < n; j++)
+						colors[j] += trace_path(m_scene, params, packet.direction[j], packet.hit[j], samplers[j], worker.segments);
+				}
+				for (int j = 0; j < n; j++)
+					worker.samples[j] = iter_end - iter_begin;
+			}
+
+			for (int j = 0; j < n; j++)
+			{
+				if (m_options.rand_mode == RandMode::XorWow) m_rand_states[samplers[j].ray_id] = samplers[j].rstate;
+
+				// final.comp, the alpha channel counts the samples until then
+				float* pix = pixels + 4 * (size_t)samplers[j].ray_id;
+				glm::vec3 color = colors[j];
+				float count = (float)worker.samples[j];
+				if (iter_begin > 0)
+				{
+					color = glm::vec3(pix[0], pix[1], pix[2]) + color;
+					count += pix[3];
+				}
+				if (iter_end == params.num_iter)
+				{
+					color = color * (1.0f / count);
+					count = 1.0f;
+				}
+				pix[0] = color.x;
+				pix[1] = color.y;
+				pix[2] = color.z;
+				pix[3] = count;
+			}
+		}
+	worker.camera_ns += (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(camera_time).count();
+}
+
+// One iteration in wavefront order. generate: the camera rays of all pixels. Then per depth, extend:
+// the closest hits of the live paths, and shade: the closest-hit/miss shaders and the rest of the
+// path loop, the paths that continue being compacted into the queue of the next depth. accumulate:
+// the radiance of every path is added to its pixel.
+void CPUTracer::_trace_wavefront(const CPUTraceParams& params, int iter)
+{
+	CPUWavefront& wf = *m_wavefront;
+	ThreadPool& pool = ThreadPool::get_pool();
+	int width = m_target->width();
+	int height = m_target->height();
+	unsigned num_paths = (unsigned)width * height;
+	size_t num_tiles = (size_t)((width + PACKET_TILE - 1) / PACKET_TILE) * ((height + PACKET_TILE - 1) / PACKET_TILE);
+	bool jitter_lanes = m_options.rand_mode == RandMode::XorWow && m_options.sampler == Sampler::Independent;
+	float* pixels = m_target->host_data();
+
+	auto t0 = std::chrono::steady_clock::now();
+	pool.parallel_for(num_tiles, 1, [&](size_t begin, size_t end, unsigned thread_id)
+	{
+		glm::vec2* jitter = m_workers[thread_id].jitter;
+		for (size_t tile = begin; tile < end; tile++)
+		{
+			int x0, y0, x1, y1;
+			unsigned first;
+			wavefront_tile(width, height, tile, x0, y0, x1, y1, first);
+			PathSampler* samplers = wf.samplers.data() + first;
+			int n = 0;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++, n++)
+				{
+					PathSampler& sampler = samplers[n];
+					sampler.rand_mode = m_options.rand_mode;
+					sampler.sampler = m_options.sampler;
+					sampler.sobol_dirs = m_sobol_dirs;
+					sampler.ray_id = (unsigned)(x + y * width);
+					if (m_options.rand_mode == RandMode::XorWow) sampler.rstate = m_rand_states[sampler.ray_id];
+					begin_sample(sampler, (unsigned)iter);
+				}
+			if (jitter_lanes)
+				camera_jitter_lanes(samplers, n, jitter);
+			else
+				for (int j = 0; j < n; j++)
+					jitter[j] = samplers[j].sample2();
+
+			n = 0;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++, n++)
+				{
+					CPUPath& path = wf.paths[first + n];
+					path.origin = params.origin;
+					path.direction = camera_direction(params, x, y, jitter[n]);
+					path.f_att = glm::vec3(1.0f, 1.0f, 1.0f);
+					path.color = glm::vec3(0.0f, 0.0f, 0.0f);
+					path.depth = 0;
+					wf.queues[0][first + n] = first + n;
+				}
+		}
+	});
+	wf.queue_size[0] = num_paths;
+	auto t1 = std::chrono::steady_clock::now();
+	wf.stage_ms[0] += std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+	for (int depth = 0; depth < params.max_depth; depth++)
+	{
+		const unsigned* in = wf.queues[depth & 1].data();
+		unsigned* out = wf.queues[(depth & 1) ^ 1].data();
+		std::atomic<unsigned>& out_size = wf.queue_size[(depth & 1) ^ 1];
+		unsigned count = wf.queue_size[depth & 1];
+		if (count == 0) break;
+		if (depth < WAVEFRONT_STATS_DEPTH) wf.live[depth] += count;
+		out_size = 0;
+
+		// the queue of depth 0 lists the paths tile by tile, the camera rays of a tile are one packet
+		if (depth == 0)
+			pool.parallel_for(num_tiles, 1, [&](size_t begin, size_t end, unsigned thread_id)
+			{
+				CPUWorker& worker = m_workers[thread_id];
+				RayPacket& packet = worker.packet;
+				auto c0 = std::chrono::steady_clock::now();
+				for (size_t tile = begin; tile < end; tile++)
+				{
+					int x0, y0, x1, y1;
+					unsigned first;
+					wavefront_tile(width, height, tile, x0, y0, x1, y1, first);
+					int n = (x1 - x0) * (y1 - y0);
+					CPUPath* paths = wf.paths.data() + first;
+					if (m_options.cpu_packets)
+					{
+						packet.origin = params.origin;
+						packet.num_rays = n;
+						for (int j = 0; j < n; j++)
+							packet.direction[j] = paths[j].direction;
+						intersect_packet(m_scene, RAY_TMIN, RAY_TMAX, packet);
+						for (int j = 0; j < n; j++)
+							paths[j].hit = packet.hit[j];
+					}
+					else
+						for (int j = 0; j < n; j++)
+							intersect_ray(m_scene, paths[j].origin, paths[j].direction, RAY_TMIN, RAY_TMAX, paths[j].hit);
+				}
+				worker.camera_ns += (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - c0).count();
+			});
+		else
+			pool.parallel_for(count, PACKET_RAYS, [&](size_t begin, size_t end, unsigned)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					CPUPath& path = wf.paths[in[i]];
+					intersect_ray(m_scene, path.origin, path.direction, RAY_TMIN, RAY_TMAX, path.hit);
+				}
+			});
+		auto t2 = std::chrono::steady_clock::now();
+
+		// the survivors of a chunk go to the output queue with one atomic add
+		pool.parallel_for(count, PACKET_RAYS, [&](size_t begin, size_t end, unsigned)
+		{
+			unsigned survivors[PACKET_RAYS];
+			unsigned num_survivors = 0;
+			for (size_t i = begin; i < end; i++)
+			{
+				unsigned slot = in[i];
+				CPUPath& path = wf.paths[slot];
+				PathSampler& sampler = wf.samplers[slot];
+				sampler.rcounter.z = (unsigned)(path.depth + 1);
+				sampler.rcounter.w = 0;
+
+				Payload payload;
+				shade(m_scene, path.hit, path.direction, payload);
+				path.depth++;
+				if (continue_path(m_scene, params, payload, path, sampler) && path.depth < params.max_depth)
+					survivors[num_survivors++] = slot;
+			}
+			if (num_survivors > 0)
+			{
+				unsigned at = out_size.fetch_add(num_survivors);
+				memcpy(out + at, survivors, num_survivors * sizeof(unsigned));
+			}
+		});
+		auto t3 = std::chrono::steady_clock::now();
+		wf.stage_ms[1] += std::chrono::duration<double, std::milli>(t2 - t1).count();
+		wf.stage_ms[2] += std::chrono::duration<double, std::milli>(t3 - t2).count();
+		t1 = t3;
+	}
+
+	pool.parallel_for(num_paths, 1024, [&](size_t begin, size_t end, unsigned thread_id)
+	{
+		CPUWorker& worker = m_workers[thread_id];
+		for (size_t slot = begin; slot < end; slot++)
+		{
+			const CPUPath& path = wf.paths[slot];
+			const PathSampler& sampler = wf.samplers[slot];
+			if (m_options.rand_mode == RandMode::XorWow) m_rand_states[sampler.ray_id] = sampler.rstate;
+			worker.segments += path.depth;
+
+			// final.comp after the last iteration
+			float* pix = pixels + 4 * (size_t)sampler.ray_id;
+			glm::vec3 color = path.color;
+			if (iter > 0) color = glm::vec3(pix[0], pix[1], pix[2]) + color;
+			if (iter == params.num_iter - 1) color = color * (1.0f / (float)params.num_iter);
+			pix[0] = color.x;
+			pix[1] = color.y;
+			pix[2] = color.z;
+			pix[3] = 1.0f;
+		}
+	});
+	wf.stage_ms[3] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+}
+
+void CPUTracer::trace(const CPUTraceParams& params)
+{
+	auto t0 = std::chrono::steady_clock::now();
+#ifdef COUNT_ALLOCATIONS
+	unsigned long long allocations = heap_allocations();
+#endif
+	m_scene.environment = params.environment;
+
+	int width = m_target->width();
+	int height = m_target->height();
+	int tile_size = m_options.cpu_tile_size > 0 ? m_options.cpu_tile_size : PACKET_TILE;
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	size_t num_tiles = (size_t)tiles_x * tiles_y;
+
+	ThreadPool& pool = ThreadPool::get_pool();
+	unsigned num_threads = pool.num_threads();
+	std::vector<ThreadWorkStats>& stats = m_thread_stats;
+	stats.assign(num_threads, ThreadWorkStats());
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		m_workers[i].segments = 0;
+		m_workers[i].camera_ns = 0;
+		m_workers[i].num_samples = 0;
+		m_workers[i].lane_passes = 0;
+		m_workers[i].busy_lanes = 0;
+	}
+
+	// the tiles are stolen between threads as path lengths, and so their cost, vary a lot; in
+	// iteration-major order every iteration is one pass over the tiles
+	auto pass = [&](int iter_begin, int iter_end)
+	{
+		pool.parallel_for_stealing(num_tiles, [&](size_t tile, unsigned thread_id)
+		{
+			int x0 = (int)(tile % tiles_x) * tile_size;
+			int y0 = (int)(tile / tiles_x) * tile_size;
+			_trace_tile(params, x0, y0, tile_size, iter_begin, iter_end, m_workers[thread_id]);
+		}, &m_pass_stats);
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			stats[i].busy_ms += m_pass_stats[i].busy_ms;
+			stats[i].items += m_pass_stats[i].items;
+			stats[i].steals += m_pass_stats[i].steals;
+		}
+	};
+	if (m_wavefront != nullptr)
+	{
+		memset(m_wavefront->live, 0, sizeof(m_wavefront->live));
+		memset(m_wavefront->stage_ms, 0, sizeof(m_wavefront->stage_ms));
+		for (int i = 0; i < params.num_iter; i++)
+			_trace_wavefront(params, i);
+	}
+	else if (m_options.cpu_tile_order == TileOrder::TileMajor)
+		pass(0, params.num_iter);
+	else
+		for (int i = 0; i < params.num_iter; i++)
+			pass(i, i + 1);
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+#ifdef COUNT_ALLOCATIONS
+	allocations = heap_allocations() - allocations;
+#endif
+	unsigned long long total_segments = 0;
+	unsigned long long total_camera_ns = 0;
+	unsigned long long total_samples = 0, lane_passes = 0, busy_lanes = 0;
+	unsigned total_steals = 0;
+	double util_min = 100.0, util_max = 0.0, util_sum = 0.0;
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		total_segments += m_workers[i].segments;
+		total_camera_ns += m_workers[i].camera_ns;
+		total_samples += m_workers[i].num_samples;
+		lane_passes += m_workers[i].lane_passes;
+		busy_lanes += m_workers[i].busy_lanes;
+		total_steals += stats[i].steals;
+		double util = 100.0 * stats[i].busy_ms / ms;
+		util_min = util < util_min ? util : util_min;
+		util_max = util > util_max ? util : util_max;
+		util_sum += util;
+	}
+
+	bool regenerate = m_options.path_schedule == PathSchedule::Regeneration;
+	double samples = regenerate ? (double)total_samples : (double)width * height * params.num_iter;
+	m_avg_path_length = (float)((double)total_segments / samples);
+	m_avg_samples = (float)(samples / ((double)width * height));
+	if (!m_options.verbose) return;
+
+	printf("CPU trace: %d iterations in %.1f ms, %.2f Mrays/s (%u threads), camera rays %s: %.2f Mrays/s per thread", params.num_iter, ms, (double)total_segments / ms * 1e-3, num_threads,
+		m_options.cpu_packets ? "in packets" : "one by one", samples / (double)total_camera_ns * 1e3);
+#ifdef COUNT_ALLOCATIONS
+	printf(", %llu heap allocations", allocations);
+#endif
+	printf("\n");
+	if (m_wavefront != nullptr)
+	{
+		const double* stage_ms = m_wavefront->stage_ms;
+		printf("CPU wavefront: generate %.1f ms, extend %.1f ms, shade %.1f ms, accumulate %.1f ms, live paths per depth:", stage_ms[0], stage_ms[1], stage_ms[2], stage_ms[3]);
+		for (int d = 0; d < WAVEFRONT_STATS_DEPTH && d < params.max_depth && m_wavefront->live[d] > 0; d++)
+			printf(" %.1f%%", 100.0 * (double)m_wavefront->live[d] / samples);
+		printf("\n");
+		return;
+	}
+	if (regenerate)
+		printf("CPU regeneration: %.2f samples per pixel for %d iterations, lane utilization %.1f%%\n", m_avg_samples, params.num_iter, 100.0 * (double)busy_lanes / (double)lane_passes);
+	printf("CPU tiles: %u of %dx%d pixels, %s, %u steals, thread utilization min %.1f%% avg %.1f%% max %.1f%%, per thread:", (unsigned)num_tiles, tile_size, tile_size,
+		m_options.cpu_tile_order == TileOrder::TileMajor ? "tile-major" : "iteration-major", total_steals, util_min, util_sum / num_threads, util_max);
+	for (unsigned i = 0; i < num_threads; i++)
+		printf(" %.0f", 100.0 * stats[i].busy_ms / ms);
+	printf("\n");
+}
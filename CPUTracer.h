@@ -0,0 +1,115 @@
+#pragma once
+
+#include <glm.hpp>
+#include <vector>
+#include "RNGState.h"
+#include "PathTracer.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "tri_kernels.h"
+#include "sphere_kernels.h"
+#include "ThreadPool.h"
+#include "LightBVH.h"
+
+// same fields as RayGenParams, the target being the host pixels of the image
+struct CPUTraceParams
+{
+	glm::vec3 origin;
+	glm::vec3 upper_left;
+	glm::vec3 ux;
+	glm::vec3 uy;
+	int num_iter;
+	int min_depth;
+	int max_depth;
+	bool next_event; // the NEXT_EVENT spec constant of raygen.rgen
+	LightSelection light_selection; // the LIGHT_SELECTION spec constant
+	const EnvironmentMap* environment; // nullptr for the gradient sky
+};
+
+// BLAS of a unique geometry, traversed through the wide BVH, the leaves of the binary BVH point to
+// blocks of TRI_BLOCK_SIZE triangles
+struct CPUGeometry
+{
+	BVH bvh;
+	WideBVH wide;
+	std::vector<TriangleBlock> blocks;
+	std::vector<unsigned> leaf_blocks; // per node, the first block of a leaf
+};
+
+// one TLAS instance: a triangle mesh or a unit sphere with its transform
+struct CPUInstance
+{
+	glm::mat4x4 world_to_object;
+	glm::mat3x3 normal_mat;
+	glm::vec3 color;
+	glm::vec4 emission;   // w: light of the sphere or of triangle 0 of the mesh, -1 when not sampled
+	glm::vec3 bounds_min; // object space
+	glm::vec3 bounds_max;
+	const TriangleMesh* mesh;    // nullptr for UnitSphere, the first mesh with this geometry otherwise
+	const CPUGeometry* geometry; // shared by all instances of the geometry
+};
+
+// The UnitSpheres whose transform is a uniform scale, rotation and translation. They skip the TLAS
+// and are intersected as world space spheres, SPHERE_BLOCK_SIZE per leaf block of their own BVH.
+// Hits on them are numbered after the instances.
+struct CPUSpheres
+{
+	BVH bvh;
+	WideBVH wide;
+	std::vector<SphereBlock> blocks;
+	std::vector<unsigned> leaf_blocks; // per node, the first block of a leaf
+	std::vector<glm::vec3> centers;
+	std::vector<glm::vec3> colors;
+	std::vector<glm::vec4> emissions; // w: light of the sphere, -1 when not sampled
+};
+
+// everything a ray is traced against
+struct CPUScene
+{
+	std::vector<CPUInstance> instances;
+	std::vector<CPUGeometry> geometries; // BLAS: one per unique vertex/index data
+	BVH tlas;                            // over the world space bounds of instances
+	WideBVH wide_tlas;
+	CPUSpheres spheres;
+	const EnvironmentMap* environment; // the sky of missed rays during trace(), nullptr for the gradient
+	const LightBVH* lights;            // the emitters, owned by the PathTracer
+};
+
+struct CPUWorker;
+struct CPUWavefront;
+
+// Native port of raygen.rgen, the closest-hit/intersection shaders and miss.rmiss,
+// running the pixels of the target on all cores of the ThreadPool.
+class CPUTracer
+{
+public:
+	CPUTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres, const LightBVH* lights, const PathTracerOptions& options);
+	~CPUTracer();
+
+	// per-pixel xorwow states, filled by PathTracer::_rand_init() in RandMode::XorWow
+	RNGState* rand_states() { return m_rand_states.data(); }
+
+	void trace(const CPUTraceParams& params);
+
+	// average number of traced segments per sample during the last trace()
+	float avg_path_length() const { return m_avg_path_length; }
+	// average number of samples per pixel during the last trace()
+	float avg_samples() const { return m_avg_samples; }
+
+private:
+	void _trace_tile(const CPUTraceParams& params, int x0, int y0, int tile_size, int iter_begin, int iter_end, CPUWorker& worker);
+	void _regenerate_block(const CPUTraceParams& params, int n, int iter_begin, int iter_end, CPUWorker& worker);
+	void _trace_wavefront(const CPUTraceParams& params, int iter);
+
+	PathTracerOptions m_options;
+	Image* m_target;
+	CPUScene m_scene;
+	std::vector<RNGState> m_rand_states;
+	unsigned m_sobol_dirs[64];
+	float m_avg_path_length;
+	float m_avg_samples;
+	CPUWorker* m_workers; // one per thread of the ThreadPool
+	CPUWavefront* m_wavefront; // PathSchedule::Wavefront only
+	std::vector<ThreadWorkStats> m_thread_stats;
+	std::vector<ThreadWorkStats> m_pass_stats;
+};
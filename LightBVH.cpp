@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include "LightBVH.h"
+#include "PathTracer.h"
+
+#define LIGHT_PI 3.14159265f
+
+bool uniform_sphere(const glm::mat4x4& model, glm::vec3& center, float& radius)
+{
+	if (model[0][3] != 0.0f || model[1][3] != 0.0f || model[2][3] != 0.0f || model[3][3] != 1.0f) return false;
+	glm::vec3 c0 = glm::vec3(model[0]);
+	glm::vec3 c1 = glm::vec3(model[1]);
+	glm::vec3 c2 = glm::vec3(model[2]);
+	float s2 = glm::dot(c0, c0);
+	float eps = 1e-5f * s2;
+	if (!(s2 > 0.0f)) return false;
+	if (fabsf(glm::dot(c1, c1) - s2) > eps || fabsf(glm::dot(c2, c2) - s2) > eps) return false;
+	if (fabsf(glm::dot(c0, c1)) > eps || fabsf(glm::dot(c0, c2)) > eps || fabsf(glm::dot(c1, c2)) > eps) return false;
+	center = glm::vec3(model[3]);
+	radius = sqrtf(s2);
+	return true;
+}
+
+static inline float luminance(const glm::vec3& c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+static void light_bounds(const Light& light, glm::vec3& bmin, glm::vec3& bmax)
+{
+	if (light.radius > 0.0f)
+	{
+		bmin = light.p0 - glm::vec3(light.radius);
+		bmax = light.p0 + glm::vec3(light.radius);
+	}
+	else
+	{
+		bmin = glm::min(light.p0, glm::min(light.p1, light.p2));
+		bmax = glm::max(light.p0, glm::max(light.p1, light.p2));
+	}
+}
+
+void LightBVH::build(const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	m_lights.clear();
+	m_nodes.clear();
+	m_light_indices.clear();
+	m_mesh_first_light.assign(triangle_meshes.size(), -1);
+	m_sphere_light.assign(spheres.size(), -1);
+	m_skipped_spheres = 0;
+	m_build_ms = 0.0;
+
+	for (size_t i = 0; i < triangle_meshes.size(); i++)
+	{
+		const TriangleMesh* mesh = triangle_meshes[i];
+		float lum = luminance(mesh->emission());
+		if (!(lum > 0.0f)) continue;
+		m_mesh_first_light[i] = (int)m_lights.size();
+		const std::vector<Vertex>& vertices = mesh->vertices();
+		const std::vector<unsigned>& indices = mesh->indices();
+		for (size_t j = 0; j + 2 < indices.size(); j += 3)
+		{
+			Light light = {};
+			light.p0 = glm::vec3(mesh->model() * glm::vec4(vertices[indices[j]].Position, 1.0f));
+			light.p1 = glm::vec3(mesh->model() * glm::vec4(vertices[indices[j + 1]].Position, 1.0f));
+			light.p2 = glm::vec3(mesh->model() * glm::vec4(vertices[indices[j + 2]].Position, 1.0f));
+			light.radius = 0.0f;
+			light.emission = mesh->emission();
+			light.area = 0.5f * glm::length(glm::cross(light.p1 - light.p0, light.p2 - light.p0));
+			light.power = LIGHT_PI * lum * 2.0f * light.area;
+			m_lights.push_back(light);
+		}
+	}
+
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		float lum = luminance(spheres[i]->emission());
+		if (!(lum > 0.0f)) continue;
+		Light light = {};
+		if (!uniform_sphere(spheres[i]->model(), light.p0, light.radius))
+		{
+			m_skipped_spheres++;
+			continue;
+		}
+		m_sphere_light[i] = (int)m_lights.size();
+		light.emission = spheres[i]->emission();
+		light.area = 4.0f * LIGHT_PI * light.radius * light.radius;
+		light.power = LIGHT_PI * lum * light.area;
+		m_lights.push_back(light);
+	}
+	if (m_lights.size() == 0) return;
+
+	std::vector<AABB> bounds(m_lights.size());
+	for (size_t i = 0; i < m_lights.size(); i++)
+		light_bounds(m_lights[i], bounds[i].bounds_min, bounds[i].bounds_max);
+	BVH bvh;
+	bvh.build(bounds.data(), (unsigned)bounds.size());
+	m_light_indices = bvh.prim_indices();
+
+	// depth-first order: the parents come first, the powers are summed in reverse
+	const std::vector<BVHNode>& nodes = bvh.nodes();
+	m_nodes.resize(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		LightNode& node = m_nodes[i];
+		node.bounds_min = nodes[i].bounds_min;
+		node.bounds_max = nodes[i].bounds_max;
+		node.offset = nodes[i].offset;
+		node.count = nodes[i].count;
+		node.pad0 = 0;
+		node.pad1 = 0;
+	}
+	m_nodes[0].parent = LIGHT_NO_PARENT;
+	for (size_t i = 0; i < m_nodes.size(); i++)
+	{
+		if (m_nodes[i].count > 0)
+		{
+			for (unsigned k = 0; k < m_nodes[i].count; k++)
+				m_lights[m_light_indices[m_nodes[i].offset + k]].leaf = (unsigned)i;
+			continue;
+		}
+		m_nodes[i + 1].parent = (unsigned)i;
+		m_nodes[m_nodes[i].offset].parent = (unsigned)i;
+	}
+	for (size_t i = m_nodes.size(); i-- > 0; )
+	{
+		LightNode& node = m_nodes[i];
+		node.power = 0.0f;
+		if (node.count > 0)
+		{
+			for (unsigned k = 0; k < node.count; k++)
+				node.power += m_lights[m_light_indices[node.offset + k]].power;
+		}
+		else
+			node.power = m_nodes[i + 1].power + m_nodes[node.offset].power;
+	}
+
+	m_build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void LightBVH::print_stats() const
+{
+	if (m_skipped_spheres > 0)
+		printf("light BVH: %u emissive spheres are not uniformly scaled, they are not sampled\n", m_skipped_spheres);
+	if (m_lights.size() > 0)
+		printf("light BVH: %u lights, %u nodes, built in %.2f ms\n", (unsigned)m_lights.size(), (unsigned)m_nodes.size(), m_build_ms);
+}
+
+// light_importance() of lights.shinc: the power of the lights within the bounds times the cosine
+// between n and the direction of the bounds closest to it, over the squared distance to their center,
+// with the bounding sphere of the box standing in for the box. Zero only when no point of the bounds
+// is above the tangent plane at p.
+static float light_importance(const glm::vec3& p, const glm::vec3& n, const glm::vec3& bmin, const glm::vec3& bmax, float power, bool power_only)
+{
+	if (power_only) return power;
+	glm::vec3 c = 0.5f * (bmin + bmax);
+	glm::vec3 ext = bmax - bmin;
+	float r2 = 0.25f * glm::dot(ext, ext);
+	glm::vec3 d = c - p;
+	float d2 = glm::dot(d, d);
+	float cos_bound = 1.0f;
+	if (d2 > r2)
+	{
+		// cos(max(0, theta_i - theta_b)), theta_i between n and the center, theta_b the half angle of the sphere
+		float cos_i = glm::dot(n, d) / sqrtf(d2);
+		float cos_b = sqrtf(1.0f - r2 / d2);
+		if (cos_i < cos_b)
+		{
+			float sin_i = sqrtf(fmaxf(0.0f, 1.0f - cos_i * cos_i));
+			float sin_b = sqrtf(r2 / d2);
+			cos_bound = cos_i * cos_b + sin_i * sin_b;
+		}
+	}
+	return power * fmaxf(cos_bound, 0.0f) / fmaxf(d2, r2);
+}
+
+static float light_importance(const Light& light, const glm::vec3& p, const glm::vec3& n, bool power_only)
+{
+	glm::vec3 bmin, bmax;
+	light_bounds(light, bmin, bmax);
+	return light_importance(p, n, bmin, bmax, light.power, power_only);
+}
+
+static inline float node_importance(const LightNode& node, const glm::vec3& p, const glm::vec3& n, bool power_only)
+{
+	return light_importance(p, n, node.bounds_min, node.bounds_max, node.power, power_only);
+}
+
+int LightBVH::pick(const glm::vec3& p, const glm::vec3& n, bool power_only, float u, float& pmf) const
+{
+	pmf = 0.0f;
+	if (m_nodes.size() == 0) return -1;
+
+	float prob = 1.0f;
+	unsigned index = 0;
+	while (m_nodes[index].count == 0)
+	{
+		const LightNode& node = m_nodes[index];
+		float i0 = node_importance(m_nodes[index + 1], p, n, power_only);
+		float i1 = node_importance(m_nodes[node.offset], p, n, power_only);
+		if (!(i0 + i1 > 0.0f)) return -1;
+		float p0 = i0 / (i0 + i1);
+		if (u < p0)
+		{
+			u = fminf(u / p0, 0.99999994f);
+			prob *= p0;
+			index = index + 1;
+		}
+		else
+		{
+			u = fminf((u - p0) / (1.0f - p0), 0.99999994f);
+			prob *= 1.0f - p0;
+			index = node.offset;
+		}
+	}
+
+	// the lights of the leaf by their own importance
+	const LightNode& leaf = m_nodes[index];
+	float total = 0.0f;
+	for (unsigned k = 0; k < leaf.count; k++)
+		total += light_importance(m_lights[m_light_indices[leaf.offset + k]], p, n, power_only);
+	if (!(total > 0.0f)) return -1;
+	float x = u * total;
+	for (unsigned k = 0; k < leaf.count; k++)
+	{
+		unsigned light = m_light_indices[leaf.offset + k];
+		float importance = light_importance(m_lights[light], p, n, power_only);
+		if (x < importance || k == leaf.count - 1)
+		{
+			pmf = prob * importance / total;
+			return pmf > 0.0f ? (int)light : -1;
+		}
+		x -= importance;
+	}
+	return -1;
+}
+
+float LightBVH::pick_pmf(const glm::vec3& p, const glm::vec3& n, bool power_only, unsigned light) const
+{
+	unsigned index = m_lights[light].leaf;
+	const LightNode& leaf = m_nodes[index];
+	float total = 0.0f;
+	float own = 0.0f;
+	for (unsigned k = 0; k < leaf.count; k++)
+	{
+		unsigned other = m_light_indices[leaf.offset + k];
+		float importance = light_importance(m_lights[other], p, n, power_only);
+		total += importance;
+		if (other == light) own = importance;
+	}
+	if (!(total > 0.0f)) return 0.0f;
+	float pmf = own / total;
+
+	while (m_nodes[index].parent != LIGHT_NO_PARENT)
+	{
+		unsigned parent = m_nodes[index].parent;
+		float i0 = node_importance(m_nodes[parent + 1], p, n, power_only);
+		float i1 = node_importance(m_nodes[m_nodes[parent].offset], p, n, power_only);
+		if (!(i0 + i1 > 0.0f)) return 0.0f;
+		pmf *= (index == parent + 1 ? i0 : i1) / (i0 + i1);
+		index = parent;
+	}
+	return pmf;
+}
+
+bool light_sample_point(const Light& light, const glm::vec3& p, glm::vec2 u, glm::vec3& direction, float& dist, float& pdf)
+{
+	if (light.radius > 0.0f)
+	{
+		glm::vec3 d = light.p0 - p;
+		float d2 = glm::dot(d, d);
+		float r2 = light.radius * light.radius;
+		if (d2 <= r2) return false;
+		// 1 - cos of the half angle of the cone, in a form that stays accurate for small spheres
+		float x = r2 / d2;
+		float one_minus_cos_max = x / (1.0f + sqrtf(1.0f - x));
+		float one_minus_cos = u.x * one_minus_cos_max;
+		float cos_t = 1.0f - one_minus_cos;
+		float sin_t = sqrtf(fmaxf(0.0f, one_minus_cos * (2.0f - one_minus_cos)));
+		float phi = 2.0f * LIGHT_PI * u.y;
+
+		float dist_c = sqrtf(d2);
+		glm::vec3 w = d / dist_c;
+		glm::vec3 a = fabsf(w.x) > 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+		glm::vec3 t = glm::normalize(glm::cross(a, w));
+		glm::vec3 b = glm::cross(w, t);
+		direction = (cosf(phi) * sin_t) * t + (sinf(phi) * sin_t) * b + cos_t * w;
+		dist = dist_c * cos_t - sqrtf(fmaxf(0.0f, r2 - d2 * sin_t * sin_t));
+		pdf = 1.0f / (2.0f * LIGHT_PI * one_minus_cos_max);
+		return true;
+	}
+
+	float su = sqrtf(u.x);
+	glm::vec3 q = (1.0f - su) * light.p0 + (u.y * su) * light.p1 + (su * (1.0f - u.y)) * light.p2;
+	glm::vec3 d = q - p;
+	float d2 = glm::dot(d, d);
+	if (!(d2 > 0.0f)) return false;
+	dist = sqrtf(d2);
+	direction = d / dist;
+	glm::vec3 ng = glm::cross(light.p1 - light.p0, light.p2 - light.p0);
+	float cos_l = fabsf(glm::dot(ng, direction)) / glm::length(ng);
+	if (!(cos_l > 0.0f)) return false;
+	pdf = d2 / (cos_l * light.area);
+	return true;
+}
+
+float light_pdf_point(const Light& light, const glm::vec3& p, const glm::vec3& direction, float t)
+{
+	if (light.radius > 0.0f)
+	{
+		glm::vec3 d = light.p0 - p;
+		float d2 = glm::dot(d, d);
+		float r2 = light.radius * light.radius;
+		if (d2 <= r2) return 0.0f;
+		float x = r2 / d2;
+		return 1.0f / (2.0f * LIGHT_PI * (x / (1.0f + sqrtf(1.0f - x))));
+	}
+
+	glm::vec3 ng = glm::cross(light.p1 - light.p0, light.p2 - light.p0);
+	float cos_l = fabsf(glm::dot(ng, direction)) / glm::length(ng);
+	if (!(cos_l > 0.0f)) return 0.0f;
+	return t * t / (cos_l * light.area);
+}
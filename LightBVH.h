@@ -0,0 +1,89 @@
+#pragma once
+
+#include <glm.hpp>
+#include <vector>
+#include "BVH.h"
+
+class TriangleMesh;
+class UnitSphere;
+
+#define LIGHT_NO_PARENT 0xffffffffu
+
+// An emitter of the light BVH, 64 bytes, the layout of Light in shaders/lights.shinc.
+// Emissive triangles emit from both sides.
+struct Light
+{
+	glm::vec3 p0;
+	float radius;       // sphere: > 0 and p0 is its center, triangle: 0 and p0, p1, p2 are its world space vertices
+	glm::vec3 p1;
+	unsigned leaf;      // node of the light BVH whose leaf lists the light
+	glm::vec3 p2;
+	float power;        // luminance of the emitted power, pi * radiance * area
+	glm::vec3 emission; // radiance
+	float area;
+};
+
+// BVHNode with the power of the lights below and the parent, 48 bytes, LightNode of lights.shinc
+struct LightNode
+{
+	glm::vec3 bounds_min;
+	float power;
+	glm::vec3 bounds_max;
+	unsigned offset; // inner node: index of the second child, leaf: first entry of light_indices()
+	unsigned count;  // number of lights of a leaf, 0 for inner nodes
+	unsigned parent; // LIGHT_NO_PARENT for the root
+	unsigned pad0;
+	unsigned pad1;
+};
+
+// A model matrix that maps the unit sphere to a sphere: orthogonal columns of equal length and no
+// projective row. Rotations and scales from glm are off by rounding, hence the tolerance.
+bool uniform_sphere(const glm::mat4x4& model, glm::vec3& center, float& radius);
+
+// The emissive geometry of a scene as light sources for next-event estimation, in a BVH over their
+// bounds built by the SAH builder of BVH. Every node knows the power below it, so a shading point
+// picks a light by descending from the root and choosing each child with a probability proportional
+// to an estimate of its contribution: power times the best cosine the bounds allow at the point, over
+// the squared distance. That takes O(log n), and the probability of a given light is found in as
+// many steps by walking up from its leaf.
+class LightBVH
+{
+public:
+	// One light per triangle of the meshes with an emission, in mesh order, then one per emissive
+	// UnitSphere. Spheres whose model is not a uniform scale still emit, but are only found by the
+	// bounces (their light index is -1).
+	void build(const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres);
+
+	const std::vector<Light>& lights() const { return m_lights; }
+	const std::vector<LightNode>& nodes() const { return m_nodes; }
+	const std::vector<unsigned>& light_indices() const { return m_light_indices; }
+	// light of triangle 0 of mesh i, of sphere i, -1 when it is not a sampled light
+	int mesh_first_light(size_t i) const { return m_mesh_first_light[i]; }
+	int sphere_light(size_t i) const { return m_sphere_light[i]; }
+	// emissive spheres left out of the build for their model, and the time the last build() took
+	unsigned skipped_spheres() const { return m_skipped_spheres; }
+	double build_ms() const { return m_build_ms; }
+	void print_stats() const;
+
+	// light_pick() and light_pick_pmf() of lights.shinc on the host. power_only: the children are
+	// chosen by power alone (LightSelection::Power).
+	int pick(const glm::vec3& p, const glm::vec3& n, bool power_only, float u, float& pmf) const;
+	float pick_pmf(const glm::vec3& p, const glm::vec3& n, bool power_only, unsigned light) const;
+
+private:
+	std::vector<Light> m_lights;
+	std::vector<LightNode> m_nodes;
+	std::vector<unsigned> m_light_indices;
+	std::vector<int> m_mesh_first_light;
+	std::vector<int> m_sphere_light;
+	unsigned m_skipped_spheres = 0;
+	double m_build_ms = 0.0;
+};
+
+// light_sample_point() of lights.shinc: a direction from p toward the light drawn with u, the distance
+// to the light along it and the solid angle density. Spheres are sampled uniformly over the cone they
+// subtend, triangles uniformly over their area. False when p can't be lit by the light.
+bool light_sample_point(const Light& light, const glm::vec3& p, glm::vec2 u, glm::vec3& direction, float& dist, float& pdf);
+
+// the density of light_sample_point() for the direction from p that reaches the light at distance t
+float light_pdf_point(const Light& light, const glm::vec3& p, const glm::vec3& direction, float t);
@@ -5,12 +5,18 @@
 
 #include "volk.h"
 
+#ifdef USE_CUDA
 #include <cuda_runtime.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <stddef.h>
 #include "context.inl"
 #include "PathTracer.h"
+#include "CPUTracer.h"
+#include "LightBVH.h"
+#include "sobol.h"
 
 struct AccelerationResource
 {
@@ -36,10 +42,11 @@ void as_release(AccelerationResource* as)
 Geometry::Geometry(const glm::mat4x4& model, glm::vec3 color)
 {
 	m_color = color;
+	m_emission = glm::vec3(0.0f);
 	m_model = model;
 	m_norm_mat = glm::transpose(glm::inverse(model));
 
-	m_blas = new AccelerationResource;
+	m_blas = nullptr;
 }
 
 Geometry::~Geometry()
@@ -47,7 +54,13 @@ Geometry::~Geometry()
 	delete m_blas;
 }
 
-void TriangleMesh::_blas_create()
+AccelerationResource* Geometry::get_blas() const
+{
+	if (m_blas == nullptr) _device_create();
+	return m_blas;
+}
+
+void TriangleMesh::_blas_create() const
 {
 	Context& ctx = Context::get_context();
 
@@ -129,24 +142,17 @@ void TriangleMesh::_blas_create()
 
 TriangleMesh::TriangleMesh(const glm::mat4x4& model, const std::vector<Vertex>& vertices, const std::vector<unsigned>& indices, glm::vec3 color) : Geometry(model, color)
 {
-	m_vertexCount = (unsigned)vertices.size();
-	m_indexCount = (unsigned)indices.size();
-
-	m_vertexBuffer = new BufferResource;
-	m_indexBuffer = new BufferResource;
-
-	Context& ctx = Context::get_context();
-	ctx.buffer_create(*m_vertexBuffer, sizeof(Vertex)* m_vertexCount);
-	ctx.buffer_upload(*m_vertexBuffer, vertices.data());
-	ctx.buffer_create(*m_indexBuffer, sizeof(unsigned)*m_indexCount);
-	ctx.buffer_upload(*m_indexBuffer, indices.data());
-
-	_blas_create();
+	m_vertices = vertices;
+	m_indices = indices;
 
+	m_vertexBuffer = nullptr;
+	m_indexBuffer = nullptr;
 }
 
 TriangleMesh::~TriangleMesh()
 {
+	if (m_blas == nullptr) return;
+
 	Context& ctx = Context::get_context();
 	as_release(m_blas);
 	ctx.buffer_release(*m_vertexBuffer);
@@ -156,7 +162,34 @@ TriangleMesh::~TriangleMesh()
 	delete m_vertexBuffer;
 }
 
-void UnitSphere::_blas_create()
+void TriangleMesh::_device_create() const
+{
+	m_vertexBuffer = new BufferResource;
+	m_indexBuffer = new BufferResource;
+
+	Context& ctx = Context::get_context();
+	ctx.buffer_create(*m_vertexBuffer, sizeof(Vertex)* m_vertices.size());
+	ctx.buffer_upload(*m_vertexBuffer, m_vertices.data());
+	ctx.buffer_create(*m_indexBuffer, sizeof(unsigned)*m_indices.size());
+	ctx.buffer_upload(*m_indexBuffer, m_indices.data());
+
+	m_blas = new AccelerationResource;
+	_blas_create();
+}
+
+BufferResource* TriangleMesh::vertex_buffer() const
+{
+	if (m_blas == nullptr) _device_create();
+	return m_vertexBuffer;
+}
+
+BufferResource* TriangleMesh::index_buffer() const
+{
+	if (m_blas == nullptr) _device_create();
+	return m_indexBuffer;
+}
+
+void UnitSphere::_blas_create() const
 {
 	Context& ctx = Context::get_context();
 
@@ -234,6 +267,21 @@ UnitSphere::UnitSphere(const glm::mat4x4& model, glm::vec3 color) : Geometry(mod
 	m_color = color;
 	m_model = model;
 
+	m_aabb_buf = nullptr;
+}
+
+UnitSphere::~UnitSphere()
+{
+	if (m_blas == nullptr) return;
+
+	Context& ctx = Context::get_context();
+	as_release(m_blas);
+	ctx.buffer_release(*m_aabb_buf);
+	delete m_aabb_buf;
+}
+
+void UnitSphere::_device_create() const
+{
 	static float s_aabb[6] = { -1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
 
 	m_aabb_buf = new BufferResource;
@@ -242,15 +290,14 @@ UnitSphere::UnitSphere(const glm::mat4x4& model, glm::vec3 color) : Geometry(mod
 	ctx.buffer_create(*m_aabb_buf, sizeof(float) * 6);
 	ctx.buffer_upload(*m_aabb_buf, s_aabb);
 
+	m_blas = new AccelerationResource;
 	_blas_create();
 }
 
-UnitSphere::~UnitSphere()
+BufferResource* UnitSphere::aabb_buffer() const
 {
-	Context& ctx = Context::get_context();
-	as_release(m_blas);
-	ctx.buffer_release(*m_aabb_buf);
-	delete m_aabb_buf;
+	if (m_blas == nullptr) _device_create();
+	return m_aabb_buf;
 }
 
 Image::Image(int width, int height, float* hdata)
@@ -258,31 +305,94 @@ Image::Image(int width, int height, float* hdata)
 	m_width = width;
 	m_height = height;
 
-	m_data = new BufferResource;
-
-	Context& ctx = Context::get_context();
-	ctx.buffer_create(*m_data, sizeof(float) * 4 * width * height);
+	m_data = nullptr;
 	if (hdata != nullptr)
-		ctx.buffer_upload(*m_data, hdata);
+		m_hdata.assign(hdata, hdata + 4 * width * height);
 }
 
 Image::~Image()
 {
+	if (m_data == nullptr) return;
+
 	Context& ctx = Context::get_context();
 	ctx.buffer_release(*m_data);
 	delete m_data;
 }
 
+BufferResource* Image::data() const
+{
+	if (m_data == nullptr)
+	{
+		m_data = new BufferResource;
+
+		Context& ctx = Context::get_context();
+		ctx.buffer_create(*m_data, sizeof(float) * 4 * m_width * m_height);
+		if (m_hdata.size() > 0)
+		{
+			ctx.buffer_upload(*m_data, m_hdata.data());
+			std::vector<float>().swap(m_hdata);
+		}
+	}
+	return m_data;
+}
+
+float* Image::host_data()
+{
+	if (m_hdata.size() == 0)
+		m_hdata.resize(4 * (size_t)m_width * m_height, 0.0f);
+	return m_hdata.data();
+}
+
 void Image::clear()
 {
-	Context& ctx = Context::get_context();
-	ctx.buffer_zero(*m_data);
+	if (m_data != nullptr)
+	{
+		Context& ctx = Context::get_context();
+		ctx.buffer_zero(*m_data);
+	}
+	if (m_hdata.size() > 0)
+		memset(m_hdata.data(), 0, sizeof(float) * m_hdata.size());
 }
 
 void Image::to_host(void *hdata) const
 {
+	if (m_data != nullptr)
+	{
+		Context& ctx = Context::get_context();
+		ctx.buffer_download(*m_data, hdata);
+	}
+	else if (m_hdata.size() > 0)
+		memcpy(hdata, m_hdata.data(), sizeof(float) * m_hdata.size());
+	else
+		memset(hdata, 0, sizeof(float) * 4 * m_width * m_height);
+}
+
+EnvironmentMap::~EnvironmentMap()
+{
+	if (m_data == nullptr) return;
+
 	Context& ctx = Context::get_context();
-	ctx.buffer_download(*m_data, hdata);
+	ctx.buffer_release(*m_data);
+	delete m_data;
+}
+
+BufferResource* EnvironmentMap::data() const
+{
+	if (m_data == nullptr)
+	{
+		// the CPU backend samples the host copies, so they are kept
+		std::vector<char> hdata(texel_tables_offset() + sizeof(AliasEntry) * m_texel_tables.size());
+		memcpy(hdata.data(), m_texels.data(), rows_offset());
+		memcpy(hdata.data() + rows_offset(), m_rows.data(), texel_tables_offset() - rows_offset());
+		memcpy(hdata.data() + texel_tables_offset(), m_texel_tables.data(), sizeof(AliasEntry) * m_texel_tables.size());
+
+		m_data = new BufferResource;
+
+		Context& ctx = Context::get_context();
+		ctx.buffer_create(*m_data, hdata.size());
+		ctx.buffer_upload(*m_data, hdata.data());
+	}
+	return m_data;
 }
 
 
@@ -290,6 +400,7 @@ struct TriangleMeshView
 {
 	glm::mat3x4 normalMat;
 	glm::vec4 color;
+	glm::vec4 emission; // w: light of the first triangle, -1 when not sampled
 	VkDeviceAddress vertexBuf;
 	VkDeviceAddress indexBuf;
 };
@@ -298,6 +409,7 @@ struct SphereView
 {
 	glm::mat3x4 normalMat;
 	glm::vec4 color;
+	glm::vec4 emission; // w: light of the sphere, -1 when not sampled
 };
 
 
@@ -332,6 +444,7 @@ void PathTracer::_tlas_create(const std::vector<const TriangleMesh*>& triangle_m
 		transforms_triangles[i] = triangle_meshes[i]->model();
 		tri_views[i].normalMat = triangle_meshes[i]->norm();
 		tri_views[i].color = { triangle_meshes[i]->color(),1.0f };
+		tri_views[i].emission = { triangle_meshes[i]->emission(), (float)m_light_bvh->mesh_first_light(i) };
 		tri_views[i].vertexBuf = ctx.buffer_get_device_address(*triangle_meshes[i]->vertex_buffer());
 		tri_views[i].indexBuf = ctx.buffer_get_device_address(*triangle_meshes[i]->index_buffer());
 	}
@@ -351,6 +464,7 @@ void PathTracer::_tlas_create(const std::vector<const TriangleMesh*>& triangle_m
 		transforms_spheres[i] = spheres[i]->model();
 		sphere_views[i].normalMat = spheres[i]->norm();
 		sphere_views[i].color = { spheres[i]->color(),1.0f };
+		sphere_views[i].emission = { spheres[i]->emission(), (float)m_light_bvh->sphere_light(i) };
 	}
 
 	m_spheres = new BufferResource;
@@ -482,6 +596,26 @@ struct ImageView
 	int height;
 };
 
+// Environment of environment.shinc, width = 0 for the gradient sky
+struct EnvironmentView
+{
+	VkDeviceAddress texels;
+	VkDeviceAddress rows;
+	VkDeviceAddress texel_tables;
+	int width;
+	int height;
+};
+
+// LightTree of lights.shinc, num_lights = 0 without emitters
+struct LightTreeView
+{
+	VkDeviceAddress lights;
+	VkDeviceAddress nodes;
+	VkDeviceAddress indices;
+	int num_lights;
+	int pad0;
+};
+
 struct RayGenParams
 {
 	glm::vec4 origin;
@@ -490,13 +624,55 @@ struct RayGenParams
 	glm::vec4 uy;
 	ImageView target;
 	int num_iter;
+	int min_depth;
+	int max_depth;
+	int pad0;     // std140 aligns the struct to 16 bytes
+	EnvironmentView env;
+	LightTreeView light_tree;
+};
+
+// constant_id order of path_sampler.shinc, used by raygen.rgen and the wavefront stages, then
+// NEXT_EVENT and LIGHT_SELECTION of raygen.rgen and regen.rgen
+struct RayGenSpecialization
+{
+	int rand_mode;
+	int sampler;
+	int next_event;
+	int light_selection;
+};
+
+struct RayGenPushConstants
+{
+	int iter;
+	int num_samples;
+};
+
+// wavefront.shinc
+struct WavefrontPushConstants
+{
+	int iter;
+	int depth;
+};
+
+// WavefrontPath of wavefront.shinc
+struct WavefrontPath
+{
+	glm::vec4 origin;
+	glm::vec4 direction;
+	glm::vec4 f_att;
+	glm::vec4 color;
+	glm::vec4 normal;
+	int depth;
+	unsigned sample_dim;
+	unsigned pad0;
+	unsigned pad1;
 };
 
 void PathTracer::_args_create()
 {
 	Context& ctx = Context::get_context();
 
-	VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[5] = { {}, {}, {}, {}, {} };
+	VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[12] = { {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {} };
 	descriptorSetLayoutBindings[0].binding = 0;
 	descriptorSetLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
 	descriptorSetLayoutBindings[0].descriptorCount = 1;
@@ -504,7 +680,7 @@ void PathTracer::_args_create()
 	descriptorSetLayoutBindings[1].binding = 1;
 	descriptorSetLayoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	descriptorSetLayoutBindings[1].descriptorCount = 1;
-	descriptorSetLayoutBindings[1].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
+	descriptorSetLayoutBindings[1].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_MISS_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
 	descriptorSetLayoutBindings[2].binding = 2;
 	descriptorSetLayoutBindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	descriptorSetLayoutBindings[2].descriptorCount = 1;
@@ -516,17 +692,32 @@ void PathTracer::_args_create()
 	descriptorSetLayoutBindings[4].binding = 4;
 	descriptorSetLayoutBindings[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	descriptorSetLayoutBindings[4].descriptorCount = 1;
-	descriptorSetLayoutBindings[4].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
-
+	descriptorSetLayoutBindings[4].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
+	descriptorSetLayoutBindings[5].binding = 5;
+	descriptorSetLayoutBindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorSetLayoutBindings[5].descriptorCount = 1;
+	descriptorSetLayoutBindings[5].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
+	descriptorSetLayoutBindings[6].binding = 6;
+	descriptorSetLayoutBindings[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorSetLayoutBindings[6].descriptorCount = 1;
+	descriptorSetLayoutBindings[6].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
+	// 7-11: paths, hits, queues, queue counts and shadow rays of the wavefront stages
+	for (unsigned i = 7; i < 12; i++)
+	{
+		descriptorSetLayoutBindings[i].binding = i;
+		descriptorSetLayoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorSetLayoutBindings[i].descriptorCount = 1;
+		descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_COMPUTE_BIT;
+	}
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
 	descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	descriptorSetLayoutCreateInfo.bindingCount = 5;
+	descriptorSetLayoutCreateInfo.bindingCount = 12;
 	descriptorSetLayoutCreateInfo.pBindings = descriptorSetLayoutBindings;
 
 	vkCreateDescriptorSetLayout(ctx.device(), &descriptorSetLayoutCreateInfo, nullptr, &m_args->descriptorSetLayout);
 
-	VkDescriptorPoolSize descriptorPoolSize[5] = { {}, {}, {}, {}, {} };
+	VkDescriptorPoolSize descriptorPoolSize[7] = { {}, {}, {}, {}, {}, {}, {} };
 	descriptorPoolSize[0].type = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
 	descriptorPoolSize[0].descriptorCount = 1;
 	descriptorPoolSize[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
@@ -537,11 +728,15 @@ void PathTracer::_args_create()
 	descriptorPoolSize[3].descriptorCount = 1;
 	descriptorPoolSize[4].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	descriptorPoolSize[4].descriptorCount = 1;
+	descriptorPoolSize[5].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorPoolSize[5].descriptorCount = 1;
+	descriptorPoolSize[6].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorPoolSize[6].descriptorCount = 6; // path stats and the 5 wavefront buffers
 
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
 	descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	descriptorPoolCreateInfo.maxSets = 1;
-	descriptorPoolCreateInfo.poolSizeCount = 5;
+	descriptorPoolCreateInfo.poolSizeCount = 7;
 	descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSize;
 
 	vkCreateDescriptorPool(ctx.device(), &descriptorPoolCreateInfo, nullptr, &m_args->descriptorPool);
@@ -575,6 +770,14 @@ void PathTracer::_args_create()
 	descriptorBufferInfo_rand_states.buffer = m_rand_states->buf;
 	descriptorBufferInfo_rand_states.range = VK_WHOLE_SIZE;
 
+	VkDescriptorBufferInfo descriptorBufferInfo_sobol_dirs = {};
+	descriptorBufferInfo_sobol_dirs.buffer = m_sobol_dirs->buf;
+	descriptorBufferInfo_sobol_dirs.range = VK_WHOLE_SIZE;
+
+	VkDescriptorBufferInfo descriptorBufferInfo_path_stats = {};
+	descriptorBufferInfo_path_stats.buffer = m_path_stats->buf;
+	descriptorBufferInfo_path_stats.range = VK_WHOLE_SIZE;
+
 	std::vector<VkWriteDescriptorSet> writeDescriptorSet(3);
 
 	writeDescriptorSet[0] = {};
@@ -596,10 +799,34 @@ void PathTracer::_args_create()
 	writeDescriptorSet[2] = {};
 	writeDescriptorSet[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[2].dstSet = m_args->descriptorSet;
-	writeDescriptorSet[2].dstBinding = 4;
+	writeDescriptorSet[2].dstBinding = 6;
 	writeDescriptorSet[2].descriptorCount = 1;
 	writeDescriptorSet[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	writeDescriptorSet[2].pBufferInfo = &descriptorBufferInfo_rand_states;
+	writeDescriptorSet[2].pBufferInfo = &descriptorBufferInfo_path_stats;
+
+	if (m_rand_states->size > 0)
+	{
+		VkWriteDescriptorSet write_rand_states = {};
+		write_rand_states.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write_rand_states.dstSet = m_args->descriptorSet;
+		write_rand_states.dstBinding = 4;
+		write_rand_states.descriptorCount = 1;
+		write_rand_states.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write_rand_states.pBufferInfo = &descriptorBufferInfo_rand_states;
+		writeDescriptorSet.push_back(write_rand_states);
+	}
+
+	if (m_sobol_dirs->size > 0)
+	{
+		VkWriteDescriptorSet write_sobol_dirs = {};
+		write_sobol_dirs.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write_sobol_dirs.dstSet = m_args->descriptorSet;
+		write_sobol_dirs.dstBinding = 5;
+		write_sobol_dirs.descriptorCount = 1;
+		write_sobol_dirs.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write_sobol_dirs.pBufferInfo = &descriptorBufferInfo_sobol_dirs;
+		writeDescriptorSet.push_back(write_sobol_dirs);
+	}
 
 	if (m_triangleMeshes->size > 0)
 	{
@@ -625,6 +852,24 @@ void PathTracer::_args_create()
 		writeDescriptorSet.push_back(write_sphere);
 	}	
 
+	BufferResource* wavefront_buffers[5] = { m_paths, m_hits, m_queues, m_queue_counts, m_shadow_rays };
+	VkDescriptorBufferInfo descriptorBufferInfo_wavefront[5] = { {}, {}, {}, {}, {} };
+	for (unsigned i = 0; i < 5; i++)
+	{
+		if (wavefront_buffers[i]->size == 0) continue;
+		descriptorBufferInfo_wavefront[i].buffer = wavefront_buffers[i]->buf;
+		descriptorBufferInfo_wavefront[i].range = VK_WHOLE_SIZE;
+
+		VkWriteDescriptorSet write_wavefront = {};
+		write_wavefront.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write_wavefront.dstSet = m_args->descriptorSet;
+		write_wavefront.dstBinding = 7 + i;
+		write_wavefront.descriptorCount = 1;
+		write_wavefront.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write_wavefront.pBufferInfo = &descriptorBufferInfo_wavefront[i];
+		writeDescriptorSet.push_back(write_wavefront);
+	}
+
 	vkUpdateDescriptorSets(ctx.device(), (uint32_t)writeDescriptorSet.size(), writeDescriptorSet.data(), 0, nullptr);
 }
 
@@ -665,7 +910,12 @@ void PathTracer::_rt_pipeline_create()
 {
 	Context& ctx = Context::get_context();
 
-	VkShaderModule rayGenModule = _createShaderModule_from_spv("../shaders/raygen.spv");
+	// the wavefront schedule only traces rays from its queues, the rest of the path loop is in compute stages
+	bool wavefront = m_options.path_schedule == PathSchedule::Wavefront;
+	const char* raygen_spv = "../shaders/raygen.spv";
+	if (wavefront) raygen_spv = "../shaders/wf_extend.spv";
+	else if (m_options.path_schedule == PathSchedule::Regeneration) raygen_spv = "../shaders/regen.spv";
+	VkShaderModule rayGenModule = _createShaderModule_from_spv(raygen_spv);
 	VkShaderModule missModule = _createShaderModule_from_spv("../shaders/miss.spv");
 	VkShaderModule missShadowModule = _createShaderModule_from_spv("../shaders/miss_shadow.spv");
 	VkShaderModule closesthit_triangles_Module = _createShaderModule_from_spv("../shaders/closesthit_triangles.spv");
@@ -677,10 +927,30 @@ void PathTracer::_rt_pipeline_create()
 
 	VkPipelineShaderStageCreateInfo stages[stage_count] = { {}, {}, {}, {}, {}, {} };
 
+	RayGenSpecialization raygen_spec;
+	raygen_spec.rand_mode = (int)m_options.rand_mode;
+	raygen_spec.sampler = (int)m_options.sampler;
+	raygen_spec.next_event = m_options.next_event ? 1 : 0;
+	raygen_spec.light_selection = (int)m_options.light_selection;
+
+	VkSpecializationMapEntry raygen_spec_entries[4] = {
+		{ 0, offsetof(RayGenSpecialization, rand_mode), sizeof(int) },
+		{ 1, offsetof(RayGenSpecialization, sampler), sizeof(int) },
+		{ 2, offsetof(RayGenSpecialization, next_event), sizeof(int) },
+		{ 3, offsetof(RayGenSpecialization, light_selection), sizeof(int) }
+	};
+
+	VkSpecializationInfo raygen_spec_info = {};
+	raygen_spec_info.mapEntryCount = 4;
+	raygen_spec_info.pMapEntries = raygen_spec_entries;
+	raygen_spec_info.dataSize = sizeof(RayGenSpecialization);
+	raygen_spec_info.pData = &raygen_spec;
+
 	stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	stages[0].stage = VK_SHADER_STAGE_RAYGEN_BIT_NV;
 	stages[0].module = rayGenModule;
 	stages[0].pName = "main";
+	stages[0].pSpecializationInfo = &raygen_spec_info;
 
 	stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	stages[1].stage = VK_SHADER_STAGE_MISS_BIT_NV;
@@ -745,10 +1015,17 @@ void PathTracer::_rt_pipeline_create()
 
 	VkDescriptorSetLayout descriptorSetLayouts[1] = { m_args->descriptorSetLayout };
 
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = wavefront ? sizeof(WavefrontPushConstants) : sizeof(RayGenPushConstants);
+
 	VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
 	pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutCreateInfo.setLayoutCount = 1;
 	pipelineLayoutCreateInfo.pSetLayouts = descriptorSetLayouts;
+	pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+	pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
 
 	vkCreatePipelineLayout(ctx.device(), &pipelineLayoutCreateInfo, nullptr, &m_rt_pipeline->pipelineLayout);
 
@@ -797,62 +1074,126 @@ void PathTracer::_rt_pipeline_release()
 	vkDestroyPipeline(ctx.device(), m_rt_pipeline->pipeline, nullptr);
 }
 
-void PathTracer::_comp_pipeline_create()
+// final.comp and the wavefront stages, all with the spec constants of raygen.rgen and the push constants of wavefront.shinc
+void PathTracer::_comp_pipeline_create(ComputePipelineResource* pipeline, const char* fn)
 {
 	Context& ctx = Context::get_context();
 
-	VkShaderModule finalModule = _createShaderModule_from_spv("../shaders/final.spv");
+	VkShaderModule compModule = _createShaderModule_from_spv(fn);
+
+	RayGenSpecialization spec;
+	spec.rand_mode = (int)m_options.rand_mode;
+	spec.sampler = (int)m_options.sampler;
+	spec.next_event = m_options.next_event ? 1 : 0;
+	spec.light_selection = (int)m_options.light_selection;
+
+	VkSpecializationMapEntry spec_entries[4] = {
+		{ 0, offsetof(RayGenSpecialization, rand_mode), sizeof(int) },
+		{ 1, offsetof(RayGenSpecialization, sampler), sizeof(int) },
+		{ 2, offsetof(RayGenSpecialization, next_event), sizeof(int) },
+		{ 3, offsetof(RayGenSpecialization, light_selection), sizeof(int) }
+	};
+
+	VkSpecializationInfo spec_info = {};
+	spec_info.mapEntryCount = 4;
+	spec_info.pMapEntries = spec_entries;
+	spec_info.dataSize = sizeof(RayGenSpecialization);
+	spec_info.pData = &spec;
 
 	VkPipelineShaderStageCreateInfo computeShaderStageInfo = {};
 	computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-	computeShaderStageInfo.module = finalModule;
+	computeShaderStageInfo.module = compModule;
 	computeShaderStageInfo.pName = "main";
+	computeShaderStageInfo.pSpecializationInfo = &spec_info;
+
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(WavefrontPushConstants);
 
 	VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
 	pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutCreateInfo.setLayoutCount = 1;
 	pipelineLayoutCreateInfo.pSetLayouts = &m_args->descriptorSetLayout;
+	pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+	pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
 
-	vkCreatePipelineLayout(ctx.device(), &pipelineLayoutCreateInfo, 0, &m_comp_pipeline->pipelineLayout);
+	vkCreatePipelineLayout(ctx.device(), &pipelineLayoutCreateInfo, 0, &pipeline->pipelineLayout);
 
 	VkComputePipelineCreateInfo pipelineInfo = {};
 	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
 	pipelineInfo.stage = computeShaderStageInfo;
-	pipelineInfo.layout = m_comp_pipeline->pipelineLayout;
+	pipelineInfo.layout = pipeline->pipelineLayout;
 
-	vkCreateComputePipelines(ctx.device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_comp_pipeline->pipeline);
+	vkCreateComputePipelines(ctx.device(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline->pipeline);
 
-	vkDestroyShaderModule(ctx.device(), finalModule, nullptr);
+	vkDestroyShaderModule(ctx.device(), compModule, nullptr);
 }
 
-void PathTracer::_comp_pipeline_release()
+void PathTracer::_comp_pipeline_release(ComputePipelineResource* pipeline)
 {
 	Context& ctx = Context::get_context();
-	vkDestroyPipelineLayout(ctx.device(), m_comp_pipeline->pipelineLayout, nullptr);
-	vkDestroyPipeline(ctx.device(), m_comp_pipeline->pipeline, nullptr);
+	vkDestroyPipelineLayout(ctx.device(), pipeline->pipelineLayout, nullptr);
+	vkDestroyPipeline(ctx.device(), pipeline->pipeline, nullptr);
 }
 
-#include "rand_state_init.hpp"
+#include "rand_state_init_poly.h"
+#include "rand_state_cache.h"
+#include "gf2_kernels.h"
+#include "ThreadPool.h"
+#include <chrono>
+
+#define RAND_SEED 1234
 
-void PathTracer::_rand_init_cpu()
+static void rand_states_generate(RNGState* states, unsigned count, bool stride)
 {
-	unsigned count = unsigned(m_target->width()*m_target->height());
-	RNGState* states = new RNGState[count];
+	RNGPoly rng;
 
-	RNG rng;
-	rng.p_sequence_matrix = xorwow_sequence_matrix;
-	rng.p_offset_matrix = xorwow_offset_matrix;
+	ThreadPool& pool = ThreadPool::get_pool();
+	if (stride)
+	{
+		pool.parallel_for(count, 4096, [&rng, states](size_t begin, size_t end, unsigned)
+		{
+			rng.state_init_stride(RAND_SEED, begin, end - begin, states + begin);
+		});
+	}
+	else
+	{
+		pool.parallel_for(count, 256, [&rng, states](size_t begin, size_t end, unsigned)
+		{
+			for (size_t i = begin; i < end; i++)
+				rng.state_init(RAND_SEED, i, 0, states[i]);
+		});
+	}
+}
 
-	for (int i = 0; i < m_target->width()*m_target->height(); i++)
-		rng.state_init(1234, i, 0, states[i]);
+void PathTracer::_rand_init_cpu(bool stride, RNGState* host_states, bool upload)
+{
+	unsigned count = unsigned(m_target->width()*m_target->height());
+	auto t0 = std::chrono::steady_clock::now();
 
-	Context& ctx = Context::get_context();
-	ctx.buffer_upload(*m_rand_states, states);
+	if (host_states != nullptr)
+	{
+		rand_states_generate(host_states, count, stride);
+		if (upload)
+			Context::get_context().buffer_upload(*m_rand_states, host_states);
+	}
+	else
+	{
+		Context::get_context().buffer_upload_inplace(*m_rand_states, [count, stride](void* data)
+		{
+			rand_states_generate((RNGState*)data, count, stride);
+		});
+	}
 
-	delete[] states;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	if (m_options.verbose)
+		printf("RNG init: %u states in %.1f ms, %.3f Mstates/s (%s, %s, %u threads)\n", count, ms, (double)count / ms * 1e-3, stride ? "stride" : "per-pixel", gf2_kernels().isa, ThreadPool::get_pool().num_threads());
 }
 
+#ifdef USE_CUDA
+
 #ifdef _WIN64 // For windows
 HANDLE getVkMemHandle(BufferResource& buf, VkExternalMemoryHandleTypeFlagsKHR externalMemoryHandleType)
 {
@@ -929,46 +1270,207 @@ void PathTracer::_rand_init_cuda()
 	delete[] h_states;*/
 }
 
+#endif
 
-PathTracer::PathTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres)
+void PathTracer::_rand_init()
 {
-	Context& ctx = Context::get_context();
+	unsigned count = unsigned(m_target->width()*m_target->height());
+
+	// the CPU backend keeps the states in host memory
+	RNGState* host_states = m_cpu != nullptr ? m_cpu->rand_states() : nullptr;
+
+	RandStateCache* cache = nullptr;
+	RNGState* cache_states = nullptr;
+	if (m_options.rand_cache_dir != nullptr)
+	{
+		cache = new RandStateCache(m_options.rand_cache_dir, RAND_SEED, count);
+		const RNGState* cached = cache->load();
+		if (cached != nullptr)
+		{
+			if (host_states != nullptr)
+				memcpy(host_states, cached, sizeof(RNGState) * count);
+			else
+				Context::get_context().buffer_upload(*m_rand_states, cached);
+			if (m_options.verbose)
+				printf("RNG init: %u states loaded from %s\n", count, cache->path().c_str());
+			delete cache;
+			return;
+		}
+		cache_states = cache->create();
+	}
+
+	if (host_states != nullptr)
+	{
+		_rand_init_cpu(m_options.rand_init == RandInit::Stride, host_states, false);
+		if (cache_states != nullptr)
+			memcpy(cache_states, host_states, sizeof(RNGState) * count);
+	}
+#ifdef USE_CUDA
+	else if (m_options.rand_init == RandInit::CUDA)
+	{
+		_rand_init_cuda();
+		if (cache_states != nullptr)
+			Context::get_context().buffer_download(*m_rand_states, cache_states);
+	}
+#endif
+	else
+		_rand_init_cpu(m_options.rand_init == RandInit::Stride, cache_states, true);
 
+	if (cache_states != nullptr)
+		cache->commit();
+	delete cache;
+}
+
+
+PathTracer::PathTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres, const PathTracerOptions& options)
+{
+	m_options = options;
 	m_target = target;
 
+	set_camera({ 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f }, 90.0f);
+	set_depth_policy(10, 10);
+	set_samples_per_launch(1);
+	m_environment = nullptr;
+	m_avg_path_length = 0.0f;
+	m_avg_samples = 0.0f;
+
+	m_light_bvh = new LightBVH;
+	m_light_bvh->build(triangle_meshes, spheres);
+	if (m_options.verbose)
+		m_light_bvh->print_stats();
+
+	m_cpu = nullptr;
+	if (m_options.backend == Backend::CPU)
+	{
+		m_cpu = new CPUTracer(target, triangle_meshes, spheres, m_light_bvh, m_options);
+		if (m_options.rand_mode == RandMode::XorWow)
+			_rand_init();
+		return;
+	}
+
+	Context& ctx = Context::get_context();
+
 	m_tlas = new AccelerationResource;
 	_tlas_create(triangle_meshes, spheres);
 
 	m_params_raygen = new BufferResource;
 	ctx.buffer_create(*m_params_raygen, sizeof(RayGenParams));
 
+	// the lights, nodes and light indices of the light BVH
+	{
+		const std::vector<Light>& lights = m_light_bvh->lights();
+		const std::vector<LightNode>& nodes = m_light_bvh->nodes();
+		const std::vector<unsigned>& indices = m_light_bvh->light_indices();
+		size_t size_lights = sizeof(Light) * lights.size();
+		size_t size_nodes = sizeof(LightNode) * nodes.size();
+		std::vector<char> hdata(size_lights + size_nodes + sizeof(unsigned) * indices.size());
+		if (hdata.size() > 0)
+		{
+			memcpy(hdata.data(), lights.data(), size_lights);
+			memcpy(hdata.data() + size_lights, nodes.data(), size_nodes);
+			memcpy(hdata.data() + size_lights + size_nodes, indices.data(), sizeof(unsigned) * indices.size());
+		}
+		m_lights = new BufferResource;
+		ctx.buffer_create(*m_lights, hdata.size());
+		if (hdata.size() > 0)
+			ctx.buffer_upload(*m_lights, hdata.data());
+	}
+
+	size_t size_rand_states = 0;
+	if (m_options.rand_mode == RandMode::XorWow)
+		size_rand_states = sizeof(RNGState) * m_target->width()*m_target->height();
+
 	m_rand_states = new BufferResource;
-	ctx.buffer_create(*m_rand_states, sizeof(RNGState) * m_target->width()*m_target->height(), true);
+#ifdef USE_CUDA
+	ctx.buffer_create(*m_rand_states, size_rand_states, m_options.rand_init == RandInit::CUDA);
+#else
+	ctx.buffer_create(*m_rand_states, size_rand_states);
+#endif
 	
+	m_sobol_dirs = new BufferResource;
+	if (m_options.sampler == Sampler::Sobol)
+	{
+		unsigned dirs[64];
+		sobol_directions_2d(dirs);
+		ctx.buffer_create(*m_sobol_dirs, sizeof(dirs));
+		ctx.buffer_upload(*m_sobol_dirs, dirs);
+	}
+	else
+	{
+		ctx.buffer_create(*m_sobol_dirs, 0);
+	}
+
+	// segments per row, then samples per row (written by regen.rgen only)
+	m_path_stats = new BufferResource;
+	ctx.buffer_create(*m_path_stats, sizeof(unsigned) * 2 * m_target->height());
+
+	size_t num_paths = 0;
+	if (m_options.path_schedule == PathSchedule::Wavefront)
+		num_paths = (size_t)m_target->width() * m_target->height();
+	m_paths = new BufferResource;
+	ctx.buffer_create(*m_paths, sizeof(WavefrontPath) * num_paths);
+	m_hits = new BufferResource;
+	ctx.buffer_create(*m_hits, sizeof(glm::vec4) * 3 * num_paths);
+	m_queues = new BufferResource;
+	ctx.buffer_create(*m_queues, sizeof(unsigned) * 3 * num_paths);
+	m_queue_counts = new BufferResource;
+	ctx.buffer_create(*m_queue_counts, num_paths > 0 ? sizeof(unsigned) * 3 : 0);
+	// origin, direction and radiance of the sky and the light sample of every path
+	m_shadow_rays = new BufferResource;
+	ctx.buffer_create(*m_shadow_rays, m_options.next_event ? sizeof(glm::vec4) * 3 * 2 * num_paths : 0);
+
 	m_args = new ArgumentResource;
 	m_rt_pipeline = new RTPipelineResource;
 	m_comp_pipeline = new ComputePipelineResource;
 
 	_args_create();
 	_rt_pipeline_create();
-	_comp_pipeline_create();
+	_comp_pipeline_create(m_comp_pipeline, "../shaders/final.spv");
 
-	set_camera({ 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f }, 90.0f);
+	m_generate_pipeline = nullptr;
+	m_shade_pipeline = nullptr;
+	m_accumulate_pipeline = nullptr;
+	if (m_options.path_schedule == PathSchedule::Wavefront)
+	{
+		m_generate_pipeline = new ComputePipelineResource;
+		_comp_pipeline_create(m_generate_pipeline, "../shaders/wf_generate.spv");
+		m_shade_pipeline = new ComputePipelineResource;
+		_comp_pipeline_create(m_shade_pipeline, "../shaders/wf_shade.spv");
+		m_accumulate_pipeline = new ComputePipelineResource;
+		_comp_pipeline_create(m_accumulate_pipeline, "../shaders/wf_accumulate.spv");
+	}
 
+	// allocated and begun by every trace(), queue_submit() ends it
 	m_cmdbuf = new CommandBufferResource;
-	ctx.command_buffer_create(*m_cmdbuf);
 
-	_rand_init_cuda();
+	if (m_options.rand_mode == RandMode::XorWow)
+		_rand_init();
 }
 
 PathTracer::~PathTracer()
 {
+	if (m_cpu != nullptr)
+	{
+		delete m_cpu;
+		delete m_light_bvh;
+		return;
+	}
+
 	Context& ctx = Context::get_context();
 
-	ctx.command_buffer_release(*m_cmdbuf);
 	delete m_cmdbuf;
 
-	_comp_pipeline_release();
+	if (m_generate_pipeline != nullptr)
+	{
+		_comp_pipeline_release(m_accumulate_pipeline);
+		delete m_accumulate_pipeline;
+		_comp_pipeline_release(m_shade_pipeline);
+		delete m_shade_pipeline;
+		_comp_pipeline_release(m_generate_pipeline);
+		delete m_generate_pipeline;
+	}
+
+	_comp_pipeline_release(m_comp_pipeline);
 	delete m_comp_pipeline;
 
 	_rt_pipeline_release();
@@ -977,9 +1479,30 @@ PathTracer::~PathTracer()
 	_args_release();
 	delete m_args;
 
+	ctx.buffer_release(*m_shadow_rays);
+	delete m_shadow_rays;
+	ctx.buffer_release(*m_queue_counts);
+	delete m_queue_counts;
+	ctx.buffer_release(*m_queues);
+	delete m_queues;
+	ctx.buffer_release(*m_hits);
+	delete m_hits;
+	ctx.buffer_release(*m_paths);
+	delete m_paths;
+
+	ctx.buffer_release(*m_path_stats);
+	delete m_path_stats;
+
+	ctx.buffer_release(*m_sobol_dirs);
+	delete m_sobol_dirs;
+
 	ctx.buffer_release(*m_rand_states);	
 	delete m_rand_states;
 
+	ctx.buffer_release(*m_lights);
+	delete m_lights;
+	delete m_light_bvh;
+
 	ctx.buffer_release(*m_params_raygen);
 	delete m_params_raygen;
 
@@ -1010,14 +1533,38 @@ void PathTracer::_update_args(int num_iter)
 	raygen_params.ux = glm::vec4(m_ux, 1.0f);
 	raygen_params.uy = glm::vec4(m_uy, 1.0f);
 	raygen_params.num_iter = num_iter;
+	raygen_params.min_depth = m_min_depth;
+	raygen_params.max_depth = m_max_depth;
+	raygen_params.pad0 = 0;
+
+	EnvironmentView env_view = {};
+	if (m_environment != nullptr)
+	{
+		VkDeviceAddress base = ctx.buffer_get_device_address(*m_environment->data());
+		env_view.texels = base;
+		env_view.rows = base + m_environment->rows_offset();
+		env_view.texel_tables = base + m_environment->texel_tables_offset();
+		env_view.width = m_environment->width();
+		env_view.height = m_environment->height();
+	}
+	raygen_params.env = env_view;
+
+	LightTreeView light_tree_view = {};
+	if (m_light_bvh->lights().size() > 0)
+	{
+		VkDeviceAddress base = ctx.buffer_get_device_address(*m_lights);
+		light_tree_view.lights = base;
+		light_tree_view.nodes = base + sizeof(Light) * m_light_bvh->lights().size();
+		light_tree_view.indices = light_tree_view.nodes + sizeof(LightNode) * m_light_bvh->nodes().size();
+		light_tree_view.num_lights = (int)m_light_bvh->lights().size();
+	}
+	raygen_params.light_tree = light_tree_view;
 
 	ctx.buffer_upload(*m_params_raygen, &raygen_params);
 }
 
 void PathTracer::set_camera(glm::vec3 lookfrom, glm::vec3 lookat, glm::vec3 vup, float vfov)
 {
-	Context& ctx = Context::get_context();
-
 	float focus_dist = 1.0f;
 
 	m_origin = lookfrom;
@@ -1037,33 +1584,159 @@ void PathTracer::set_camera(glm::vec3 lookfrom, glm::vec3 lookat, glm::vec3 vup,
 	m_uy = -size_pix * axis_y;
 }
 
+void PathTracer::set_depth_policy(int min_depth, int max_depth)
+{
+	m_min_depth = min_depth;
+	m_max_depth = max_depth;
+}
+
+void PathTracer::set_samples_per_launch(int samples_per_launch)
+{
+	m_samples_per_launch = samples_per_launch > 0 ? samples_per_launch : 1;
+}
+
+void PathTracer::set_environment(const EnvironmentMap* environment)
+{
+	m_environment = environment;
+}
+
+// memory dependency of everything after it on all shader and transfer writes before
+static void cmd_barrier(VkCommandBuffer cmdbuf, VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages)
+{
+	VkMemoryBarrier memoryBarrier = {};
+	memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmdbuf, src_stages, dst_stages, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+// Per iteration: wf_generate, then per depth wf_extend and wf_shade, then wf_accumulate. The queue
+// lengths stay on the device, so every extend and shade covers the whole image and the threads past
+// the end of the queue return at once; once all paths have ended the remaining depths cost only these
+// empty launches. With next-event estimation each extend also traces the shadow rays of queue 2, which
+// the shade before it filled; shade writes none at max_depth, so the last extend leaves none behind.
+void PathTracer::_record_wavefront(int num_iter)
+{
+	Context& ctx = Context::get_context();
+	VkCommandBuffer cmdbuf = m_cmdbuf->buf;
+	unsigned progIdSize = ctx.raytracing_properties().shaderGroupHandleSize;
+	unsigned num_paths = (unsigned)(m_target->width() * m_target->height());
+	unsigned group_x = (unsigned)(m_target->width() + 15) / 16;
+	unsigned group_y = (unsigned)(m_target->height() + 15) / 16;
+	unsigned group_shade = (num_paths + 255) / 256;
+	VkPipelineStageFlags all_stages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipelineLayout, 0, 1, &m_args->descriptorSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_shade_pipeline->pipelineLayout, 0, 1, &m_args->descriptorSet, 0, nullptr);
+	vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipeline);
+
+	for (int i = 0; i < num_iter; i++)
+	{
+		WavefrontPushConstants push_constants;
+		push_constants.iter = i;
+		push_constants.depth = 0;
+
+		// queue 0 lists every path, queues 1 and 2 are filled by the first shade
+		cmd_barrier(cmdbuf, all_stages, all_stages);
+		vkCmdFillBuffer(cmdbuf, m_queue_counts->buf, 0, sizeof(unsigned), num_paths);
+		vkCmdFillBuffer(cmdbuf, m_queue_counts->buf, sizeof(unsigned), sizeof(unsigned) * 2, 0);
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_generate_pipeline->pipeline);
+		vkCmdPushConstants(cmdbuf, m_generate_pipeline->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(WavefrontPushConstants), &push_constants);
+		vkCmdDispatch(cmdbuf, group_x, group_y, 1);
+
+		for (int depth = 0; depth < m_max_depth; depth++)
+		{
+			push_constants.depth = depth;
+			cmd_barrier(cmdbuf, all_stages, all_stages);
+			vkCmdPushConstants(cmdbuf, m_rt_pipeline->pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_NV, 0, sizeof(WavefrontPushConstants), &push_constants);
+			vkCmdTraceRaysNV(cmdbuf,
+				m_rt_pipeline->shaderBindingTableBuffer, 0,
+				m_rt_pipeline->shaderBindingTableBuffer, progIdSize, progIdSize,
+				m_rt_pipeline->shaderBindingTableBuffer, progIdSize * 3, progIdSize,
+				VK_NULL_HANDLE, 0, 0, m_target->width(), m_target->height(), 1);
+
+			// the shadow rays just traced make room for those of this shade
+			cmd_barrier(cmdbuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, VK_PIPELINE_STAGE_TRANSFER_BIT);
+			vkCmdFillBuffer(cmdbuf, m_queue_counts->buf, sizeof(unsigned) * 2, sizeof(unsigned), 0);
+			cmd_barrier(cmdbuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+			vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_shade_pipeline->pipeline);
+			vkCmdPushConstants(cmdbuf, m_shade_pipeline->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(WavefrontPushConstants), &push_constants);
+			vkCmdDispatch(cmdbuf, group_shade, 1, 1);
+
+			// the queue just consumed receives the survivors of the next shade
+			cmd_barrier(cmdbuf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+			vkCmdFillBuffer(cmdbuf, m_queue_counts->buf, sizeof(unsigned) * (depth & 1), sizeof(unsigned), 0);
+		}
+
+		cmd_barrier(cmdbuf, all_stages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_accumulate_pipeline->pipeline);
+		vkCmdPushConstants(cmdbuf, m_accumulate_pipeline->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(WavefrontPushConstants), &push_constants);
+		vkCmdDispatch(cmdbuf, group_x, group_y, 1);
+	}
+
+	cmd_barrier(cmdbuf, all_stages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+}
+
 void PathTracer::trace(int num_iter)
 {
+	if (m_cpu != nullptr)
+	{
+		CPUTraceParams params;
+		params.origin = m_origin;
+		params.upper_left = m_upper_left;
+		params.ux = m_ux;
+		params.uy = m_uy;
+		params.num_iter = num_iter;
+		params.min_depth = m_min_depth;
+		params.max_depth = m_max_depth;
+		params.next_event = m_options.next_event;
+		params.environment = m_environment;
+		params.light_selection = m_options.light_selection;
+		m_cpu->trace(params);
+		m_avg_path_length = m_cpu->avg_path_length();
+		m_avg_samples = m_cpu->avg_samples();
+		return;
+	}
+
 	_update_args(num_iter);
 	Context& ctx = Context::get_context();
 
 	m_target->clear();
+	ctx.buffer_zero(*m_path_stats);
+	ctx.command_buffer_create(*m_cmdbuf, true);
 
 	unsigned progIdSize = ctx.raytracing_properties().shaderGroupHandleSize;
 
-	vkCmdBindPipeline(m_cmdbuf->buf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipeline);
-	vkCmdBindDescriptorSets(m_cmdbuf->buf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipelineLayout, 0, 1, &m_args->descriptorSet, 0, nullptr);
-
-	for (int i = 0; i < num_iter; i++)
+	if (m_options.path_schedule == PathSchedule::Wavefront)
+	{
+		_record_wavefront(num_iter);
+	}
+	else
 	{
-		vkCmdTraceRaysNV(m_cmdbuf->buf,
-			m_rt_pipeline->shaderBindingTableBuffer, 0,
-			m_rt_pipeline->shaderBindingTableBuffer, progIdSize, progIdSize,
-			m_rt_pipeline->shaderBindingTableBuffer, progIdSize * 3, progIdSize,
-			VK_NULL_HANDLE, 0, 0, m_target->width(), m_target->height(), 1);
-
-		VkMemoryBarrier memoryBarrier = {};
-		memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-		memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-		memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdBindPipeline(m_cmdbuf->buf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipeline);
+		vkCmdBindDescriptorSets(m_cmdbuf->buf, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, m_rt_pipeline->pipelineLayout, 0, 1, &m_args->descriptorSet, 0, nullptr);
+
+		for (int i = 0; i < num_iter; i += m_samples_per_launch)
+		{
+			RayGenPushConstants push_constants;
+			push_constants.iter = i;
+			push_constants.num_samples = num_iter - i < m_samples_per_launch ? num_iter - i : m_samples_per_launch;
+			vkCmdPushConstants(m_cmdbuf->buf, m_rt_pipeline->pipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_NV, 0, sizeof(RayGenPushConstants), &push_constants);
+
+			vkCmdTraceRaysNV(m_cmdbuf->buf,
+				m_rt_pipeline->shaderBindingTableBuffer, 0,
+				m_rt_pipeline->shaderBindingTableBuffer, progIdSize, progIdSize,
+				m_rt_pipeline->shaderBindingTableBuffer, progIdSize * 3, progIdSize,
+				VK_NULL_HANDLE, 0, 0, m_target->width(), m_target->height(), 1);
+
+			VkMemoryBarrier memoryBarrier = {};
+			memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
  
-		vkCmdPipelineBarrier(m_cmdbuf->buf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+			vkCmdPipelineBarrier(m_cmdbuf->buf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
 			
+		}
 	}
 
 	int group_x = (m_target->width() + 15) / 16;
@@ -1076,6 +1749,23 @@ void PathTracer::trace(int num_iter)
 
 	ctx.queue_submit(*m_cmdbuf);
 	ctx.queue_wait();
+	ctx.command_buffer_release(*m_cmdbuf);
+
+	int height = m_target->height();
+	std::vector<unsigned> row_stats(2 * height);
+	ctx.buffer_download(*m_path_stats, row_stats.data());
+	unsigned long long segments = 0;
+	unsigned long long samples = (unsigned long long)m_target->width() * height * num_iter;
+	for (int i = 0; i < height; i++)
+		segments += row_stats[i];
+	if (m_options.path_schedule == PathSchedule::Regeneration)
+	{
+		samples = 0;
+		for (int i = 0; i < height; i++)
+			samples += row_stats[height + i];
+	}
+	m_avg_path_length = (float)((double)segments / (double)samples);
+	m_avg_samples = (float)((double)samples / ((double)m_target->width() * height));
 }
 
 
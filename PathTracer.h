@@ -2,26 +2,36 @@
 
 #include <glm.hpp>
 #include <vector>
+#include "alias_table.h"
 
 struct AccelerationResource;
 struct BufferResource;
+struct RNGState;
 
 class Geometry
 {
 public:
 	const glm::vec3& color() const { return m_color; }
+	// radiance emitted by every point of the surface (color times intensity), zero for geometry that
+	// only reflects. Set before the PathTracer is created, which collects the emitters into its light BVH.
+	const glm::vec3& emission() const { return m_emission; }
+	void set_emission(const glm::vec3& emission) { m_emission = emission; }
 	const glm::mat4x4& model() const { return m_model; }
 	const glm::mat4x4& norm() const { return m_norm_mat; }
-	AccelerationResource* get_blas() const { return m_blas; }
+	// device buffers and BLAS are created on first use, so the CPU backend never touches Vulkan
+	AccelerationResource* get_blas() const;
 
 	Geometry(const glm::mat4x4& model, glm::vec3 color);
 	virtual ~Geometry();
 
 protected:
+	virtual void _device_create() const = 0;
+
 	glm::vec3 m_color;
+	glm::vec3 m_emission;
 	glm::mat4x4 m_model;
 	glm::mat4x4 m_norm_mat;
-	AccelerationResource* m_blas;
+	mutable AccelerationResource* m_blas;
 
 };
 
@@ -36,42 +46,52 @@ struct Vertex
 class TriangleMesh : public Geometry
 {
 public:
-	BufferResource* vertex_buffer() const { return m_vertexBuffer; }
-	BufferResource* index_buffer() const { return m_indexBuffer; }
+	BufferResource* vertex_buffer() const;
+	BufferResource* index_buffer() const;
+	const std::vector<Vertex>& vertices() const { return m_vertices; }
+	const std::vector<unsigned>& indices() const { return m_indices; }
 	
 	TriangleMesh(const glm::mat4x4& model, const std::vector<Vertex>& vertices, const std::vector<unsigned>& indices, glm::vec3 color = { 1.0f, 1.0f, 1.0f });
 	virtual ~TriangleMesh();
 
+protected:
+	virtual void _device_create() const;
+
 private:
-	void _blas_create();
+	void _blas_create() const;
 
-	unsigned m_vertexCount;
-	unsigned m_indexCount;
+	std::vector<Vertex> m_vertices;
+	std::vector<unsigned> m_indices;
 
-	BufferResource* m_vertexBuffer;
-	BufferResource* m_indexBuffer;
+	mutable BufferResource* m_vertexBuffer;
+	mutable BufferResource* m_indexBuffer;
 };
 
 
 class UnitSphere : public Geometry
 {
 public:
-	BufferResource* aabb_buffer() const { return m_aabb_buf; }
+	BufferResource* aabb_buffer() const;
 
 	UnitSphere(const glm::mat4x4& model, glm::vec3 color = { 1.0f, 1.0f, 1.0f });
 	virtual ~UnitSphere();
 
+protected:
+	virtual void _device_create() const;
 
 private:
-	void _blas_create();
-	BufferResource* m_aabb_buf;
+	void _blas_create() const;
+	mutable BufferResource* m_aabb_buf;
 
 };
 
 class Image
 {
 public:
-	BufferResource* data() const { return m_data; }
+	// float4 pixels, either in a device buffer (GPU backend) or in host memory (CPU backend),
+	// whichever is asked for first
+	BufferResource* data() const;
+	float* host_data();
 	int width() const { return m_width; }
 	int height() const { return m_height; }
 
@@ -82,26 +102,143 @@ public:
 	void to_host(void *hdata) const;
 
 private:
-	BufferResource* m_data;
+	mutable BufferResource* m_data;
+	mutable std::vector<float> m_hdata;
 	int m_width;
 	int m_height;
 
 };
 
+// An equirectangular HDR map lighting the rays that leave the scene, in place of the gradient sky.
+// Row 0 is at the zenith (+y), row height-1 at the nadir, and column u of width covers the azimuths
+// around atan2(z, x) = 2*pi*(u + 0.5)/width. Texels are drawn with a probability proportional to
+// their luminance times the solid angle they cover, through an alias table over the rows and one over
+// the texels of every row, built in O(width*height) by the constructor.
+class EnvironmentMap
+{
+public:
+	// rgb: width*height linear radiance triplets, top row first, scaled by intensity
+	EnvironmentMap(int width, int height, const float* rgb, float intensity = 1.0f);
+	~EnvironmentMap();
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+
+	// the functions of environment.shinc on the host
+	glm::vec3 radiance(const glm::vec3& direction) const;
+	float pdf(const glm::vec3& direction) const;  // solid angle density of sample()
+	glm::vec3 sample(glm::vec2 u) const;
+
+	// device buffer created on first use: the texels (rgb radiance, probability in w), then the row
+	// table and the texel tables of the rows
+	BufferResource* data() const;
+	size_t rows_offset() const { return sizeof(glm::vec4) * m_texels.size(); }
+	size_t texel_tables_offset() const { return rows_offset() + sizeof(AliasEntry) * m_rows.size(); }
+
+private:
+	int _texel(const glm::vec3& direction) const;
+
+	int m_width;
+	int m_height;
+	std::vector<glm::vec4> m_texels;
+	std::vector<AliasEntry> m_rows;
+	std::vector<AliasEntry> m_texel_tables;
+	mutable BufferResource* m_data;
+
+};
+
+enum class RandInit
+{
+	CUDA,     // per-pixel jump-ahead on the GPU, falls back to PerPixel without USE_CUDA or on the CPU backend
+	PerPixel, // per-pixel jump-ahead on all CPU cores
+	Stride    // one jump-ahead per chunk of pixels, then one 2^67-step matrix-vector product per pixel
+};
+
+enum class RandMode
+{
+	XorWow,  // per-pixel xorwow states kept in a device buffer
+	Counter  // stateless hash of (pixel, iteration, bounce, dimension), no state buffer, no initialization
+};
+
+enum class Sampler
+{
+	Independent, // independent uniforms from the RNG
+	Sobol        // Owen-scrambled Sobol, indexed by (pixel, iteration, dimension)
+};
+
+enum class Backend
+{
+	Vulkan, // VK_NV_ray_tracing pipeline
+	CPU     // native port of the shaders on all CPU cores, no GPU required
+};
+
+enum class LightSelection
+{
+	Contribution, // down the light BVH by the power, distance and orientation of each subtree to the shading point
+	Power         // down the light BVH by power alone, the distribution of a power-weighted alias table
+};
+
+enum class TileOrder
+{
+	TileMajor,     // a thread traces all iterations of a tile before taking the next one
+	IterationMajor // all tiles of an iteration before the next iteration, the image converges evenly
+};
+
+enum class PathSchedule
+{
+	Megakernel,  // one thread traces whole paths, it stays busy until the longest path of its launch ends
+	Wavefront,   // generate, extend, shade and accumulate stages, the live paths compacted into queues between them
+	Regeneration // a thread whose path ends starts the next sample of its pixel while others of its subgroup
+	             // (CPU: of its 8x8 packet) still need samples, so pixels get at least num_iter samples;
+	             // that count depends on the paths, which biases a pixel by O(1/samples)
+};
+
+struct PathTracerOptions
+{
+	Backend backend = Backend::Vulkan;
+	RandMode rand_mode = RandMode::XorWow;
+	Sampler sampler = Sampler::Independent;
+	PathSchedule path_schedule = PathSchedule::Megakernel;
+	bool next_event = false;              // sample the sky with a shadow ray at every diffuse vertex, combined by MIS
+	                                      // with the bounces reaching it, and likewise one light of the light BVH
+	                                      // when there are emitters
+	LightSelection light_selection = LightSelection::Contribution;
+	RandInit rand_init = RandInit::Stride;
+	const char* rand_cache_dir = nullptr; // when set, initialized RNG states are cached there across runs
+	bool cpu_packets = true;              // CPU backend: intersect the camera rays of 8x8 pixel tiles as packets
+	int cpu_tile_size = 8;                // CPU backend: edge in pixels of the tiles the threads schedule and steal
+	TileOrder cpu_tile_order = TileOrder::TileMajor;
+	bool verbose = false;                 // print the timings and statistics of the RNG initialization, the builds and every trace()
+};
+
 struct ArgumentResource;
 struct RTPipelineResource;
 struct ComputePipelineResource;
 struct CommandBufferResource;
+class CPUTracer;
+class LightBVH;
 
 class PathTracer
 {
 public:
-	PathTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres);
+	PathTracer(Image* target, const std::vector<const TriangleMesh*>& triangle_meshes, const std::vector<const UnitSphere*>& spheres, const PathTracerOptions& options = PathTracerOptions());
 	~PathTracer();
 
 	void set_camera(glm::vec3 lookfrom, glm::vec3 lookat, glm::vec3 vup, float vfov);
+	// paths always get min_depth segments, then continue by Russian roulette up to max_depth;
+	// the default (10, 10) is the fixed ten segments without Russian roulette of the original tracer
+	void set_depth_policy(int min_depth, int max_depth);
+	// number of iterations traced by each raygen thread per vkCmdTraceRaysNV, 1 by default
+	void set_samples_per_launch(int samples_per_launch);
+	// the sky of the rays leaving the scene, nullptr for the gradient; the map must outlive the traces
+	void set_environment(const EnvironmentMap* environment);
 	void trace(int num_iter = 100);
 
+	// average number of traced segments per sample during the last trace()
+	float avg_path_length() const { return m_avg_path_length; }
+	// average number of samples per pixel during the last trace(), above num_iter with PathSchedule::Regeneration
+	float avg_samples() const { return m_avg_samples; }
+
 private:
 	void _update_args(int num_iter);
 
@@ -111,12 +248,20 @@ private:
 	void _rt_pipeline_create();
 	void _rt_pipeline_release();
 
-	void _comp_pipeline_create();
-	void _comp_pipeline_release();
+	void _comp_pipeline_create(ComputePipelineResource* pipeline, const char* fn);
+	void _comp_pipeline_release(ComputePipelineResource* pipeline);
+
+	void _record_wavefront(int num_iter);
 
-	void _rand_init_cpu();
+	void _rand_init();
+	void _rand_init_cpu(bool stride, RNGState* host_states, bool upload);
+#ifdef USE_CUDA
 	void _rand_init_cuda();
+#endif
 
+	PathTracerOptions m_options;
+	CPUTracer* m_cpu;
+	LightBVH* m_light_bvh; // the emitters, built by the constructor for both backends
 	AccelerationResource* m_tlas;
 	Image* m_target;
 	BufferResource* m_triangleMeshes;
@@ -125,13 +270,30 @@ private:
 	glm::vec3 m_upper_left;
 	glm::vec3 m_ux;
 	glm::vec3 m_uy;
+	int m_min_depth;
+	int m_max_depth;
+	int m_samples_per_launch;
+	const EnvironmentMap* m_environment;
+	float m_avg_path_length;
+	float m_avg_samples;
 
 	BufferResource* m_params_raygen;
+	BufferResource* m_lights;       // lights, nodes and light indices of m_light_bvh
 	BufferResource* m_rand_states;
+	BufferResource* m_sobol_dirs;
+	BufferResource* m_path_stats;
+	BufferResource* m_paths;        // PathSchedule::Wavefront: path states, hits, queues, queue lengths
+	BufferResource* m_hits;         // and, with next_event, the shadow rays
+	BufferResource* m_queues;
+	BufferResource* m_queue_counts;
+	BufferResource* m_shadow_rays;
 	
 	ArgumentResource* m_args;
 	RTPipelineResource* m_rt_pipeline;
 	ComputePipelineResource* m_comp_pipeline;
+	ComputePipelineResource* m_generate_pipeline; // PathSchedule::Wavefront only
+	ComputePipelineResource* m_shade_pipeline;
+	ComputePipelineResource* m_accumulate_pipeline;
 	CommandBufferResource* m_cmdbuf;
 	
 };
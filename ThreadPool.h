@@ -0,0 +1,256 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <chrono>
+
+// what one thread did during a parallel_for_stealing()
+struct ThreadWorkStats
+{
+	double busy_ms;  // time spent in the item function
+	unsigned items;
+	unsigned steals; // successful steals, each takes half of the victim's remaining items
+};
+
+class ThreadPool
+{
+public:
+	static ThreadPool& get_pool()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	unsigned num_threads() const { return (unsigned)m_workers.size() + 1; }
+
+	// Runs job(ctx, thread_id) once on every thread of the pool (the calling thread being thread 0),
+	// returns when all of them have finished.
+	void run(void(*job)(void* ctx, unsigned thread_id), void* ctx)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_job = job;
+			m_ctx = ctx;
+			m_running = (unsigned)m_workers.size();
+			m_generation++;
+		}
+		m_cv_start.notify_all();
+
+		job(ctx, 0);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cv_done.wait(lock, [this]() { return m_running == 0; });
+	}
+
+	// Splits [0, count) into chunks of "grain" items which are handed out dynamically,
+	// func(begin, end, thread_id) is called for each chunk.
+	template<typename Func>
+	void parallel_for(size_t count, size_t grain, const Func& func)
+	{
+		if (count == 0) return;
+		if (grain == 0) grain = 1;
+
+		struct Range
+		{
+			const Func* func;
+			size_t count;
+			size_t grain;
+			std::atomic<size_t> next;
+		};
+
+		Range range;
+		range.func = &func;
+		range.count = count;
+		range.grain = grain;
+		range.next = 0;
+
+		run([](void* ctx, unsigned thread_id)
+		{
+			Range& r = *(Range*)ctx;
+			while (true)
+			{
+				size_t begin = r.next.fetch_add(r.grain);
+				if (begin >= r.count) break;
+				size_t end = begin + r.grain;
+				if (end > r.count) end = r.count;
+				(*r.func)(begin, end, thread_id);
+			}
+		}, &range);
+	}
+
+	// For items of uneven cost: every thread starts on its own contiguous share of [0, count) and
+	// takes items from its front, a thread that runs dry steals the back half of the largest
+	// remaining share. func(item, thread_id) is called for each item. stats, when given, gets one
+	// entry per thread. The shares are kept by the pool, no call touches the heap once stats has
+	// reached its size.
+	template<typename Func>
+	void parallel_for_stealing(size_t count, const Func& func, std::vector<ThreadWorkStats>* stats = nullptr)
+	{
+		unsigned n = num_threads();
+		if (stats != nullptr) stats->assign(n, ThreadWorkStats());
+		if (count == 0) return;
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			unsigned long long begin = count * i / n;
+			unsigned long long end = count * (i + 1) / n;
+			m_shares[i].range = begin | (end << 32);
+		}
+
+		struct Job
+		{
+			ThreadPool* pool;
+			const Func* func;
+		};
+		Job job = { this, &func };
+
+		run([](void* ctx, unsigned thread_id)
+		{
+			Job& job = *(Job*)ctx;
+			ThreadWorkStats stats = {};
+			std::chrono::steady_clock::duration busy(0);
+			while (true)
+			{
+				unsigned item;
+				if (!job.pool->_pop(thread_id, item))
+				{
+					if (!job.pool->_steal(thread_id)) break;
+					stats.steals++;
+					continue;
+				}
+				auto t0 = std::chrono::steady_clock::now();
+				(*job.func)(item, thread_id);
+				busy += std::chrono::steady_clock::now() - t0;
+				stats.items++;
+			}
+			stats.busy_ms = std::chrono::duration<double, std::milli>(busy).count();
+			job.pool->m_shares[thread_id].stats = stats;
+		}, &job);
+
+		if (stats != nullptr)
+			for (unsigned i = 0; i < n; i++)
+				(*stats)[i] = m_shares[i].stats;
+	}
+
+private:
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_cv_start;
+	std::condition_variable m_cv_done;
+	void(*m_job)(void* ctx, unsigned thread_id) = nullptr;
+	void* m_ctx = nullptr;
+	unsigned m_running = 0;
+	unsigned long long m_generation = 0;
+	bool m_quit = false;
+
+	// The share of a thread in parallel_for_stealing() as begin | end << 32, so that the owner and
+	// the thieves update it with one CAS. Items are handed out only once, so a share never returns
+	// to a value a thief saw. The padding keeps the shares on separate cache lines.
+	struct Share
+	{
+		std::atomic<unsigned long long> range;
+		ThreadWorkStats stats;
+		char pad[64 - sizeof(std::atomic<unsigned long long>) - sizeof(ThreadWorkStats)];
+	};
+	std::vector<Share> m_shares;
+
+	bool _pop(unsigned thread_id, unsigned& item)
+	{
+		std::atomic<unsigned long long>& range = m_shares[thread_id].range;
+		unsigned long long r = range.load();
+		while (true)
+		{
+			unsigned begin = (unsigned)r;
+			unsigned end = (unsigned)(r >> 32);
+			if (begin >= end) return false;
+			if (range.compare_exchange_weak(r, (begin + 1) | ((unsigned long long)end << 32)))
+			{
+				item = begin;
+				return true;
+			}
+		}
+	}
+
+	// false when no share has items left
+	bool _steal(unsigned thread_id)
+	{
+		unsigned n = num_threads();
+		while (true)
+		{
+			unsigned victim = n;
+			unsigned most = 0;
+			for (unsigned i = 0; i < n; i++)
+			{
+				unsigned long long r = m_shares[i].range.load();
+				unsigned begin = (unsigned)r;
+				unsigned end = (unsigned)(r >> 32);
+				if (begin < end && end - begin > most)
+				{
+					victim = i;
+					most = end - begin;
+				}
+			}
+			if (victim == n) return false;
+
+			std::atomic<unsigned long long>& range = m_shares[victim].range;
+			unsigned long long r = range.load();
+			unsigned begin = (unsigned)r;
+			unsigned end = (unsigned)(r >> 32);
+			if (begin >= end) continue;
+			unsigned half = (end - begin + 1) / 2;
+			if (!range.compare_exchange_strong(r, begin | ((unsigned long long)(end - half) << 32))) continue;
+			m_shares[thread_id].range.store((end - half) | ((unsigned long long)end << 32));
+			return true;
+		}
+	}
+
+	void _worker(unsigned thread_id)
+	{
+		unsigned long long generation = 0;
+		while (true)
+		{
+			void(*job)(void* ctx, unsigned thread_id);
+			void* ctx;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv_start.wait(lock, [this, generation]() { return m_quit || m_generation != generation; });
+				if (m_quit) return;
+				generation = m_generation;
+				job = m_job;
+				ctx = m_ctx;
+			}
+
+			job(ctx, thread_id);
+
+			bool last;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				last = (--m_running == 0);
+			}
+			if (last) m_cv_done.notify_one();
+		}
+	}
+
+	ThreadPool()
+	{
+		unsigned count = std::thread::hardware_concurrency();
+		if (count < 1) count = 1;
+		m_shares = std::vector<Share>(count);
+		for (unsigned i = 1; i < count; i++)
+			m_workers.push_back(std::thread(&ThreadPool::_worker, this, i));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_cv_start.notify_all();
+		for (size_t i = 0; i < m_workers.size(); i++)
+			m_workers[i].join();
+	}
+};
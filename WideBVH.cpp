@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "WideBVH.h"
+#include "cpu_features.h"
+
+static inline float half_area(const BVHNode& node)
+{
+	glm::vec3 e = node.bounds_max - node.bounds_min;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+unsigned WideBVH::_collapse(const std::vector<BVHNode>& binary, unsigned index)
+{
+	unsigned children[WIDE_BVH_WIDTH];
+	int num_children = 0;
+	if (binary[index].count > 0)
+	{
+		// a binary BVH that is a single leaf
+		children[num_children++] = index;
+	}
+	else
+	{
+		children[num_children++] = index + 1;
+		children[num_children++] = binary[index].offset;
+	}
+
+	// open the largest inner child until the node is full, the larger a child the more likely it
+	// would be entered anyway
+	while (num_children < WIDE_BVH_WIDTH)
+	{
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (int i = 0; i < num_children; i++)
+		{
+			const BVHNode& c = binary[children[i]];
+			if (c.count > 0) continue;
+			float area = half_area(c);
+			if (area > largest_area)
+			{
+				largest = i;
+				largest_area = area;
+			}
+		}
+		if (largest < 0) break;
+		unsigned c = children[largest];
+		children[largest] = c + 1;
+		children[num_children++] = binary[c].offset;
+	}
+
+	unsigned wide_index = (unsigned)m_nodes.size();
+	m_nodes.push_back(WideBVHNode());
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			m_nodes[wide_index].bounds[0][k][i] = INFINITY;
+			m_nodes[wide_index].bounds[1][k][i] = -INFINITY;
+		}
+		m_nodes[wide_index].child[i] = WIDE_BVH_LEAF;
+	}
+
+	for (int i = 0; i < num_children; i++)
+	{
+		const BVHNode& c = binary[children[i]];
+		unsigned child = c.count > 0 ? (WIDE_BVH_LEAF | children[i]) : _collapse(binary, children[i]);
+		WideBVHNode& node = m_nodes[wide_index]; // the recursion may have reallocated
+		for (int k = 0; k < 3; k++)
+		{
+			node.bounds[0][k][i] = c.bounds_min[k];
+			node.bounds[1][k][i] = c.bounds_max[k];
+		}
+		node.child[i] = child;
+	}
+	return wide_index;
+}
+
+void WideBVH::build(const BVH& bvh)
+{
+	m_nodes.clear();
+	const std::vector<BVHNode>& binary = bvh.nodes();
+	if (binary.size() == 0) return;
+	m_nodes.reserve(binary.size() / (WIDE_BVH_WIDTH / 2) + 1);
+	_collapse(binary, 0);
+}
+
+// scalar reference. The max/min keep the accumulated value when a product is NaN (0 * inf for a
+// ray in the plane of a slab), which is what MAXPS/MINPS do with the accumulator as second operand.
+
+static unsigned intersect_scalar(const WideBVHNode& node, const WideRay& ray, float tmax, float* t_near)
+{
+	unsigned mask = 0;
+	for (int i = 0; i < WIDE_BVH_WIDTH; i++)
+	{
+		float enter = ray.tmin;
+		float exit = tmax;
+		for (int k = 0; k < 3; k++)
+		{
+			float t0 = (node.bounds[ray.sign[k]][k][i] - ray.origin[k]) * ray.inv_dir[k];
+			float t1 = (node.bounds[1 - ray.sign[k]][k][i] - ray.origin[k]) * ray.inv_dir[k];
+			enter = t0 > enter ? t0 : enter;
+			exit = t1 < exit ? t1 : exit;
+		}
+		t_near[i] = enter;
+		if (enter <= exit) mask |= 1u << i;
+	}
+	return mask;
+}
+
+#ifdef CPU_X86
+
+// SSE: two groups of 4 children
+
+static inline unsigned intersect_sse_half(const WideBVHNode& node, const WideRay& ray, float tmax, int base, float* t_near)
+{
+	__m128 enter = _mm_set1_ps(ray.tmin);
+	__m128 exit = _mm_set1_ps(tmax);
+	for (int k = 0; k < 3; k++)
+	{
+		__m128 o = _mm_set1_ps(ray.origin[k]);
+		__m128 inv = _mm_set1_ps(ray.inv_dir[k]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[ray.sign[k]][k] + base), o), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[1 - ray.sign[k]][k] + base), o), inv);
+		enter = _mm_max_ps(t0, enter);
+		exit = _mm_min_ps(t1, exit);
+	}
+	_mm_storeu_ps(t_near + base, enter);
+	return (unsigned)_mm_movemask_ps(_mm_cmple_ps(enter, exit)) << base;
+}
+
+static unsigned intersect_sse(const WideBVHNode& node, const WideRay& ray, float tmax, float* t_near)
+{
+	return intersect_sse_half(node, ray, tmax, 0, t_near) | intersect_sse_half(node, ray, tmax, 4, t_near);
+}
+
+// AVX2: all children in one register
+
+TARGET_AVX2 static unsigned intersect_avx2(const WideBVHNode& node, const WideRay& ray, float tmax, float* t_near)
+{
+	__m256 enter = _mm256_set1_ps(ray.tmin);
+	__m256 exit = _mm256_set1_ps(tmax);
+	for (int k = 0; k < 3; k++)
+	{
+		__m256 o = _mm256_set1_ps(ray.origin[k]);
+		__m256 inv = _mm256_set1_ps(ray.inv_dir[k]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.sign[k]][k]), o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - ray.sign[k]][k]), o), inv);
+		enter = _mm256_max_ps(t0, enter);
+		exit = _mm256_min_ps(t1, exit);
+	}
+	_mm256_storeu_ps(t_near, enter);
+	return (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+}
+
+#endif
+
+static WideNodeKernels select_kernels()
+{
+	WideNodeKernels scalar = { "scalar", intersect_scalar };
+	const char* forced = getenv("WIDE_BVH_ISA");
+	if (forced != nullptr && strcmp(forced, "scalar") == 0) return scalar;
+
+#ifdef CPU_X86
+	WideNodeKernels sse = { "sse", intersect_sse };
+	WideNodeKernels avx2 = { "avx2", intersect_avx2 };
+
+	if (forced != nullptr && strcmp(forced, "sse") == 0) return sse;
+	if (cpu_has_avx2()) return avx2;
+	return sse;
+#else
+	return scalar;
+#endif
+}
+
+const WideNodeKernels& wide_node_kernels()
+{
+	static WideNodeKernels kernels = select_kernels();
+	return kernels;
+}
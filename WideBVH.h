@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glm.hpp>
+#include <vector>
+#include "BVH.h"
+
+#define WIDE_BVH_WIDTH 8
+#define WIDE_BVH_LEAF 0x80000000u
+#define WIDE_BVH_STACK_SIZE ((WIDE_BVH_WIDTH - 1) * 64 + 1)
+
+// The bounds of all children in structure-of-arrays form, [0] minimum and [1] maximum, so a ray
+// picks its near and far planes by the sign of its direction. Unused slots have inverted infinite
+// bounds and are never entered.
+struct WideBVHNode
+{
+	float bounds[2][3][WIDE_BVH_WIDTH];
+	unsigned child[WIDE_BVH_WIDTH]; // wide node index, or WIDE_BVH_LEAF | index of the leaf in BVH::nodes()
+};
+
+struct WideRay
+{
+	glm::vec3 origin;
+	glm::vec3 inv_dir;
+	int sign[3]; // 1 for negative direction components: the near plane is then the maximum
+	float tmin;
+};
+
+inline WideRay make_wide_ray(const glm::vec3& origin, const glm::vec3& direction, float tmin)
+{
+	WideRay ray;
+	ray.origin = origin;
+	ray.inv_dir = 1.0f / direction;
+	for (int k = 0; k < 3; k++)
+		ray.sign[k] = ray.inv_dir[k] < 0.0f ? 1 : 0;
+	ray.tmin = tmin;
+	return ray;
+}
+
+// Slab test of one ray against all children of a node. Returns the mask of the children entered
+// before tmax and writes their entry distances to t_near.
+typedef unsigned(*WideNodeIntersect)(const WideBVHNode& node, const WideRay& ray, float tmax, float* t_near);
+
+struct WideNodeKernels
+{
+	const char* isa;
+	WideNodeIntersect intersect;
+};
+
+// Best kernel for the running CPU, selected once by feature detection.
+// Setting the environment variable WIDE_BVH_ISA to "scalar", "sse" or "avx2" forces a variant.
+const WideNodeKernels& wide_node_kernels();
+
+// 8-ary BVH collapsed from a binary one: every node absorbs the children of its largest inner
+// children until it has WIDE_BVH_WIDTH of them. The leaves stay those of the binary BVH, which
+// must outlive this one.
+class WideBVH
+{
+public:
+	void build(const BVH& bvh);
+
+	const std::vector<WideBVHNode>& nodes() const { return m_nodes; }
+
+private:
+	unsigned _collapse(const std::vector<BVHNode>& binary, unsigned index);
+
+	std::vector<WideBVHNode> m_nodes;
+};
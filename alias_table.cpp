@@ -0,0 +1,45 @@
+#include <vector>
+#include "alias_table.h"
+
+void alias_table_build(const double* weights, int n, AliasEntry* table)
+{
+	double sum = 0.0;
+	for (int i = 0; i < n; i++)
+		sum += weights[i] > 0.0 ? weights[i] : 0.0;
+
+	for (int i = 0; i < n; i++)
+	{
+		table[i].prob = 1.0f;
+		table[i].alias = (unsigned)i;
+	}
+	if (!(sum > 0.0)) return;
+
+	// weights scaled to a mean of 1, the slots below and above it on two work lists
+	std::vector<double> q(n);
+	std::vector<int> small, large;
+	small.reserve(n);
+	large.reserve(n);
+	for (int i = 0; i < n; i++)
+	{
+		q[i] = (weights[i] > 0.0 ? weights[i] : 0.0) * (double)n / sum;
+		if (q[i] < 1.0) small.push_back(i);
+		else large.push_back(i);
+	}
+
+	// every small slot is topped up by a large one, which may become small in turn
+	while (!small.empty() && !large.empty())
+	{
+		int s = small.back();
+		small.pop_back();
+		int l = large.back();
+		table[s].prob = (float)q[s];
+		table[s].alias = (unsigned)l;
+		q[l] = (q[l] + q[s]) - 1.0;
+		if (q[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// what is left is 1 up to rounding and keeps prob = 1
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// One slot of Walker's alias table, the layout of AliasEntry in shaders/environment.shinc.
+// Drawing u in [0, 1): slot i = floor(u*n) keeps i when the fraction u*n - i is below prob, and
+// gives alias otherwise, so every index is drawn with probability exactly weight / sum of weights.
+struct AliasEntry
+{
+	float prob;
+	unsigned alias;
+};
+
+// Builds the table of n weights in O(n) with Vose's method. Weights that sum to zero give the
+// uniform distribution.
+void alias_table_build(const double* weights, int n, AliasEntry* table);
+
+// Index drawn with u in [0, 1) as above. u is replaced by the fraction left within the slot, rescaled
+// to [0, 1) and independent of the index, so one uniform can also place the sample within its cell.
+inline int alias_table_sample(const AliasEntry* table, int n, float& u)
+{
+	float fi = u * (float)n;
+	int i = (int)fi < n - 1 ? (int)fi : n - 1;
+	float f = fi - (float)i;
+	AliasEntry e = table[i];
+	if (f < e.prob)
+		f = f / e.prob;
+	else
+	{
+		f = (f - e.prob) / (1.0f - e.prob);
+		i = (int)e.alias;
+	}
+	u = f < 0.99999994f ? f : 0.99999994f;
+	return i;
+}
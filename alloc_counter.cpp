@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include "alloc_counter.h"
+
+static std::atomic<unsigned long long> s_allocations(0);
+
+unsigned long long heap_allocations()
+{
+	return s_allocations.load(std::memory_order_relaxed);
+}
+
+static void* counted_alloc(size_t size)
+{
+	s_allocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size > 0 ? size : 1);
+}
+
+void* operator new(size_t size)
+{
+	void* p = counted_alloc(size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	void* p = counted_alloc(size);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	free(p);
+}
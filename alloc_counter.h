@@ -0,0 +1,7 @@
+#pragma once
+
+// Number of calls to the global operator new so far, on all threads. alloc_counter.cpp replaces the
+// operators with counting ones, so taking the difference around a piece of code shows whether it
+// touches the heap (allocations through malloc directly are not seen). Only built with the CMake
+// option COUNT_ALLOCATIONS, which defines COUNT_ALLOCATIONS for the code that reports the count.
+unsigned long long heap_allocations();
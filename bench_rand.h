@@ -0,0 +1,30 @@
+#pragma once
+
+// xorshift generator of the benchmarks: their scenes, rays and states are the same on every platform,
+// whatever the C library
+struct BenchRand
+{
+	unsigned state;
+
+	BenchRand(unsigned seed = 0x2545F491u) : state(seed) {}
+
+	unsigned next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// in [0, 1)
+	float uniform()
+	{
+		return (float)(next() >> 8) / (float)(1u << 24);
+	}
+
+	// in [-1, 1)
+	float uniform_signed()
+	{
+		return uniform() * 2.0f - 1.0f;
+	}
+};
@@ -52,6 +52,14 @@ public:
 	}
 
 	void buffer_upload(BufferResource& buffer, const void* hdata) const
+	{
+		size_t size = (size_t)buffer.size;
+		buffer_upload_inplace(buffer, [hdata, size](void* data) { memcpy(data, hdata, size); });
+	}
+
+	// fill(data) writes the content directly into the mapped staging memory
+	template<typename Filler>
+	void buffer_upload_inplace(BufferResource& buffer, const Filler& fill) const
 	{
 		if (buffer.size == 0) return;
 		VkBuffer stagingBuffer;
@@ -60,7 +68,7 @@ public:
 
 		void* data;
 		vkMapMemory(m_device, stagingBufferMemory, 0, buffer.size, 0, &data);
-		memcpy(data, hdata, (size_t)buffer.size);
+		fill(data);
 		vkUnmapMemory(m_device, stagingBufferMemory);
 
 		VkCommandBufferAllocateInfo allocInfo = {};
@@ -0,0 +1,64 @@
+#pragma once
+
+// ISA detection shared by the hand-vectorized kernels. Each kernel file compiles all of its variants
+// with function-level target attributes and picks one at runtime, so the build needs no -m flags.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512vl")))
+#endif
+
+inline bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+inline bool cpu_has_avx512()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	if (!osxsave || (_xgetbv(0) & 0xE6) != 0xE6) return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 16)) != 0 && (regs[1] & (1 << 31)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f") != 0 && __builtin_cpu_supports("avx512vl") != 0;
+#endif
+}
+
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// index of the lowest set bit, mask != 0
+inline int lowest_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
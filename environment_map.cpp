@@ -0,0 +1,92 @@
+#include <math.h>
+#include "PathTracer.h"
+
+// host parts of EnvironmentMap, the device buffer is created in PathTracer.cpp
+
+#define ENV_PI 3.14159265f
+
+EnvironmentMap::EnvironmentMap(int width, int height, const float* rgb, float intensity)
+{
+	m_width = width;
+	m_height = height;
+	m_data = nullptr;
+
+	// A texel is drawn uniformly within its (u, v) rectangle, whose solid angle is proportional to
+	// sin(theta), so its weight is its luminance times the sine at its center.
+	size_t num_texels = (size_t)width * height;
+	m_texels.resize(num_texels);
+	std::vector<double> weights(num_texels);
+	std::vector<double> row_weights(height, 0.0);
+	for (int y = 0; y < height; y++)
+	{
+		double sin_theta = sin(((double)y + 0.5) / (double)height * 3.14159265358979);
+		for (int x = 0; x < width; x++)
+		{
+			size_t i = (size_t)y * width + x;
+			glm::vec3 c = glm::vec3(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]) * intensity;
+			m_texels[i] = glm::vec4(c, 0.0f);
+			double lum = 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+			weights[i] = (lum > 0.0 ? lum : 0.0) * sin_theta;
+			row_weights[y] += weights[i];
+		}
+	}
+
+	double sum = 0.0;
+	for (int y = 0; y < height; y++)
+		sum += row_weights[y];
+	if (!(sum > 0.0))
+	{
+		// black: uniform over the sphere, though the sky contributes nothing anyway
+		for (int y = 0; y < height; y++)
+		{
+			double sin_theta = sin(((double)y + 0.5) / (double)height * 3.14159265358979);
+			for (int x = 0; x < width; x++)
+				weights[(size_t)y * width + x] = sin_theta;
+			row_weights[y] = sin_theta * width;
+			sum += row_weights[y];
+		}
+	}
+	for (size_t i = 0; i < num_texels; i++)
+		m_texels[i].w = (float)(weights[i] / sum);
+
+	m_rows.resize(height);
+	alias_table_build(row_weights.data(), height, m_rows.data());
+	m_texel_tables.resize(num_texels);
+	for (int y = 0; y < height; y++)
+		alias_table_build(weights.data() + (size_t)y * width, width, m_texel_tables.data() + (size_t)y * width);
+}
+
+int EnvironmentMap::_texel(const glm::vec3& direction) const
+{
+	float phi = atan2f(direction.z, direction.x);
+	float u = phi < 0.0f ? phi / (2.0f * ENV_PI) + 1.0f : phi / (2.0f * ENV_PI);
+	float v = acosf(fminf(fmaxf(direction.y, -1.0f), 1.0f)) / ENV_PI;
+	int x = (int)(u * (float)m_width);
+	int y = (int)(v * (float)m_height);
+	x = x < m_width - 1 ? x : m_width - 1;
+	y = y < m_height - 1 ? y : m_height - 1;
+	return y * m_width + x;
+}
+
+glm::vec3 EnvironmentMap::radiance(const glm::vec3& direction) const
+{
+	return glm::vec3(m_texels[_texel(direction)]);
+}
+
+float EnvironmentMap::pdf(const glm::vec3& direction) const
+{
+	// the texel probability spread uniformly over its (u, v) rectangle, d(omega) = 2 pi^2 sin(theta) du dv
+	float sin_theta = sqrtf(fmaxf(0.0f, 1.0f - direction.y * direction.y));
+	float p = m_texels[_texel(direction)].w * (float)m_width * (float)m_height;
+	return p / (2.0f * ENV_PI * ENV_PI * fmaxf(sin_theta, 1e-6f));
+}
+
+glm::vec3 EnvironmentMap::sample(glm::vec2 u) const
+{
+	int y = alias_table_sample(m_rows.data(), m_height, u.y);
+	int x = alias_table_sample(m_texel_tables.data() + (size_t)y * m_width, m_width, u.x);
+	float theta = ((float)y + u.y) / (float)m_height * ENV_PI;
+	float phi = ((float)x + u.x) / (float)m_width * (2.0f * ENV_PI);
+	float s = sinf(theta);
+	return glm::vec3(s * cosf(phi), cosf(theta), s * sinf(phi));
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include "gf2_kernels.h"
+
+#include "cpu_features.h"
+
+// scalar reference, one branch per bit
+
+static inline void matvec_i_scalar(int i, unsigned v_i, const unsigned *matrix, V5& result)
+{
+	for (int j = 0; j < 32; j++)
+		if (v_i & (1 << j))
+		{
+			V5 mat_row = ((V5*)matrix)[i * 32 + j];
+			result.v0 ^= mat_row.v0;
+			result.v1 ^= mat_row.v1;
+			result.v2 ^= mat_row.v2;
+			result.v3 ^= mat_row.v3;
+			result.v4 ^= mat_row.v4;
+		}
+}
+
+static void matvec_scalar(const V5& vector, const unsigned *matrix, V5& result)
+{
+	memset(&result, 0, sizeof(V5));
+	matvec_i_scalar(0, vector.v0, matrix, result);
+	matvec_i_scalar(1, vector.v1, matrix, result);
+	matvec_i_scalar(2, vector.v2, matrix, result);
+	matvec_i_scalar(3, vector.v3, matrix, result);
+	matvec_i_scalar(4, vector.v4, matrix, result);
+}
+
+static void matmat_scalar(unsigned int *matrixA, const unsigned int *matrixB)
+{
+	V5 result;
+	for (int i = 0; i < 160; i++)
+	{
+		matvec_scalar(((V5*)matrixA)[i], matrixB, result);
+		((V5*)matrixA)[i] = result;
+	}
+}
+
+#ifdef CPU_X86
+
+// A 160-bit row lives in the low 5 lanes of a 256-bit register.
+//
+// matvec: branch-free masked XOR accumulation over the 160 rows.
+// matmat: "Four Russians" - for every group of 4 rows of B, the 16 possible XOR combinations are tabulated
+// (40 tables, 20KB), then each row of A costs 40 table lookups instead of up to 160 row XORs.
+
+TARGET_AVX2 static inline __m256i lanes5_avx2()
+{
+	return _mm256_setr_epi32(-1, -1, -1, -1, -1, 0, 0, 0);
+}
+
+TARGET_AVX2 static void matvec_avx2(const V5& vector, const unsigned *matrix, V5& result)
+{
+	const __m256i lanes5 = lanes5_avx2();
+	__m256i acc = _mm256_setzero_si256();
+	const unsigned* v = &vector.v0;
+	for (int i = 0; i < 5; i++)
+	{
+		unsigned v_i = v[i];
+		const int* rows = (const int*)matrix + i * 32 * 5;
+		for (int j = 0; j < 32; j++)
+		{
+			__m256i mask = _mm256_and_si256(lanes5, _mm256_set1_epi32(-(int)((v_i >> j) & 1)));
+			acc = _mm256_xor_si256(acc, _mm256_maskload_epi32(rows + j * 5, mask));
+		}
+	}
+	_mm256_maskstore_epi32((int*)&result, lanes5, acc);
+}
+
+TARGET_AVX2 static void build_tables_avx2(const unsigned* matrixB, __m256i table[40][16])
+{
+	const __m256i lanes5 = lanes5_avx2();
+	for (int c = 0; c < 40; c++)
+	{
+		__m256i* t = table[c];
+		t[0] = _mm256_setzero_si256();
+		for (int b = 0; b < 4; b++)
+		{
+			__m256i row = _mm256_maskload_epi32((const int*)matrixB + (c * 4 + b) * 5, lanes5);
+			int n = 1 << b;
+			for (int k = 0; k < n; k++)
+				t[n + k] = _mm256_xor_si256(t[k], row);
+		}
+	}
+}
+
+TARGET_AVX2 static void matmat_avx2(unsigned *matrixA, const unsigned *matrixB)
+{
+	const __m256i lanes5 = lanes5_avx2();
+	__m256i table[40][16];
+	build_tables_avx2(matrixB, table);
+
+	for (int i = 0; i < 160; i++)
+	{
+		int* row = (int*)matrixA + i * 5;
+		__m256i acc = _mm256_setzero_si256();
+		for (int w = 0; w < 5; w++)
+		{
+			unsigned v = (unsigned)row[w];
+			for (int n = 0; n < 8; n++)
+				acc = _mm256_xor_si256(acc, table[w * 8 + n][(v >> (n * 4)) & 0xF]);
+		}
+		_mm256_maskstore_epi32(row, lanes5, acc);
+	}
+}
+
+TARGET_AVX512 static void matvec_avx512(const V5& vector, const unsigned *matrix, V5& result)
+{
+	__m256i acc = _mm256_setzero_si256();
+	const unsigned* v = &vector.v0;
+	for (int i = 0; i < 5; i++)
+	{
+		unsigned v_i = v[i];
+		const unsigned* rows = matrix + i * 32 * 5;
+		for (int j = 0; j < 32; j++)
+		{
+			__mmask8 k = (__mmask8)(((v_i >> j) & 1) * 0x1F);
+			acc = _mm256_xor_si256(acc, _mm256_maskz_loadu_epi32(k, rows + j * 5));
+		}
+	}
+	_mm256_mask_storeu_epi32(&result, 0x1F, acc);
+}
+
+TARGET_AVX512 static void matmat_avx512(unsigned *matrixA, const unsigned *matrixB)
+{
+	__m256i table[40][16];
+	for (int c = 0; c < 40; c++)
+	{
+		__m256i* t = table[c];
+		t[0] = _mm256_setzero_si256();
+		for (int b = 0; b < 4; b++)
+		{
+			__m256i row = _mm256_maskz_loadu_epi32(0x1F, matrixB + (c * 4 + b) * 5);
+			int n = 1 << b;
+			for (int k = 0; k < n; k++)
+				t[n + k] = _mm256_xor_si256(t[k], row);
+		}
+	}
+
+	for (int i = 0; i < 160; i++)
+	{
+		unsigned* row = matrixA + i * 5;
+		__m256i acc = _mm256_setzero_si256();
+		for (int w = 0; w < 5; w++)
+		{
+			unsigned v = row[w];
+			// 3-way XOR in one instruction
+			for (int n = 0; n < 8; n += 2)
+				acc = _mm256_ternarylogic_epi32(acc, table[w * 8 + n][(v >> (n * 4)) & 0xF], table[w * 8 + n + 1][(v >> (n * 4 + 4)) & 0xF], 0x96);
+		}
+		_mm256_mask_storeu_epi32(row, 0x1F, acc);
+	}
+}
+
+#endif
+
+bool gf2_kernels_isa(const char* isa, GF2Kernels& kernels)
+{
+	if (strcmp(isa, "scalar") == 0)
+	{
+		kernels = { "scalar", matvec_scalar, matmat_scalar };
+		return true;
+	}
+
+#ifdef CPU_X86
+	bool has_avx2 = cpu_has_avx2();
+	if (strcmp(isa, "avx2") == 0 && has_avx2)
+	{
+		kernels = { "avx2", matvec_avx2, matmat_avx2 };
+		return true;
+	}
+	if (strcmp(isa, "avx512") == 0 && has_avx2 && cpu_has_avx512())
+	{
+		kernels = { "avx512", matvec_avx512, matmat_avx512 };
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+static GF2Kernels select_kernels()
+{
+	GF2Kernels kernels;
+	const char* forced = getenv("XORWOW_GF2_ISA");
+	if (forced != nullptr && gf2_kernels_isa(forced, kernels)) return kernels;
+	if (gf2_kernels_isa("avx512", kernels)) return kernels;
+	if (gf2_kernels_isa("avx2", kernels)) return kernels;
+	gf2_kernels_isa("scalar", kernels);
+	return kernels;
+}
+
+const GF2Kernels& gf2_kernels()
+{
+	static GF2Kernels kernels = select_kernels();
+	return kernels;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "RNGState.h"
+
+// GF(2) matrix kernels used by the xorwow jump-ahead.
+// A matrix is 160 rows of V5 (800 unsigneds), vectors are multiplied from the left.
+typedef void(*GF2MatVec)(const V5& vector, const unsigned* matrix, V5& result);
+typedef void(*GF2MatMat)(unsigned* matrixA, const unsigned* matrixB); // matrixA = matrixA * matrixB
+
+struct GF2Kernels
+{
+	const char* isa;
+	GF2MatVec matvec;
+	GF2MatMat matmat;
+};
+
+// Best kernels for the running CPU, selected once by feature detection.
+// Setting the environment variable XORWOW_GF2_ISA to "scalar", "avx2" or "avx512" forces a variant
+// (when supported), which is how the before/after numbers of the RNG initialization are compared.
+const GF2Kernels& gf2_kernels();
+
+// The variant isa ("scalar", "avx2" or "avx512"), false when the build or the running CPU lacks it.
+bool gf2_kernels_isa(const char* isa, GF2Kernels& kernels);
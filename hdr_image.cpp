@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "hdr_image.h"
+
+// one scanline of RGBE pixels, either flat or in the run-length encoding of the Radiance format where
+// the four components are stored one after the other, each as runs and literal spans
+static bool read_scanline(FILE* fp, int width, unsigned char* rgbe)
+{
+	unsigned char head[4];
+	if (fread(head, 1, 4, fp) != 4) return false;
+	if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80) != 0)
+	{
+		// flat
+		memcpy(rgbe, head, 4);
+		return fread(rgbe + 4, 4, width - 1, fp) == (size_t)(width - 1);
+	}
+	if (((int)head[2] << 8 | head[3]) != width) return false;
+
+	for (int c = 0; c < 4; c++)
+	{
+		int x = 0;
+		while (x < width)
+		{
+			int count = fgetc(fp);
+			if (count == EOF) return false;
+			if (count > 128)
+			{
+				count -= 128;
+				int value = fgetc(fp);
+				if (value == EOF || x + count > width) return false;
+				for (int i = 0; i < count; i++, x++)
+					rgbe[x * 4 + c] = (unsigned char)value;
+			}
+			else
+			{
+				if (count == 0 || x + count > width) return false;
+				for (int i = 0; i < count; i++, x++)
+				{
+					int value = fgetc(fp);
+					if (value == EOF) return false;
+					rgbe[x * 4 + c] = (unsigned char)value;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+bool hdr_load(const char* filename, int& width, int& height, std::vector<float>& rgb)
+{
+	FILE* fp = fopen(filename, "rb");
+	if (fp == nullptr)
+	{
+		printf("hdr_load: can't open %s\n", filename);
+		return false;
+	}
+
+	// header lines up to an empty one, then the resolution
+	char line[256];
+	bool ok = fgets(line, sizeof(line), fp) != nullptr && strncmp(line, "#?", 2) == 0;
+	while (ok)
+	{
+		if (fgets(line, sizeof(line), fp) == nullptr) ok = false;
+		else if (line[0] == '\n' || line[0] == '\r') break;
+		else if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+		{
+			printf("hdr_load: %s: unsupported %s", filename, line);
+			fclose(fp);
+			return false;
+		}
+	}
+	if (!ok || fgets(line, sizeof(line), fp) == nullptr || sscanf(line, "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0)
+	{
+		printf("hdr_load: %s is not a Radiance picture in -Y +X order\n", filename);
+		fclose(fp);
+		return false;
+	}
+
+	rgb.resize((size_t)width * height * 3);
+	std::vector<unsigned char> rgbe((size_t)width * 4);
+	for (int y = 0; y < height; y++)
+	{
+		if (!read_scanline(fp, width, rgbe.data()))
+		{
+			printf("hdr_load: %s: truncated or corrupt at scanline %d\n", filename, y);
+			fclose(fp);
+			return false;
+		}
+		float* out = rgb.data() + (size_t)y * width * 3;
+		for (int x = 0; x < width; x++)
+		{
+			const unsigned char* p = rgbe.data() + x * 4;
+			// a zero exponent is black, otherwise the mantissas are taken at the centers of their steps
+			float f = p[3] == 0 ? 0.0f : ldexpf(1.0f, (int)p[3] - (128 + 8));
+			out[x * 3] = ((float)p[0] + 0.5f) * f;
+			out[x * 3 + 1] = ((float)p[1] + 0.5f) * f;
+			out[x * 3 + 2] = ((float)p[2] + 0.5f) * f;
+		}
+	}
+	fclose(fp);
+	return true;
+}
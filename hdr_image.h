@@ -0,0 +1,8 @@
+#pragma once
+
+#include <vector>
+
+// Reads a Radiance RGBE picture (.hdr, .pic) into width*height linear rgb triplets, top row first.
+// Flat and run-length encoded scanlines are supported in the usual "-Y height +X width" orientation.
+// Prints the reason and returns false when the file can't be read.
+bool hdr_load(const char* filename, int& width, int& height, std::vector<float>& rgb);
@@ -1,7 +1,18 @@
 #include "PathTracer.h"
+#include "BVH.h"
+#include "tri_kernels.h"
+#include "sphere_kernels.h"
+#include "xorwow_kernels.h"
+#include "rand_state_init_poly.h"
+#include "hdr_image.h"
+#include "bench_rand.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <memory>
 #include <glm.hpp>
 #include <gtc/matrix_transform.hpp>
 
@@ -9,9 +20,578 @@
 #define PI 3.1415926f
 #endif
 
+// The cover scene of "Ray Tracing in One Weekend" grown to num_spheres: small spheres on a jittered
+// grid resting on a ground sphere of radius 1000, around three large ones. Traced with the CPU backend,
+// which reports the sphere blocks, the build and the trace.
+static void bench_spheres(PathTracerOptions options, int num_spheres)
+{
+	options.backend = Backend::CPU;
+	options.verbose = true;
+	glm::mat4x4 identity = glm::identity<glm::mat4x4>();
+	const glm::vec3 ground_center = glm::vec3(0.0f, -1000.0f, 0.0f);
+
+	BenchRand rng;
+
+	std::vector<std::unique_ptr<UnitSphere>> spheres;
+	spheres.emplace_back(new UnitSphere(glm::scale(glm::translate(identity, ground_center), glm::vec3(1000.0f)), { 0.5f, 0.5f, 0.5f }));
+	spheres.emplace_back(new UnitSphere(glm::translate(identity, glm::vec3(0.0f, 1.0f, 0.0f)), { 0.9f, 0.9f, 0.9f }));
+	spheres.emplace_back(new UnitSphere(glm::translate(identity, glm::vec3(-4.0f, 1.0f, 0.0f)), { 0.4f, 0.2f, 0.1f }));
+	spheres.emplace_back(new UnitSphere(glm::translate(identity, glm::vec3(4.0f, 1.0f, 0.0f)), { 0.7f, 0.6f, 0.5f }));
+
+	int side = (int)sqrtf((float)num_spheres);
+	for (int a = -side / 2; a < side - side / 2; a++)
+		for (int b = -side / 2; b < side - side / 2; b++)
+		{
+			glm::vec3 p = glm::vec3((float)a + 0.9f * rng.uniform(), 0.0f, (float)b + 0.9f * rng.uniform());
+			glm::vec3 color = glm::vec3(rng.uniform() * rng.uniform(), rng.uniform() * rng.uniform(), rng.uniform() * rng.uniform());
+			if (glm::length(p - glm::vec3(4.0f, 0.0f, 0.0f)) < 0.9f || glm::length(p) < 0.9f || glm::length(p - glm::vec3(-4.0f, 0.0f, 0.0f)) < 0.9f) continue;
+			glm::vec3 center = ground_center + 1000.2f * glm::normalize(p - ground_center);
+			spheres.emplace_back(new UnitSphere(glm::scale(glm::translate(identity, center), glm::vec3(0.2f)), color));
+		}
+
+	std::vector<const UnitSphere*> sphere_ptrs(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++)
+		sphere_ptrs[i] = spheres[i].get();
+
+	printf("--- %u spheres ---\n", (unsigned)spheres.size());
+	Image target(400, 200);
+	PathTracer pt(&target, {}, sphere_ptrs, options);
+	pt.set_camera({ 13.0f, 2.0f, 3.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 20.0f);
+	pt.trace(16);
+}
+
+// A grid of num_cubes small rotated cubes on a ground cube, traced with the CPU backend twice: as
+// instances of the same vertex data, which share one BLAS, and with the models baked into the vertices,
+// every cube a geometry of its own. The CPU backend reports the BLAS memory, the build and the trace.
+static void bench_instancing(PathTracerOptions options, const std::vector<Vertex>& cube_vertices, const std::vector<unsigned>& cube_indices, int num_cubes)
+{
+	options.backend = Backend::CPU;
+	options.verbose = true;
+	glm::mat4x4 identity = glm::identity<glm::mat4x4>();
+
+	int side = (int)sqrtf((float)num_cubes);
+	std::vector<glm::mat4x4> models;
+	std::vector<glm::vec3> colors;
+	BenchRand rng;
+	for (int a = 0; a < side; a++)
+		for (int b = 0; b < side; b++)
+		{
+			glm::mat4x4 model = glm::translate(identity, glm::vec3((float)(a - side / 2), 0.2f, (float)(b - side / 2)));
+			model = glm::rotate(model, rng.uniform() * 2.0f * PI, glm::vec3(0.0f, 1.0f, 0.0f));
+			models.push_back(glm::scale(model, glm::vec3(0.2f)));
+			colors.push_back(glm::vec3(rng.uniform(), rng.uniform(), rng.uniform()));
+		}
+	glm::mat4x4 ground_model = glm::scale(glm::translate(identity, glm::vec3(0.0f, -1.0f, 0.0f)), glm::vec3((float)side, 1.0f, (float)side));
+	TriangleMesh ground(ground_model, cube_vertices, cube_indices);
+
+	for (int k = 0; k < 2; k++)
+	{
+		std::vector<std::unique_ptr<TriangleMesh>> cubes;
+		for (size_t i = 0; i < models.size(); i++)
+		{
+			if (k == 0)
+			{
+				cubes.emplace_back(new TriangleMesh(models[i], cube_vertices, cube_indices, colors[i]));
+				continue;
+			}
+			std::vector<Vertex> vertices = cube_vertices;
+			glm::mat3x3 norm = glm::mat3x3(glm::transpose(glm::inverse(models[i])));
+			for (Vertex& v : vertices)
+			{
+				v.Position = glm::vec3(models[i] * glm::vec4(v.Position, 1.0f));
+				v.Normal = glm::normalize(norm * v.Normal);
+			}
+			cubes.emplace_back(new TriangleMesh(identity, vertices, cube_indices, colors[i]));
+		}
+		std::vector<const TriangleMesh*> meshes = { &ground };
+		for (size_t i = 0; i < cubes.size(); i++)
+			meshes.push_back(cubes[i].get());
+
+		printf("--- %u cubes, %s ---\n", (unsigned)cubes.size(), k == 0 ? "instances of one geometry" : "one geometry each");
+		Image target(400, 200);
+		auto t0 = std::chrono::steady_clock::now();
+		PathTracer pt(&target, meshes, {}, options);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		printf("created in %.1f ms\n", ms);
+		pt.set_camera({ 0.0f, (float)side * 0.3f, (float)side * 0.6f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+		pt.trace(16);
+	}
+}
+
+// A tessellated sphere of 2 x rings x segments triangles on a ground cube, traced with the CPU backend
+// and the triangle kernel of tri_kernels(): run it once per TRI_ISA to compare the variants end to end.
+static void bench_triangle_mesh(PathTracerOptions options, const std::vector<Vertex>& cube_vertices, const std::vector<unsigned>& cube_indices, int rings, int segments)
+{
+	options.backend = Backend::CPU;
+	options.verbose = true;
+	glm::mat4x4 identity = glm::identity<glm::mat4x4>();
+
+	std::vector<Vertex> vertices;
+	std::vector<unsigned> indices;
+	for (int i = 0; i <= rings; i++)
+		for (int j = 0; j <= segments; j++)
+		{
+			float theta = (float)i / (float)rings * PI;
+			float phi = (float)j / (float)segments * 2.0f * PI;
+			glm::vec3 n = glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+			vertices.push_back({ n, n, { (float)j / (float)segments, (float)i / (float)rings } });
+		}
+	for (int i = 0; i < rings; i++)
+		for (int j = 0; j < segments; j++)
+		{
+			unsigned a = (unsigned)(i * (segments + 1) + j);
+			unsigned b = a + (unsigned)(segments + 1);
+			indices.insert(indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+		}
+
+	TriangleMesh sphere(glm::scale(glm::translate(identity, glm::vec3(0.0f, 2.0f, 0.0f)), glm::vec3(2.0f)), vertices, indices, { 0.8f, 0.6f, 0.8f });
+	TriangleMesh ground(glm::scale(glm::translate(identity, glm::vec3(0.0f, -0.2f, 0.0f)), glm::vec3(6.0f, 0.2f, 6.0f)), cube_vertices, cube_indices);
+
+	printf("--- %u triangle mesh ---\n", (unsigned)indices.size() / 3);
+	Image target(400, 200);
+	PathTracer pt(&target, { &sphere, &ground }, {}, options);
+	pt.set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+	pt.trace(16);
+}
+
+// RMSE of the rgb channels against a reference
+static double rmse(const std::vector<float>& a, const std::vector<float>& b)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i++)
+	{
+		if (i % 4 == 3) continue;
+		double d = (double)a[i] - (double)b[i];
+		sum += d * d;
+	}
+	return sqrt(sum / (double)(a.size() / 4 * 3));
+}
+
+// The options of the reference of an RMSE benchmark: independent uniforms from the other generator than
+// that of the runs measured against it. Sobol points and the streams of one generator repeat from one
+// tracer to the next, a reference sharing them would be correlated with the runs and flatter them.
+static PathTracerOptions reference_options(PathTracerOptions options)
+{
+	options.rand_mode = options.rand_mode == RandMode::XorWow ? RandMode::Counter : RandMode::XorWow;
+	options.sampler = Sampler::Independent;
+	return options;
+}
+
+// RMSE versus time of the scene of main() with and without next-event estimation, against a
+// reference traced with it at reference_iter iterations from reference_options(). The RMSE of both
+// falls as 1/sqrt(iterations), so the ratio of the squared errors is the factor in iterations to the
+// same noise level.
+// Without it the sky (the gradient or the environment map) is only reached by the cosine-distributed bounces.
+static void bench_next_event(PathTracerOptions options, const std::vector<const TriangleMesh*>& meshes, const std::vector<const UnitSphere*>& spheres, int width, int height, const EnvironmentMap* environment = nullptr)
+{
+	const int reference_iter = 1024;
+	const int max_iter = 64;
+	Image target(width, height);
+	std::vector<float> reference((size_t)width * height * 4);
+	std::vector<float> render(reference.size());
+
+	auto trace = [&](bool next_event, int num_iter)
+	{
+		options.next_event = next_event;
+		PathTracer pt(&target, meshes, spheres, options);
+		pt.set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+		pt.set_environment(environment);
+		auto t0 = std::chrono::steady_clock::now();
+		pt.trace(num_iter);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		target.to_host(render.data());
+		return ms;
+	};
+
+	PathTracerOptions measured = options;
+	options = reference_options(measured);
+	trace(true, reference_iter);
+	reference = render;
+	options = measured;
+
+	std::vector<double> results;
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2)
+	{
+		for (int k = 0; k < 2; k++)
+		{
+			double ms = trace(k == 1, num_iter);
+			results.push_back(ms);
+			results.push_back(rmse(render, reference));
+		}
+	}
+
+	if (environment != nullptr)
+		printf("--- next-event estimation, %dx%d environment map, RMSE against %d iterations ---\n", environment->width(), environment->height(), reference_iter);
+	else
+		printf("--- next-event estimation, gradient sky, RMSE against %d iterations ---\n", reference_iter);
+	size_t i = 0;
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2, i += 4)
+	{
+		double ms_off = results[i], err_off = results[i + 1], ms_on = results[i + 2], err_on = results[i + 3];
+		double fewer_iter = (err_off * err_off) / (err_on * err_on);
+		printf("%3d iterations: without %8.1f ms RMSE %.5f, with %8.1f ms RMSE %.5f: same RMSE in %.2fx fewer iterations, %.2fx less time\n",
+			num_iter, ms_off, err_off, ms_on, err_on, fewer_iter, fewer_iter * ms_off / ms_on);
+	}
+}
 
-int main()
+// The bounce direction of raygen.rgen before and after the closed form: the rejection loop drew points
+// in the cube until one fell in the unit ball, normal + that point being roughly cosine distributed;
+// sample_lambertian() maps one 2D sample to the unit sphere, which is exactly cosine distributed.
+// Reports directions/s on one thread, uniforms per direction, the fraction of the passes of the loop a
+// 32-lane subgroup keeps its lanes busy (all lanes wait for the slowest), and the mean cosine with the
+// normal, 2/3 for the Lambertian lobe.
+static void bench_bounce()
 {
+	const int num_directions = 1 << 22;
+	const int subgroup_size = 32;
+	const glm::vec3 normal = glm::vec3(0.0f, 0.0f, 1.0f);
+
+	BenchRand rng;
+	unsigned long long num_uniforms = 0;
+	auto rnd = [&rng, &num_uniforms]()
+	{
+		num_uniforms++;
+		return rng.uniform();
+	};
+
+	for (int k = 0; k < 2; k++)
+	{
+		num_uniforms = 0;
+		unsigned long long lane_passes = 0, subgroup_passes = 0;
+		double sum_cos = 0.0;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < num_directions; i += subgroup_size)
+		{
+			int max_passes = 0;
+			for (int j = 0; j < subgroup_size; j++)
+			{
+				glm::vec3 d;
+				int passes = 0;
+				if (k == 0)
+				{
+					glm::vec3 p;
+					do
+					{
+						float x = rnd() * 2.0f - 1.0f;
+						float y = rnd() * 2.0f - 1.0f;
+						p = glm::vec3(x, y, rnd() * 2.0f - 1.0f);
+						passes++;
+					} while (glm::dot(p, p) > 1.0f);
+					d = glm::normalize(p + normal);
+				}
+				else
+				{
+					float z = 1.0f - 2.0f * rnd();
+					float s = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+					float phi = 2.0f * PI * rnd();
+					d = normal + glm::vec3(s * cosf(phi), s * sinf(phi), z);
+					float len2 = glm::dot(d, d);
+					d = len2 > 1e-12f ? d / sqrtf(len2) : normal;
+					passes = 1;
+				}
+				sum_cos += d.z;
+				lane_passes += passes;
+				max_passes = passes > max_passes ? passes : max_passes;
+			}
+			subgroup_passes += (unsigned long long)max_passes * subgroup_size;
+		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		printf("bounce %-11s: %7.1f M directions/s, %.2f uniforms per direction, subgroup lane utilization %5.1f%%, mean cosine %.4f\n",
+			k == 0 ? "rejection" : "closed form", (double)num_directions / ms * 1e-3, (double)num_uniforms / num_directions,
+			100.0 * (double)lane_passes / (double)subgroup_passes, sum_cos / num_directions);
+	}
+}
+
+// RMSE versus iterations of the scene of main() with independent uniforms and with the Owen-scrambled
+// Sobol sampler, against a reference of reference_options() at reference_iter iterations. The squared
+// errors of the independent sampler fall as 1/iterations, the ratio of the two is the factor in
+// iterations the Sobol points save to the same noise level. The noise of the reference adds to both
+// errors alike, which only understates that factor.
+static void bench_sampler(PathTracerOptions options, const std::vector<const TriangleMesh*>& meshes, const std::vector<const UnitSphere*>& spheres, int width, int height)
+{
+	const int reference_iter = 1024;
+	const int max_iter = 64;
+	Image target(width, height);
+	std::vector<float> reference((size_t)width * height * 4);
+	std::vector<float> render(reference.size());
+
+	auto trace = [&](Sampler sampler, int num_iter)
+	{
+		options.sampler = sampler;
+		PathTracer pt(&target, meshes, spheres, options);
+		pt.set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+		auto t0 = std::chrono::steady_clock::now();
+		pt.trace(num_iter);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		target.to_host(render.data());
+		return ms;
+	};
+
+	PathTracerOptions measured = options;
+	options = reference_options(measured);
+	trace(Sampler::Independent, reference_iter);
+	reference = render;
+	options = measured;
+
+	printf("--- independent vs Sobol sampler, RMSE against %d iterations ---\n", reference_iter);
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2)
+	{
+		double ms_independent = trace(Sampler::Independent, num_iter);
+		double err_independent = rmse(render, reference);
+		double ms_sobol = trace(Sampler::Sobol, num_iter);
+		double err_sobol = rmse(render, reference);
+		printf("%3d iterations: independent %8.1f ms RMSE %.5f, Sobol %8.1f ms RMSE %.5f: same RMSE in %.2fx fewer iterations\n",
+			num_iter, ms_independent, err_independent, ms_sobol, err_sobol, (err_independent * err_independent) / (err_sobol * err_sobol));
+	}
+}
+
+// The scene of main() lit only by num_lights small emissive spheres scattered behind the camera, under a
+// black sky. Every pixel sees the light of thousands of them, each covering a tiny solid angle, so the
+// bounces alone rarely find them. Compares tracing without next-event estimation and with it, choosing
+// the light by power alone or by its estimated contribution, at the same iterations against a
+// reference traced with the latter at reference_iter iterations from reference_options().
+static void bench_lights(PathTracerOptions options, const std::vector<const TriangleMesh*>& meshes, std::vector<const UnitSphere*> spheres, int width, int height, int num_lights)
+{
+	const int reference_iter = 1024;
+	const int max_iter = 64;
+	glm::mat4x4 identity = glm::identity<glm::mat4x4>();
+
+	BenchRand rng;
+
+	// radius 0.01, out of the view of the camera at (0, 8, 8) looking down at the origin
+	std::vector<std::unique_ptr<UnitSphere>> lights;
+	for (int i = 0; i < num_lights; i++)
+	{
+		glm::vec3 center = glm::vec3(-10.0f + 20.0f * rng.uniform(), 0.1f + 4.0f * rng.uniform(), 8.0f + 10.0f * rng.uniform());
+		lights.emplace_back(new UnitSphere(glm::scale(glm::translate(identity, center), glm::vec3(0.01f)), { 0.0f, 0.0f, 0.0f }));
+		lights.back()->set_emission(glm::vec3(rng.uniform(), rng.uniform(), rng.uniform()) * 1500.0f);
+		spheres.push_back(lights.back().get());
+	}
+	float black[3] = { 0.0f, 0.0f, 0.0f };
+	EnvironmentMap sky(1, 1, black);
+
+	Image target(width, height);
+	std::vector<float> reference((size_t)width * height * 4);
+	std::vector<float> render(reference.size());
+
+	auto trace = [&](bool next_event, LightSelection light_selection, int num_iter)
+	{
+		options.next_event = next_event;
+		options.light_selection = light_selection;
+		PathTracer pt(&target, meshes, spheres, options);
+		pt.set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+		pt.set_environment(&sky);
+		auto t0 = std::chrono::steady_clock::now();
+		pt.trace(num_iter);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		target.to_host(render.data());
+		return ms;
+	};
+
+	PathTracerOptions measured = options;
+	options = reference_options(measured);
+	trace(true, LightSelection::Contribution, reference_iter);
+	reference = render;
+	options = measured;
+
+	const char* names[3] = { "without", "power", "contribution" };
+	std::vector<double> results;
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double ms = trace(k > 0, k == 1 ? LightSelection::Power : LightSelection::Contribution, num_iter);
+			results.push_back(ms);
+			results.push_back(rmse(render, reference));
+		}
+	}
+
+	printf("--- %d lights, next-event estimation without / by power / by contribution, RMSE against %d iterations ---\n", num_lights, reference_iter);
+	size_t i = 0;
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2)
+	{
+		printf("%3d iterations:", num_iter);
+		for (int k = 0; k < 3; k++, i += 2)
+			printf(" %s %8.1f ms RMSE %.5f%s", names[k], results[i], results[i + 1], k < 2 ? "," : "\n");
+	}
+}
+
+// The bias of PathSchedule::Regeneration: a pixel gets more samples when its own paths end early, so
+// its sample count depends on what they return and the sum over the count is a ratio estimator, biased
+// by O(1/samples). The signed error of the image averaged over num_runs traces, which cancels the noise,
+// against a reference of reference_iter iterations, for both schedules at 1 to max_iter iterations.
+// Each trace continues the xorwow states of the last one, so the runs are independent.
+static void bench_regeneration(PathTracerOptions options, const std::vector<const TriangleMesh*>& meshes, const std::vector<const UnitSphere*>& spheres, int width, int height)
+{
+	const int reference_iter = 1024;
+	const int max_iter = 16;
+	const int num_runs = 64;
+	options.rand_mode = RandMode::XorWow;
+	options.sampler = Sampler::Independent;
+	Image target(width, height);
+	std::vector<float> reference((size_t)width * height * 4);
+	std::vector<float> render(reference.size());
+
+	std::unique_ptr<PathTracer> tracers[2];
+	for (int k = 0; k < 2; k++)
+	{
+		options.path_schedule = k == 0 ? PathSchedule::Megakernel : PathSchedule::Regeneration;
+		tracers[k].reset(new PathTracer(&target, meshes, spheres, options));
+		tracers[k]->set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
+	}
+	tracers[0]->trace(reference_iter);
+	target.to_host(reference.data());
+
+	printf("--- regeneration bias, mean signed error of %d traces against %d iterations ---\n", num_runs, reference_iter);
+	for (int num_iter = 1; num_iter <= max_iter; num_iter *= 2)
+	{
+		printf("%3d iterations:", num_iter);
+		for (int k = 0; k < 2; k++)
+		{
+			std::vector<double> sum(reference.size(), 0.0), sum2(reference.size(), 0.0);
+			double samples = 0.0;
+			for (int r = 0; r < num_runs; r++)
+			{
+				tracers[k]->trace(num_iter);
+				samples += tracers[k]->avg_samples();
+				target.to_host(render.data());
+				for (size_t i = 0; i < render.size(); i++)
+				{
+					sum[i] += render[i];
+					sum2[i] += (double)render[i] * render[i];
+				}
+			}
+			// the error of the mean image and its standard error
+			double error = 0.0, variance = 0.0;
+			size_t count = 0;
+			for (size_t i = 0; i < render.size(); i++)
+			{
+				if (i % 4 == 3) continue;
+				double mean = sum[i] / num_runs;
+				error += mean - reference[i];
+				variance += (sum2[i] / num_runs - mean * mean) / (num_runs - 1);
+				count++;
+			}
+			printf(" %s %.2f spp error %+.5f +- %.5f%s", k == 0 ? "megakernel" : "regeneration", samples / num_runs, error / count, sqrt(variance) / count, k == 0 ? "," : "\n");
+		}
+	}
+}
+
+// The gradient of miss.rmiss as a width x height equirectangular map, with a sun of radiance 1000 and
+// an angular radius of 2.5 degrees 40 degrees above the horizon: most of the light comes from 0.05% of
+// the sphere, which the bounces alone rarely find.
+static std::vector<float> sun_sky(int width, int height)
+{
+	const glm::vec3 sun = glm::normalize(glm::vec3(cosf(40.0f / 180.0f * PI), sinf(40.0f / 180.0f * PI), 0.3f));
+	const float cos_radius = cosf(2.5f / 180.0f * PI);
+	std::vector<float> rgb((size_t)width * height * 3);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			float theta = ((float)y + 0.5f) / (float)height * PI;
+			float phi = ((float)x + 0.5f) / (float)width * 2.0f * PI;
+			glm::vec3 direction = glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+			float t = 0.5f * (direction.y + 1.0f);
+			glm::vec3 c = (1.0f - t)*glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+			if (glm::dot(direction, sun) >= cos_radius)
+				c = glm::vec3(1000.0f, 950.0f, 900.0f);
+			float* p = rgb.data() + ((size_t)y * width + x) * 3;
+			p[0] = c.x;
+			p[1] = c.y;
+			p[2] = c.z;
+		}
+	return rgb;
+}
+
+int main(int argc, char* argv[])
+{
+	PathTracerOptions options;
+	bool bench_nee = false;
+	bool bench_env = false;
+	bool bench_many_lights = false;
+	bool bench_regen = false;
+	bool bench_sobol = false;
+	bool bench_inst = false;
+	bool bench_tri = false;
+	const char* environment_file = nullptr;
+	int min_depth = 10, max_depth = 10;
+	int samples_per_launch = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--cpu") == 0)
+			options.backend = Backend::CPU;
+		else if (strcmp(argv[i], "--no-packets") == 0)
+			options.cpu_packets = false;
+		else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc)
+			options.cpu_tile_size = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--iteration-major") == 0)
+			options.cpu_tile_order = TileOrder::IterationMajor;
+		else if (strcmp(argv[i], "--wavefront") == 0)
+			options.path_schedule = PathSchedule::Wavefront;
+		else if (strcmp(argv[i], "--regeneration") == 0)
+			options.path_schedule = PathSchedule::Regeneration;
+		else if (strcmp(argv[i], "--bench-regeneration") == 0)
+			bench_regen = true;
+		else if (strcmp(argv[i], "--bench-sampler") == 0)
+			bench_sobol = true;
+		else if (strcmp(argv[i], "--bench-instancing") == 0)
+			bench_inst = true;
+		else if (strcmp(argv[i], "--next-event") == 0)
+			options.next_event = true;
+		else if (strcmp(argv[i], "--depth") == 0 && i + 2 < argc)
+		{
+			min_depth = atoi(argv[++i]);
+			max_depth = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--samples-per-launch") == 0 && i + 1 < argc)
+			samples_per_launch = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-next-event") == 0)
+			bench_nee = true;
+		else if (strcmp(argv[i], "--light-selection") == 0 && i + 1 < argc)
+		{
+			i++;
+			options.light_selection = strcmp(argv[i], "power") == 0 ? LightSelection::Power : LightSelection::Contribution;
+		}
+		else if (strcmp(argv[i], "--bench-lights") == 0)
+			bench_many_lights = true;
+		else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc)
+			environment_file = argv[++i];
+		else if (strcmp(argv[i], "--bench-environment") == 0)
+			bench_env = true;
+		else if (strcmp(argv[i], "--bench-triangles") == 0)
+			bench_tri = true;
+		else if (strcmp(argv[i], "--verbose") == 0)
+			options.verbose = true;
+		else if (strcmp(argv[i], "--bench-rand-init") == 0)
+		{
+			// the pixel ids of a 1080p image
+			rand_init_benchmark(1920 * 1080);
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-bvh") == 0)
+		{
+			bvh_build_benchmark();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-bounce") == 0)
+		{
+			bench_bounce();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-xorwow") == 0)
+		{
+			xorwow_kernels_benchmark();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--bench-spheres") == 0)
+		{
+			sphere_kernels_benchmark();
+			bench_spheres(options, 100000);
+			bench_spheres(options, 1000000);
+			return 0;
+		}
+	}
+
 	std::vector<Vertex> cube_vertices =
 	{
 		{{-1.0f, -1.0f, -1.0f}, {-1.0f, 0.0f, 0.0f }, {0.0f, 0.0f} },
@@ -66,6 +646,19 @@ int main()
 		20, 22, 23
 	};
 
+	if (bench_tri)
+	{
+		tri_kernels_benchmark();
+		bench_triangle_mesh(options, cube_vertices, cube_indices, 256, 512);
+		return 0;
+	}
+
+	if (bench_inst)
+	{
+		bench_instancing(options, cube_vertices, cube_indices, 10000);
+		return 0;
+	}
+
 	const int view_width = 800;
 	const int view_height = 400;
 
@@ -97,10 +690,62 @@ int main()
 	glm::mat4x4 model6 = glm::translate(identity, glm::vec3(-4.0, 1.0, 2.0));
 	UnitSphere sphere6(model6, { 0.8, 0.8, 0.6 });
 
+	std::unique_ptr<EnvironmentMap> environment;
+	if (environment_file != nullptr)
+	{
+		int width, height;
+		std::vector<float> rgb;
+		if (!hdr_load(environment_file, width, height, rgb)) return 1;
+		environment.reset(new EnvironmentMap(width, height, rgb.data()));
+	}
+
+	if (bench_nee)
+	{
+		bench_next_event(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width, view_height, environment.get());
+		return 0;
+	}
+
+	if (bench_env)
+	{
+		// the map of --environment, or the gradient with a sun
+		if (environment == nullptr)
+			environment.reset(new EnvironmentMap(1024, 512, sun_sky(1024, 512).data()));
+		bench_next_event(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width, view_height);
+		bench_next_event(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width, view_height, environment.get());
+		return 0;
+	}
+
+	if (bench_many_lights)
+	{
+		bench_lights(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width, view_height, 10000);
+		return 0;
+	}
+
+	if (bench_sobol)
+	{
+		bench_sampler(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width, view_height);
+		return 0;
+	}
+
+	if (bench_regen)
+	{
+		bench_regeneration(options, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, view_width / 4, view_height / 4);
+		return 0;
+	}
+
 	Image target(view_width, view_height);
-	PathTracer pt(&target, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 });
+	PathTracer pt(&target, { &cube0, &cube1, &cube2, &cube3 }, { &sphere4, &sphere5, &sphere6 }, options);
 	pt.set_camera({ 0.0f, 8.0f, 8.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f);
-	pt.trace();
+	pt.set_environment(environment.get());
+	pt.set_depth_policy(min_depth, max_depth);
+	pt.set_samples_per_launch(samples_per_launch);
+
+	const int num_iter = 100;
+	auto t0 = std::chrono::steady_clock::now();
+	pt.trace(num_iter);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	double samples = (double)view_width * view_height * pt.avg_samples();
+	printf("trace: %d iterations in %.1f ms, %.2f samples per pixel, %.2f Msamples/s, average path length %.2f, %.2f Mrays/s\n", num_iter, ms, pt.avg_samples(), samples / ms * 1e-3, pt.avg_path_length(), samples * pt.avg_path_length() / ms * 1e-3);
 
 	float* hbuffer = (float*)malloc(view_width * view_height * sizeof(float)*4);
 	target.to_host(hbuffer);
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include "rand_state_cache.h"
+
+#ifdef _WIN64
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char s_magic[8] = { 'X', 'W', 'S', 'T', 'A', 'T', 'E', 'S' };
+
+RandStateCache::RandStateCache(const char* dir, unsigned long long seed, unsigned count)
+{
+	m_seed = seed;
+	m_count = count;
+	m_view = nullptr;
+	m_size = 0;
+	m_pending = false;
+#ifdef _WIN64
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+	_mkdir(dir);
+#else
+	m_fd = -1;
+	mkdir(dir, 0755);
+#endif
+
+	char name[128];
+	sprintf(name, "/xorwow_s%llu_n%u_v%u.bin", seed, count, (unsigned)RAND_STATE_CACHE_VERSION);
+	m_path = std::string(dir) + name;
+
+#ifdef _WIN64
+	sprintf(name, ".%lu.tmp", (unsigned long)GetCurrentProcessId());
+#else
+	sprintf(name, ".%lu.tmp", (unsigned long)getpid());
+#endif
+	m_tmp_path = m_path + name;
+}
+
+RandStateCache::~RandStateCache()
+{
+	_unmap();
+	// created but never committed
+	if (m_pending) _remove_tmp();
+}
+
+const RNGState* RandStateCache::load()
+{
+	if (!_map(m_path.c_str(), false)) return nullptr;
+
+	const Header* header = (const Header*)m_view;
+	if (m_size != sizeof(Header) + sizeof(RNGState) * (size_t)m_count ||
+		memcmp(header->magic, s_magic, sizeof(s_magic)) != 0 ||
+		header->version != RAND_STATE_CACHE_VERSION ||
+		header->count != m_count ||
+		header->seed != m_seed)
+	{
+		_unmap();
+		return nullptr;
+	}
+	return (const RNGState*)(header + 1);
+}
+
+RNGState* RandStateCache::create()
+{
+	if (!_map(m_tmp_path.c_str(), true))
+	{
+		// the file may exist by now, failing to be sized or mapped
+		_remove_tmp();
+		return nullptr;
+	}
+	m_pending = true;
+
+	Header* header = (Header*)m_view;
+	memcpy(header->magic, s_magic, sizeof(s_magic));
+	header->version = RAND_STATE_CACHE_VERSION;
+	header->count = m_count;
+	header->seed = m_seed;
+	return (RNGState*)(header + 1);
+}
+
+void RandStateCache::commit()
+{
+	_unmap();
+	m_pending = false;
+	// renaming is atomic, concurrent jobs either see a complete file or none
+#ifdef _WIN64
+	if (!MoveFileExA(m_tmp_path.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING))
+		_remove_tmp();
+#else
+	if (rename(m_tmp_path.c_str(), m_path.c_str()) != 0)
+		_remove_tmp();
+#endif
+}
+
+void RandStateCache::_remove_tmp()
+{
+	_unmap();
+#ifdef _WIN64
+	DeleteFileA(m_tmp_path.c_str());
+#else
+	unlink(m_tmp_path.c_str());
+#endif
+}
+
+bool RandStateCache::_map(const char* path, bool writable)
+{
+	_unmap();
+	size_t size = sizeof(Header) + sizeof(RNGState) * (size_t)m_count;
+
+#ifdef _WIN64
+	if (writable)
+		m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	else
+		m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE) return false;
+
+	if (!writable)
+	{
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(m_file, &file_size);
+		size = (size_t)file_size.QuadPart;
+	}
+	if (size < sizeof(Header))
+	{
+		_unmap();
+		return false;
+	}
+
+	m_mapping = CreateFileMappingA(m_file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD)((unsigned long long)size >> 32), (DWORD)size, nullptr);
+	if (m_mapping == nullptr)
+	{
+		_unmap();
+		return false;
+	}
+	m_view = MapViewOfFile(m_mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+#else
+	if (writable)
+	{
+		m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (m_fd < 0) return false;
+		if (ftruncate(m_fd, (off_t)size) != 0)
+		{
+			_unmap();
+			return false;
+		}
+	}
+	else
+	{
+		m_fd = open(path, O_RDONLY);
+		if (m_fd < 0) return false;
+		struct stat st;
+		fstat(m_fd, &st);
+		size = (size_t)st.st_size;
+	}
+	if (size < sizeof(Header))
+	{
+		_unmap();
+		return false;
+	}
+
+	m_view = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m_fd, 0);
+	if (m_view == MAP_FAILED) m_view = nullptr;
+#endif
+
+	if (m_view == nullptr)
+	{
+		_unmap();
+		return false;
+	}
+	m_size = size;
+	return true;
+}
+
+void RandStateCache::_unmap()
+{
+#ifdef _WIN64
+	if (m_view != nullptr) UnmapViewOfFile(m_view);
+	if (m_mapping != nullptr) CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_view != nullptr) munmap(m_view, m_size);
+	if (m_fd >= 0) close(m_fd);
+	m_fd = -1;
+#endif
+	m_view = nullptr;
+	m_size = 0;
+}
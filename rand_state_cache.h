@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include "RNGState.h"
+
+// Bump when the content of an initialized state buffer changes for the same seed and count.
+#define RAND_STATE_CACHE_VERSION 1
+
+// On-disk cache of an initialized RNG state buffer, one file per (seed, count, version) in "dir".
+// Files are memory mapped, so a cached buffer goes from the page cache straight into the upload.
+class RandStateCache
+{
+public:
+	RandStateCache(const char* dir, unsigned long long seed, unsigned count);
+	~RandStateCache();
+
+	// Maps the cache file read-only. Returns nullptr if there is none or it doesn't match the key.
+	const RNGState* load();
+
+	// Maps a new temporary file of the right size writable. Returns nullptr on failure.
+	// Once the states are filled in, commit() publishes it under the final name. The temporary file is
+	// removed when create() fails and when the cache is destroyed without a commit().
+	RNGState* create();
+	void commit();
+
+	const std::string& path() const { return m_path; }
+
+private:
+	struct Header
+	{
+		char magic[8];
+		unsigned version;
+		unsigned count;
+		unsigned long long seed;
+	};
+
+	unsigned long long m_seed;
+	unsigned m_count;
+	std::string m_path;
+	std::string m_tmp_path;
+
+	void* m_view;
+	size_t m_size;
+	bool m_pending; // the temporary file of create() awaits its commit()
+#ifdef _WIN64
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_fd;
+#endif
+
+	bool _map(const char* path, bool writable);
+	void _unmap();
+	void _remove_tmp();
+};
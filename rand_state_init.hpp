@@ -1,10 +1,12 @@
 #include "xor_wow_data.hpp"
 #include "RNGState.h"
+#include "gf2_kernels.h"
 
 struct RNG
 {
 	const unsigned* p_sequence_matrix;
 	const unsigned* p_offset_matrix;
+	const GF2Kernels* kernels = nullptr; // those of gf2_kernels() when not set
 
 	inline void state_init(unsigned long long seed,
 		unsigned long long subsequence,
@@ -22,6 +24,10 @@ struct RNG
 		state.v.v3 = 88675123UL ^ t1;
 		state.v.v4 = 5783321UL + t0;
 
+		const GF2Kernels& k = kernels != nullptr ? *kernels : gf2_kernels();
+		GF2MatVec matvec = k.matvec;
+		GF2MatMat matmat = k.matmat;
+
 		// apply sequence matrix
 		V5 result;
 		unsigned long long p = subsequence;
@@ -104,41 +110,21 @@ struct RNG
 		state.d += 362437 * (unsigned int)offset;
 	}
 
-private:
-	static inline void matvec_i(int i, unsigned v_i, const unsigned *matrix, V5& result)
+	// Initializes states for subsequences first .. first+count-1 (offset 0).
+	// Only the first one is jumped ahead from scratch, each following state is its predecessor
+	// advanced by one subsequence (2^67 steps), which is a single product with sequence matrix 0.
+	inline void state_init_stride(unsigned long long seed,
+		unsigned long long first,
+		size_t count,
+		RNGState* states)
 	{
-		for (int j = 0; j < 32; j++)
-			if (v_i & (1 << j))
-			{
-				V5 mat_row = ((V5*)matrix)[i * 32 + j];
-				result.v0 ^= mat_row.v0;
-				result.v1 ^= mat_row.v1;
-				result.v2 ^= mat_row.v2;
-				result.v3 ^= mat_row.v3;
-				result.v4 ^= mat_row.v4;
-			}
-	}
-
-	static inline void matvec(const V5& vector, const unsigned *matrix, V5& result)
-	{
-		memset(&result, 0, sizeof(V5));
-		matvec_i(0, vector.v0, matrix, result);
-		matvec_i(1, vector.v1, matrix, result);
-		matvec_i(2, vector.v2, matrix, result);
-		matvec_i(3, vector.v3, matrix, result);
-		matvec_i(4, vector.v4, matrix, result);
-	}
-
-	static inline void matmat(unsigned int *matrixA, const unsigned int *matrixB)
-	{
-		V5 result;
-		for (int i = 0; i < 160; i++)
+		if (count == 0) return;
+		GF2MatVec matvec = (kernels != nullptr ? *kernels : gf2_kernels()).matvec;
+		state_init(seed, first, 0, states[0]);
+		for (size_t i = 1; i < count; i++)
 		{
-			matvec(((V5*)matrixA)[i], matrixB, result);
-			((V5*)matrixA)[i] = result;
+			states[i].d = states[i - 1].d;
+			matvec(states[i - 1].v, p_sequence_matrix, states[i].v);
 		}
 	}
-
-
 };
-
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "rand_state_init_poly.h"
+#include "gf2_kernels.h"
+#include "rand_state_init.hpp"
+#include "ThreadPool.h"
+
+typedef unsigned long long u64;
+
+// polynomial over GF(2) of degree < 160, bit k is the coefficient of x^k
+struct Poly160
+{
+	u64 w[3];
+};
+
+static inline void poly_xor(Poly160& a, const Poly160& b)
+{
+	a.w[0] ^= b.w[0];
+	a.w[1] ^= b.w[1];
+	a.w[2] ^= b.w[2];
+}
+
+static inline unsigned poly_bit(const Poly160& a, int k)
+{
+	return (unsigned)(a.w[k >> 6] >> (k & 63)) & 1;
+}
+
+// the linear part of rand() in rand.shinc
+static inline void xorwow_step(V5& v)
+{
+	unsigned t = v.v0 ^ (v.v0 >> 2);
+	v.v0 = v.v1;
+	v.v1 = v.v2;
+	v.v2 = v.v3;
+	v.v3 = v.v4;
+	v.v4 = (v.v4 ^ (v.v4 << 4)) ^ (t ^ (t << 1));
+}
+
+// r = J(A) v, Horner scheme over the 160 coefficients of J
+static inline void poly_apply(const Poly160& J, const V5& v, V5& r)
+{
+	memset(&r, 0, sizeof(V5));
+	for (int k = 159; k >= 0; k--)
+	{
+		xorwow_step(r);
+		unsigned mask = 0u - poly_bit(J, k);
+		r.v0 ^= v.v0 & mask;
+		r.v1 ^= v.v1 & mask;
+		r.v2 ^= v.v2 & mask;
+		r.v3 ^= v.v3 & mask;
+		r.v4 ^= v.v4 & mask;
+	}
+}
+
+struct PolyTables
+{
+	Poly160 low;                 // P(x) - x^160
+	Poly160 reduce[40][16];      // (m * x^(160 + 4j)) mod P, for every nibble m
+	Poly160 pow2[131];           // x^(2^k) mod P, from k = 67 on these jump whole subsequences
+	unsigned stride_matrix[800]; // A^(2^67) in the layout of the gf2 kernels
+
+	PolyTables();
+	Poly160 mulmod(const Poly160& a, const Poly160& b) const;
+	Poly160 jump(unsigned long long subsequence, unsigned long long offset) const;
+};
+
+Poly160 PolyTables::mulmod(const Poly160& a, const Poly160& b) const
+{
+	// multiples of b by every 4-bit polynomial, degree < 163
+	Poly160 t[16];
+	memset(&t[0], 0, sizeof(Poly160));
+	t[1] = b;
+	for (int s = 1; s < 4; s++)
+	{
+		Poly160& d = t[1 << s];
+		d.w[2] = (b.w[2] << s) | (b.w[1] >> (64 - s));
+		d.w[1] = (b.w[1] << s) | (b.w[0] >> (64 - s));
+		d.w[0] = b.w[0] << s;
+	}
+	for (int m = 3; m < 16; m++)
+	{
+		int lowest = m & -m;
+		if (lowest == m) continue;
+		t[m] = t[lowest];
+		poly_xor(t[m], t[m ^ lowest]);
+	}
+
+	// schoolbook product, 4 bits of a at a time, degree < 319
+	u64 acc[5] = { 0, 0, 0, 0, 0 };
+	for (int n = 39; n >= 0; n--)
+	{
+		acc[4] = (acc[4] << 4) | (acc[3] >> 60);
+		acc[3] = (acc[3] << 4) | (acc[2] >> 60);
+		acc[2] = (acc[2] << 4) | (acc[1] >> 60);
+		acc[1] = (acc[1] << 4) | (acc[0] >> 60);
+		acc[0] = acc[0] << 4;
+		const Poly160& m = t[(a.w[n >> 4] >> ((n & 15) * 4)) & 0xF];
+		acc[0] ^= m.w[0];
+		acc[1] ^= m.w[1];
+		acc[2] ^= m.w[2];
+	}
+
+	// fold bits 160..319 back with the reduction table
+	Poly160 r = { { acc[0], acc[1], acc[2] & 0xFFFFFFFFull } };
+	for (int j = 0; j < 40; j++)
+	{
+		int bit = 160 + j * 4;
+		poly_xor(r, reduce[j][(acc[bit >> 6] >> (bit & 63)) & 0xF]);
+	}
+	return r;
+}
+
+Poly160 PolyTables::jump(unsigned long long subsequence, unsigned long long offset) const
+{
+	// x^(subsequence * 2^67 + offset) mod P
+	Poly160 J = { { 1, 0, 0 } };
+	for (int k = 0; k < 64; k++)
+		if ((offset >> k) & 1)
+			J = mulmod(J, pow2[k]);
+	for (int k = 0; k < 64; k++)
+		if ((subsequence >> k) & 1)
+			J = mulmod(J, pow2[67 + k]);
+	return J;
+}
+
+PolyTables::PolyTables()
+{
+	// Berlekamp-Massey over 320 output bits gives the minimal polynomial of the sequence,
+	// which for the full-period xorshift state is the characteristic polynomial of A (degree 160).
+	const int N = 320;
+	std::vector<int> s(N);
+	{
+		V5 v = { 123456789U, 362436069U, 521288629U, 88675123U, 5783321U };
+		for (int i = 0; i < N; i++)
+		{
+			s[i] = v.v4 & 1;
+			xorwow_step(v);
+		}
+	}
+
+	std::vector<int> C(N + 1, 0), B(N + 1, 0), T;
+	C[0] = B[0] = 1;
+	int L = 0, m = 1;
+	for (int n = 0; n < N; n++)
+	{
+		int d = s[n];
+		for (int i = 1; i <= L; i++)
+			d ^= C[i] & s[n - i];
+		if (d == 0)
+		{
+			m++;
+			continue;
+		}
+		T = C;
+		for (int i = 0; i + m <= N; i++)
+			C[i + m] ^= B[i];
+		if (2 * L <= n)
+		{
+			L = n + 1 - L;
+			B = T;
+			m = 1;
+		}
+		else
+		{
+			m++;
+		}
+	}
+
+	// P(x) = x^160 + c_1 x^159 + ... + c_160
+	memset(&low, 0, sizeof(Poly160));
+	for (int i = 1; i <= 160; i++)
+		if (C[i])
+			low.w[(160 - i) >> 6] |= 1ull << ((160 - i) & 63);
+
+	// x^(160 + k) mod P for k = 0..159, combined into nibble tables
+	{
+		std::vector<Poly160> xk(160);
+		Poly160 r = low;
+		for (int k = 0; k < 160; k++)
+		{
+			xk[k] = r;
+			bool carry = ((r.w[2] >> 31) & 1) != 0;
+			r.w[2] = ((r.w[2] << 1) | (r.w[1] >> 63)) & 0xFFFFFFFFull;
+			r.w[1] = (r.w[1] << 1) | (r.w[0] >> 63);
+			r.w[0] = r.w[0] << 1;
+			if (carry) poly_xor(r, low);
+		}
+
+		for (int j = 0; j < 40; j++)
+			for (int n = 0; n < 16; n++)
+			{
+				memset(&reduce[j][n], 0, sizeof(Poly160));
+				for (int b = 0; b < 4; b++)
+					if ((n >> b) & 1)
+						poly_xor(reduce[j][n], xk[j * 4 + b]);
+			}
+	}
+
+	Poly160 x = { { 2, 0, 0 } };
+	pow2[0] = x;
+	for (int k = 1; k < 131; k++)
+		pow2[k] = mulmod(pow2[k - 1], pow2[k - 1]);
+
+	// row j is the image of the unit vector of bit j
+	for (int j = 0; j < 160; j++)
+	{
+		V5 e;
+		memset(&e, 0, sizeof(V5));
+		(&e.v0)[j >> 5] = 1u << (j & 31);
+		poly_apply(pow2[67], e, ((V5*)stride_matrix)[j]);
+	}
+
+#ifdef _DEBUG
+	{
+		// P(A) v == 0
+		V5 v = { 123456789U, 362436069U, 521288629U, 88675123U, 5783321U };
+		V5 r;
+		poly_apply(low, v, r);
+		for (int i = 0; i < 160; i++)
+			xorwow_step(v);
+		if (L != 160 || memcmp(&r, &v, sizeof(V5)) != 0)
+			printf("RNGPoly: characteristic polynomial check failed\n");
+	}
+#endif
+}
+
+static const PolyTables& poly_tables()
+{
+	static PolyTables tables;
+	return tables;
+}
+
+void RNGPoly::state_init(unsigned long long seed,
+	unsigned long long subsequence,
+	unsigned long long offset,
+	RNGState& state) const
+{
+	unsigned int s0 = ((unsigned int)seed) ^ 0xaad26b49UL;
+	unsigned int s1 = (unsigned int)(seed >> 32) ^ 0xf7dcefddUL;
+	unsigned int t0 = 1099087573UL * s0;
+	unsigned int t1 = 2591861531UL * s1;
+	state.d = 6615241 + t1 + t0;
+	state.v.v0 = 123456789UL + t0;
+	state.v.v1 = 362436069UL ^ t0;
+	state.v.v2 = 521288629UL + t1;
+	state.v.v3 = 88675123UL ^ t1;
+	state.v.v4 = 5783321UL + t0;
+
+	if (subsequence != 0 || offset != 0)
+	{
+		Poly160 J = poly_tables().jump(subsequence, offset);
+		V5 v = state.v;
+		poly_apply(J, v, state.v);
+	}
+	state.d += 362437 * (unsigned int)offset;
+}
+
+void RNGPoly::state_init_stride(unsigned long long seed,
+	unsigned long long first,
+	size_t count,
+	RNGState* states) const
+{
+	if (count == 0) return;
+	const unsigned* stride_matrix = poly_tables().stride_matrix;
+	GF2MatVec matvec = gf2_kernels().matvec;
+	state_init(seed, first, 0, states[0]);
+	for (size_t i = 1; i < count; i++)
+	{
+		states[i].d = states[i - 1].d;
+		matvec(states[i - 1].v, stride_matrix, states[i].v);
+	}
+}
+
+void rand_init_benchmark(unsigned count)
+{
+	// a single thread does a per-pixel jump-ahead for every 157th pixel only
+	const unsigned sparse_step = 157;
+	RNGPoly rng;
+	ThreadPool& pool = ThreadPool::get_pool();
+	std::vector<RNGState> per_pixel(count);
+	std::vector<RNGState> stride(count);
+	poly_tables();
+
+	auto run = [](const char* name, unsigned num_states, unsigned num_threads, const std::function<void()>& func)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		func();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		printf("RNG init %-12s %2u threads: %8u states in %8.1f ms, %8.3f Mstates/s\n", name, num_threads, num_states, ms, (double)num_states / ms * 1e-3);
+	};
+
+	printf("--- RNG init, %u states, GF(2) kernels %s ---\n", count, gf2_kernels().isa);
+	run("per-pixel", (count + sparse_step - 1) / sparse_step, 1, [&]()
+	{
+		for (unsigned i = 0; i < count; i += sparse_step)
+			rng.state_init(1234, i, 0, per_pixel[i]);
+	});
+	run("per-pixel", count, pool.num_threads(), [&]()
+	{
+		pool.parallel_for(count, 256, [&](size_t begin, size_t end, unsigned)
+		{
+			for (size_t i = begin; i < end; i++)
+				rng.state_init(1234, i, 0, per_pixel[i]);
+		});
+	});
+	run("stride", count, 1, [&]()
+	{
+		rng.state_init_stride(1234, 0, count, stride.data());
+	});
+	run("stride", count, pool.num_threads(), [&]()
+	{
+		pool.parallel_for(count, 4096, [&](size_t begin, size_t end, unsigned)
+		{
+			rng.state_init_stride(1234, begin, end - begin, stride.data() + begin);
+		});
+	});
+
+	unsigned mismatches = 0;
+	for (unsigned i = 0; i < count; i++)
+		if (memcmp(&per_pixel[i], &stride[i], sizeof(RNGState)) != 0) mismatches++;
+	printf("RNG init: %u stride states differ from the per-pixel jump-ahead\n", mismatches);
+
+	// The table jump-ahead of rand_state_init.hpp with every variant of the GF(2) kernels. Past the 7
+	// tabulated matrices a subsequence costs 4 matrix products per hex digit, so most pixel ids take
+	// the matmat kernel.
+	RNG table;
+	table.p_sequence_matrix = xorwow_sequence_matrix;
+	table.p_offset_matrix = xorwow_offset_matrix;
+	const char* isas[3] = { "scalar", "avx2", "avx512" };
+	for (int k = 0; k < 3; k++)
+	{
+		GF2Kernels kernels;
+		if (!gf2_kernels_isa(isas[k], kernels)) continue;
+		table.kernels = &kernels;
+
+		const int num_products = 2000;
+		unsigned matrix[800];
+		memcpy(matrix, xorwow_sequence_matrix, sizeof(matrix));
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < num_products; i++)
+			kernels.matmat(matrix, xorwow_sequence_matrix + 800);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		printf("GF(2) matmat %-6s: %8.1f k products/s\n", kernels.isa, (double)num_products / ms);
+
+		char name[16];
+		snprintf(name, sizeof(name), "table %s", kernels.isa);
+		unsigned table_mismatches = 0;
+		run(name, (count + sparse_step - 1) / sparse_step, 1, [&]()
+		{
+			for (unsigned i = 0; i < count; i += sparse_step)
+			{
+				RNGState state;
+				table.state_init(1234, i, 0, state);
+				if (memcmp(&state, &per_pixel[i], sizeof(RNGState)) != 0) table_mismatches++;
+			}
+		});
+		if (table_mismatches > 0)
+			printf("RNG init: %u table states differ from the per-pixel jump-ahead\n", table_mismatches);
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include "RNGState.h"
+
+// xorwow jump-ahead based on the characteristic polynomial P(x) of the 160-bit state transition A.
+// Advancing by n steps is A^n = (x^n mod P)(A), so a jump costs a few 160-bit polynomial products
+// plus one Horner evaluation (160 generator steps), without the 160x160 matrix tables.
+// Produces the same states as the table driven RNG in rand_state_init.hpp.
+struct RNGPoly
+{
+	void state_init(unsigned long long seed,
+		unsigned long long subsequence,
+		unsigned long long offset,
+		RNGState& state) const;
+
+	// Same as RNG::state_init_stride(): subsequences first .. first+count-1, offset 0.
+	void state_init_stride(unsigned long long seed,
+		unsigned long long first,
+		size_t count,
+		RNGState* states) const;
+};
+
+// States/s of state_init() (a jump-ahead per pixel) and state_init_stride() for the pixel ids 0..count-1,
+// on one thread and on all threads of the pool, with the GF(2) kernels of gf2_kernels(): run it once per
+// XORWOW_GF2_ISA to compare the variants. Then, for every variant the CPU supports, products/s of the
+// matmat kernel and states/s of the table driven RNG of rand_state_init.hpp, which uses it. All states
+// are checked against the per-pixel ones.
+void rand_init_benchmark(unsigned count);
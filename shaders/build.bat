@@ -1,10 +1,14 @@
 glslangValidator -V final.comp -o final.spv
 
 glslangValidator -V raygen.rgen -o raygen.spv
+glslangValidator -V --target-env vulkan1.1 regen.rgen -o regen.spv
 glslangValidator -V miss.rmiss -o miss.spv
 glslangValidator -V miss_shadow.rmiss -o miss_shadow.spv
 glslangValidator -V closesthit_triangles.rchit -o closesthit_triangles.spv
 glslangValidator -V intersection_spheres.rint -o intersection_spheres.spv
 glslangValidator -V closesthit_spheres.rchit -o closesthit_spheres.spv
 
-
+glslangValidator -V wf_generate.comp -o wf_generate.spv
+glslangValidator -V wf_extend.rgen -o wf_extend.spv
+glslangValidator -V --target-env vulkan1.1 wf_shade.comp -o wf_shade.spv
+glslangValidator -V wf_accumulate.comp -o wf_accumulate.spv
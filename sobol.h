@@ -0,0 +1,15 @@
+#pragma once
+
+// Direction numbers of the first two Sobol dimensions, 32 per dimension, in the layout of
+// sobol_dirs[] in shaders/sampler.shinc.
+inline void sobol_directions_2d(unsigned dirs[64])
+{
+	// dimension 0: van der Corput
+	for (int i = 0; i < 32; i++)
+		dirs[i] = 1u << (31 - i);
+
+	// dimension 1: primitive polynomial x + 1, m_1 = 1
+	dirs[32] = 1u << 31;
+	for (int i = 1; i < 32; i++)
+		dirs[32 + i] = dirs[31 + i] ^ (dirs[31 + i] >> 1);
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <chrono>
+#include <vector>
+#include "sphere_kernels.h"
+#include "cpu_features.h"
+#include "bench_rand.h"
+
+// AVX-512 implies FMA and GCC would fuse the products and sums of that variant only
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+void sphere_block_clear(SphereBlock& block)
+{
+	memset(&block, 0, sizeof(SphereBlock));
+	for (int i = 0; i < SPHERE_BLOCK_SIZE; i++)
+		block.radius2[i] = -INFINITY;
+}
+
+void sphere_block_set(SphereBlock& block, int lane, const glm::vec3& center, float radius, unsigned prim)
+{
+	for (int k = 0; k < 3; k++)
+		block.center[k][lane] = center[k];
+	block.radius2[lane] = radius * radius;
+	block.prim[lane] = prim;
+}
+
+// closest of the lanes in mask, lowest lane on ties like the strict t < tmax of the scalar loop.
+// near_mask: the lanes hit by the near root.
+static inline int pick_lane(unsigned mask, unsigned near_mask, const float* t_lanes, float& t, float& side)
+{
+	if (mask == 0) return -1;
+	int lane = -1;
+	float t_best = FLT_MAX;
+	for (int i = 0; i < SPHERE_BLOCK_SIZE; i++)
+		if ((mask & (1u << i)) != 0 && (lane < 0 || t_lanes[i] < t_best))
+		{
+			lane = i;
+			t_best = t_lanes[i];
+		}
+	t = t_lanes[lane];
+	side = (near_mask & (1u << lane)) != 0 ? 1.0f : -1.0f;
+	return lane;
+}
+
+// scalar reference, intersection_spheres.rint with the ray origin relative to the center
+
+static int intersect_scalar(const SphereBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& side)
+{
+	const float a = glm::dot(direction, direction);
+	int lane = -1;
+	for (int i = 0; i < SPHERE_BLOCK_SIZE; i++)
+	{
+		glm::vec3 oc = origin - glm::vec3(block.center[0][i], block.center[1][i], block.center[2][i]);
+		const float b = glm::dot(oc, direction);
+		const float c = glm::dot(oc, oc) - block.radius2[i];
+		const float discriminant = b * b - a * c;
+		if (!(discriminant >= 0.0f)) continue;
+
+		const float t1 = (-b - sqrtf(discriminant)) / a;
+		const float t2 = (-b + sqrtf(discriminant)) / a;
+		if (tmin <= t1 && t1 < tmax)
+		{
+			tmax = t1;
+			t = t1;
+			side = 1.0f;
+			lane = i;
+		}
+		else if (tmin <= t2 && t2 < tmax)
+		{
+			tmax = t2;
+			t = t2;
+			side = -1.0f;
+			lane = i;
+		}
+	}
+	return lane;
+}
+
+#ifdef CPU_X86
+
+// The vector variants evaluate all lanes branch-free against the tmax of the call, the closest valid
+// lane is then the one the narrowing tmax of the scalar loop ends up with. A negative discriminant
+// gives NaN roots, which fail the ordered compares.
+
+// SSE: four groups of 4 lanes
+
+static inline unsigned lanes_sse(const SphereBlock& block, int base, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float* t_lanes, unsigned& near_mask)
+{
+	__m128 dx = _mm_set1_ps(direction.x);
+	__m128 dy = _mm_set1_ps(direction.y);
+	__m128 dz = _mm_set1_ps(direction.z);
+	__m128 a = _mm_set1_ps(glm::dot(direction, direction));
+
+	__m128 ox = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(block.center[0] + base));
+	__m128 oy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(block.center[1] + base));
+	__m128 oz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(block.center[2] + base));
+	__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)), _mm_mul_ps(oz, dz));
+	__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)), _mm_loadu_ps(block.radius2 + base));
+	__m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+
+	__m128 s = _mm_sqrt_ps(discriminant);
+	__m128 nb = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+	__m128 t1 = _mm_div_ps(_mm_sub_ps(nb, s), a);
+	__m128 t2 = _mm_div_ps(_mm_add_ps(nb, s), a);
+
+	__m128 t_min = _mm_set1_ps(tmin);
+	__m128 t_max = _mm_set1_ps(tmax);
+	__m128 valid1 = _mm_and_ps(_mm_cmple_ps(t_min, t1), _mm_cmplt_ps(t1, t_max));
+	__m128 valid2 = _mm_and_ps(_mm_cmple_ps(t_min, t2), _mm_cmplt_ps(t2, t_max));
+
+	_mm_storeu_ps(t_lanes + base, _mm_or_ps(_mm_and_ps(valid1, t1), _mm_andnot_ps(valid1, t2)));
+	near_mask |= (unsigned)_mm_movemask_ps(valid1) << base;
+	return (unsigned)_mm_movemask_ps(_mm_or_ps(valid1, valid2)) << base;
+}
+
+static int intersect_sse(const SphereBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& side)
+{
+	float t_lanes[SPHERE_BLOCK_SIZE];
+	unsigned near_mask = 0;
+	unsigned mask = 0;
+	for (int base = 0; base < SPHERE_BLOCK_SIZE; base += 4)
+		mask |= lanes_sse(block, base, origin, direction, tmin, tmax, t_lanes, near_mask);
+	return pick_lane(mask, near_mask, t_lanes, t, side);
+}
+
+// AVX2: two groups of 8 lanes
+
+TARGET_AVX2 static inline unsigned lanes_avx2(const SphereBlock& block, int base, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float* t_lanes, unsigned& near_mask)
+{
+	__m256 dx = _mm256_set1_ps(direction.x);
+	__m256 dy = _mm256_set1_ps(direction.y);
+	__m256 dz = _mm256_set1_ps(direction.z);
+	__m256 a = _mm256_set1_ps(glm::dot(direction, direction));
+
+	__m256 ox = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(block.center[0] + base));
+	__m256 oy = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(block.center[1] + base));
+	__m256 oz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(block.center[2] + base));
+	__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)), _mm256_mul_ps(oz, dz));
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)), _mm256_mul_ps(oz, oz)), _mm256_loadu_ps(block.radius2 + base));
+	__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+
+	__m256 s = _mm256_sqrt_ps(discriminant);
+	__m256 nb = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+	__m256 t1 = _mm256_div_ps(_mm256_sub_ps(nb, s), a);
+	__m256 t2 = _mm256_div_ps(_mm256_add_ps(nb, s), a);
+
+	__m256 t_min = _mm256_set1_ps(tmin);
+	__m256 t_max = _mm256_set1_ps(tmax);
+	__m256 valid1 = _mm256_and_ps(_mm256_cmp_ps(t_min, t1, _CMP_LE_OQ), _mm256_cmp_ps(t1, t_max, _CMP_LT_OQ));
+	__m256 valid2 = _mm256_and_ps(_mm256_cmp_ps(t_min, t2, _CMP_LE_OQ), _mm256_cmp_ps(t2, t_max, _CMP_LT_OQ));
+
+	_mm256_storeu_ps(t_lanes + base, _mm256_blendv_ps(t2, t1, valid1));
+	near_mask |= (unsigned)_mm256_movemask_ps(valid1) << base;
+	return (unsigned)_mm256_movemask_ps(_mm256_or_ps(valid1, valid2)) << base;
+}
+
+TARGET_AVX2 static int intersect_avx2(const SphereBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& side)
+{
+	float t_lanes[SPHERE_BLOCK_SIZE];
+	unsigned near_mask = 0;
+	unsigned mask = lanes_avx2(block, 0, origin, direction, tmin, tmax, t_lanes, near_mask);
+	mask |= lanes_avx2(block, 8, origin, direction, tmin, tmax, t_lanes, near_mask);
+	return pick_lane(mask, near_mask, t_lanes, t, side);
+}
+
+// AVX-512F: all 16 lanes in one register, the closest lane is found with a horizontal minimum
+// and its side comes from the near root mask
+
+TARGET_AVX512 static int intersect_avx512(const SphereBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& side)
+{
+	__m512 dx = _mm512_set1_ps(direction.x);
+	__m512 dy = _mm512_set1_ps(direction.y);
+	__m512 dz = _mm512_set1_ps(direction.z);
+	__m512 a = _mm512_set1_ps(glm::dot(direction, direction));
+
+	__m512 ox = _mm512_sub_ps(_mm512_set1_ps(origin.x), _mm512_loadu_ps(block.center[0]));
+	__m512 oy = _mm512_sub_ps(_mm512_set1_ps(origin.y), _mm512_loadu_ps(block.center[1]));
+	__m512 oz = _mm512_sub_ps(_mm512_set1_ps(origin.z), _mm512_loadu_ps(block.center[2]));
+	__m512 b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ox, dx), _mm512_mul_ps(oy, dy)), _mm512_mul_ps(oz, dz));
+	__m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ox, ox), _mm512_mul_ps(oy, oy)), _mm512_mul_ps(oz, oz)), _mm512_loadu_ps(block.radius2));
+	__m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(a, c));
+	__mmask16 hit = _mm512_cmp_ps_mask(discriminant, _mm512_setzero_ps(), _CMP_GE_OQ);
+	if (hit == 0) return -1;
+
+	__m512 s = _mm512_sqrt_ps(discriminant);
+	__m512 nb = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(b), _mm512_set1_epi32((int)0x80000000u)));
+	__m512 t1 = _mm512_div_ps(_mm512_sub_ps(nb, s), a);
+	__m512 t2 = _mm512_div_ps(_mm512_add_ps(nb, s), a);
+
+	__m512 t_min = _mm512_set1_ps(tmin);
+	__m512 t_max = _mm512_set1_ps(tmax);
+	__mmask16 valid1 = _mm512_mask_cmp_ps_mask(hit, t_min, t1, _CMP_LE_OQ);
+	valid1 = _mm512_mask_cmp_ps_mask(valid1, t1, t_max, _CMP_LT_OQ);
+	__mmask16 valid2 = _mm512_mask_cmp_ps_mask(hit, t_min, t2, _CMP_LE_OQ);
+	valid2 = _mm512_mask_cmp_ps_mask(valid2, t2, t_max, _CMP_LT_OQ);
+	__mmask16 valid = valid1 | valid2;
+	if (valid == 0) return -1;
+
+	__m512 tl = _mm512_mask_mov_ps(t2, valid1, t1);
+	__m512 tm = _mm512_mask_mov_ps(_mm512_set1_ps(FLT_MAX), valid, tl);
+	float t_best = _mm512_reduce_min_ps(tm);
+	int lane = lowest_bit(valid & _mm512_cmp_ps_mask(tm, _mm512_set1_ps(t_best), _CMP_EQ_OQ));
+	t = t_best;
+	side = (valid1 & (1u << lane)) != 0 ? 1.0f : -1.0f;
+	return lane;
+}
+
+#endif
+
+static SphereKernels select_kernels()
+{
+	SphereKernels scalar = { "scalar", intersect_scalar };
+	const char* forced = getenv("SPHERE_ISA");
+	if (forced != nullptr && strcmp(forced, "scalar") == 0) return scalar;
+
+#ifdef CPU_X86
+	SphereKernels sse = { "sse", intersect_sse };
+	SphereKernels avx2 = { "avx2", intersect_avx2 };
+	SphereKernels avx512 = { "avx512", intersect_avx512 };
+
+	bool has_avx2 = cpu_has_avx2();
+	bool has_avx512 = has_avx2 && cpu_has_avx512();
+
+	if (forced != nullptr && strcmp(forced, "sse") == 0) return sse;
+	if (forced != nullptr && strcmp(forced, "avx2") == 0 && has_avx2) return avx2;
+	if (has_avx512) return avx512;
+	if (has_avx2) return avx2;
+	return sse;
+#else
+	return scalar;
+#endif
+}
+
+const SphereKernels& sphere_kernels()
+{
+	static SphereKernels kernels = select_kernels();
+	return kernels;
+}
+
+void sphere_kernels_benchmark()
+{
+	const int num_blocks = 1024;  // 320KB, resident in L2 like the leaves near the camera
+	const int num_rays = 256;
+	const int num_rounds = 16;
+
+	BenchRand rng(0x9E3779B9u);
+	std::vector<SphereBlock> blocks(num_blocks);
+	for (int i = 0; i < num_blocks; i++)
+	{
+		sphere_block_clear(blocks[i]);
+		glm::vec3 c = glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+		for (int j = 0; j < SPHERE_BLOCK_SIZE; j++)
+		{
+			glm::vec3 center = c + 0.3f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+			float radius = 0.1f + 0.05f * rng.uniform_signed();
+			sphere_block_set(blocks[i], j, center, radius, (unsigned)(i * SPHERE_BLOCK_SIZE + j));
+		}
+	}
+	std::vector<glm::vec3> origins(num_rays), directions(num_rays);
+	for (int i = 0; i < num_rays; i++)
+	{
+		origins[i] = 3.0f * glm::normalize(glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed()));
+		glm::vec3 target = 0.5f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+		directions[i] = glm::normalize(target - origins[i]);
+	}
+
+	std::vector<SphereKernels> variants;
+	variants.push_back({ "scalar", intersect_scalar });
+#ifdef CPU_X86
+	variants.push_back({ "sse", intersect_sse });
+	if (cpu_has_avx2()) variants.push_back({ "avx2", intersect_avx2 });
+	if (cpu_has_avx2() && cpu_has_avx512()) variants.push_back({ "avx512", intersect_avx512 });
+#endif
+
+	std::vector<int> reference_lanes;
+	std::vector<float> reference_t;
+	std::vector<float> reference_side;
+	double scalar_rate = 0.0;
+	for (size_t k = 0; k < variants.size(); k++)
+	{
+		SphereBlockIntersect intersect = variants[k].intersect;
+		std::vector<int> lanes((size_t)num_rays * num_blocks);
+		std::vector<float> ts((size_t)num_rays * num_blocks);
+		std::vector<float> sides((size_t)num_rays * num_blocks);
+		unsigned long long hits = 0;
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < num_rounds; r++)
+			for (int i = 0; i < num_rays; i++)
+				for (int j = 0; j < num_blocks; j++)
+				{
+					float t = 0.0f, side = 0.0f;
+					int lane = intersect(blocks[j], origins[i], directions[i], 0.0001f, 10000.0f, t, side);
+					hits += lane >= 0 ? 1 : 0;
+					lanes[(size_t)i * num_blocks + j] = lane;
+					ts[(size_t)i * num_blocks + j] = t;
+					sides[(size_t)i * num_blocks + j] = side;
+				}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		if (k == 0)
+		{
+			reference_lanes = lanes;
+			reference_t = ts;
+			reference_side = sides;
+		}
+		unsigned mismatches = 0;
+		for (size_t i = 0; i < lanes.size(); i++)
+			if (lanes[i] != reference_lanes[i] || (lanes[i] >= 0 && (memcmp(&ts[i], &reference_t[i], sizeof(float)) != 0 || sides[i] != reference_side[i])))
+				mismatches++;
+
+		double tests = (double)num_rounds * num_rays * num_blocks * SPHERE_BLOCK_SIZE;
+		double rate = tests / ms * 1e-3;
+		if (k == 0) scalar_rate = rate;
+		printf("sphere kernel %-6s: %8.1f M intersections/s (%.2fx scalar), %llu block hits, %u mismatches\n",
+			variants[k].isa, rate, rate / scalar_rate, hits / num_rounds, mismatches);
+	}
+	printf("sphere kernel in use: %s\n", sphere_kernels().isa);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <glm.hpp>
+
+#define SPHERE_BLOCK_SIZE 16
+
+// Up to 16 world space spheres of a BVH leaf in structure-of-arrays layout. Unused lanes have
+// radius2 = -inf, their discriminant is -inf and they are never hit.
+struct SphereBlock
+{
+	float center[3][SPHERE_BLOCK_SIZE];
+	float radius2[SPHERE_BLOCK_SIZE];
+	unsigned prim[SPHERE_BLOCK_SIZE];
+};
+
+void sphere_block_clear(SphereBlock& block);
+void sphere_block_set(SphereBlock& block, int lane, const glm::vec3& center, float radius, unsigned prim);
+
+// The quadratic of intersection_spheres.rint in world space for one ray against all lanes of a block.
+// Returns the lane of the closest hit with tmin <= t < tmax (the lowest lane on ties), its t and
+// side (1 entering, -1 leaving through the far root), or -1.
+// All variants evaluate the same expressions in the same order as the scalar one.
+typedef int(*SphereBlockIntersect)(const SphereBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& side);
+
+struct SphereKernels
+{
+	const char* isa;
+	SphereBlockIntersect intersect;
+};
+
+// Best kernel for the running CPU, selected once by feature detection.
+// Setting the environment variable SPHERE_ISA to "scalar", "sse", "avx2" or "avx512" forces a variant
+// (when supported).
+const SphereKernels& sphere_kernels();
+
+// Runs every variant the CPU supports over random blocks and rays, checks them against the scalar
+// one and prints the ray-sphere tests per second.
+void sphere_kernels_benchmark();
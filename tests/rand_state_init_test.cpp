@@ -0,0 +1,94 @@
+// RNGPoly against the table driven jump-ahead of rand_state_init.hpp (the one of cu_rand_init), over
+// random seeds, subsequences and offsets, and for state_init_stride(). Returns nonzero on a mismatch.
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "rand_state_init.hpp"
+#include "rand_state_init_poly.h"
+
+static unsigned long long splitmix64(unsigned long long& x)
+{
+	unsigned long long z = (x += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// small, pixel-id sized or any 64-bit value
+static unsigned long long random_index(unsigned long long& x)
+{
+	unsigned long long r = splitmix64(x);
+	switch (r & 3)
+	{
+	case 0: return (r >> 2) & 0xF;
+	case 1: return (r >> 2) & 0xFFFFFF;
+	default: return splitmix64(x);
+	}
+}
+
+static bool same(const RNGState& a, const RNGState& b)
+{
+	return memcmp(&a, &b, sizeof(RNGState)) == 0;
+}
+
+int main()
+{
+	const int num_cases = 256;
+	const int num_stride_runs = 16;
+	const size_t stride_count = 1000;
+
+	RNG table;
+	table.p_sequence_matrix = xorwow_sequence_matrix;
+	table.p_offset_matrix = xorwow_offset_matrix;
+	RNGPoly poly;
+
+	unsigned long long x = 0x5EEDull;
+	unsigned failures = 0;
+
+	struct Case { unsigned long long seed, subsequence, offset; };
+	std::vector<Case> cases = { { 1234, 0, 0 }, { 1234, 1, 0 }, { 1234, 0, 1 }, { 0, ~0ull, ~0ull } };
+	for (int i = 0; i < num_cases; i++)
+	{
+		Case c;
+		c.seed = splitmix64(x);
+		c.subsequence = random_index(x);
+		c.offset = random_index(x);
+		cases.push_back(c);
+	}
+
+	for (const Case& c : cases)
+	{
+		RNGState ref, state;
+		table.state_init(c.seed, c.subsequence, c.offset, ref);
+		poly.state_init(c.seed, c.subsequence, c.offset, state);
+		if (!same(ref, state))
+		{
+			printf("state_init(%llu, %llu, %llu) differs from the table driven jump-ahead\n", c.seed, c.subsequence, c.offset);
+			failures++;
+		}
+	}
+
+	std::vector<RNGState> states(stride_count);
+	std::vector<RNGState> table_states(stride_count);
+	for (int run = 0; run < num_stride_runs; run++)
+	{
+		unsigned long long seed = run == 0 ? 1234 : splitmix64(x);
+		unsigned long long first = run == 0 ? 0 : random_index(x);
+		poly.state_init_stride(seed, first, stride_count, states.data());
+		table.state_init_stride(seed, first, stride_count, table_states.data());
+		for (size_t i = 0; i < stride_count; i++)
+		{
+			RNGState ref;
+			table.state_init(seed, first + i, 0, ref);
+			if (!same(ref, states[i]) || !same(ref, table_states[i]))
+			{
+				printf("state_init_stride(%llu, %llu): state %u differs from the table driven jump-ahead\n", seed, first, (unsigned)i);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	printf("rand_state_init_test (%s): %u cases, %d stride runs of %u states, %u failures\n", gf2_kernels().isa, (unsigned)cases.size(), num_stride_runs, (unsigned)stride_count, failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <chrono>
+#include <vector>
+#include "tri_kernels.h"
+#include "cpu_features.h"
+#include "bench_rand.h"
+
+// AVX-512 implies FMA and GCC would fuse the products and sums of that variant only
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+void tri_block_clear(TriangleBlock& block)
+{
+	memset(&block, 0, sizeof(TriangleBlock));
+}
+
+void tri_block_set(TriangleBlock& block, int lane, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, unsigned prim)
+{
+	glm::vec3 e1 = p1 - p0;
+	glm::vec3 e2 = p2 - p0;
+	for (int k = 0; k < 3; k++)
+	{
+		block.p0[k][lane] = p0[k];
+		block.e1[k][lane] = e1[k];
+		block.e2[k][lane] = e2[k];
+	}
+	block.prim[lane] = prim;
+}
+
+// closest of the lanes in mask, lowest lane on ties like the strict t < tmax of the scalar loop
+static inline int pick_lane(unsigned mask, const float* t_lanes, const float* u_lanes, const float* v_lanes, float& t, float& u, float& v)
+{
+	if (mask == 0) return -1;
+	int lane = -1;
+	float t_best = FLT_MAX;
+	for (int i = 0; i < TRI_BLOCK_SIZE; i++)
+		if ((mask & (1u << i)) != 0 && (lane < 0 || t_lanes[i] < t_best))
+		{
+			lane = i;
+			t_best = t_lanes[i];
+		}
+	t = t_lanes[lane];
+	u = u_lanes[lane];
+	v = v_lanes[lane];
+	return lane;
+}
+
+// scalar reference, the per-triangle test of the CPU tracer with the edges loaded from the block
+
+static int intersect_scalar(const TriangleBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& u, float& v)
+{
+	int lane = -1;
+	for (int i = 0; i < TRI_BLOCK_SIZE; i++)
+	{
+		glm::vec3 p0 = glm::vec3(block.p0[0][i], block.p0[1][i], block.p0[2][i]);
+		glm::vec3 e1 = glm::vec3(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+		glm::vec3 e2 = glm::vec3(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
+		glm::vec3 pvec = glm::cross(direction, e2);
+		float det = glm::dot(e1, pvec);
+		if (det == 0.0f) continue;
+		float inv_det = 1.0f / det;
+		glm::vec3 tvec = origin - p0;
+		float ui = glm::dot(tvec, pvec) * inv_det;
+		if (ui < 0.0f || ui > 1.0f) continue;
+		glm::vec3 qvec = glm::cross(tvec, e1);
+		float vi = glm::dot(direction, qvec) * inv_det;
+		if (vi < 0.0f || ui + vi > 1.0f) continue;
+		float ti = glm::dot(e2, qvec) * inv_det;
+		if (ti >= tmin && ti < tmax)
+		{
+			tmax = ti;
+			t = ti;
+			u = ui;
+			v = vi;
+			lane = i;
+		}
+	}
+	return lane;
+}
+
+// Packets: the rays share the origin, so tvec, qvec and dot(e2, qvec) are computed once per triangle,
+// with the same expressions as above.
+
+struct PacketTriangle
+{
+	float e1[3];
+	float e2[3];
+	float tvec[3];
+	float qvec[3];
+	float e2q;
+	unsigned prim;
+};
+
+static inline void packet_triangle(const TriangleBlock& block, int lane, const glm::vec3& origin, PacketTriangle& tri)
+{
+	glm::vec3 p0 = glm::vec3(block.p0[0][lane], block.p0[1][lane], block.p0[2][lane]);
+	glm::vec3 e1 = glm::vec3(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+	glm::vec3 e2 = glm::vec3(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+	glm::vec3 tvec = origin - p0;
+	glm::vec3 qvec = glm::cross(tvec, e1);
+	for (int k = 0; k < 3; k++)
+	{
+		tri.e1[k] = e1[k];
+		tri.e2[k] = e2[k];
+		tri.tvec[k] = tvec[k];
+		tri.qvec[k] = qvec[k];
+	}
+	tri.e2q = glm::dot(e2, qvec);
+	tri.prim = block.prim[lane];
+}
+
+static void intersect_packet_scalar(const TriangleBlock& block, int num_triangles, TriRayPacket& packet, float tmin)
+{
+	for (int l = 0; l < num_triangles; l++)
+	{
+		PacketTriangle tri;
+		packet_triangle(block, l, packet.origin, tri);
+		glm::vec3 e1 = glm::vec3(tri.e1[0], tri.e1[1], tri.e1[2]);
+		glm::vec3 e2 = glm::vec3(tri.e2[0], tri.e2[1], tri.e2[2]);
+		glm::vec3 tvec = glm::vec3(tri.tvec[0], tri.tvec[1], tri.tvec[2]);
+		glm::vec3 qvec = glm::vec3(tri.qvec[0], tri.qvec[1], tri.qvec[2]);
+		for (int r = 0; r < packet.num_rays; r++)
+		{
+			glm::vec3 direction = glm::vec3(packet.dir[0][r], packet.dir[1][r], packet.dir[2][r]);
+			glm::vec3 pvec = glm::cross(direction, e2);
+			float det = glm::dot(e1, pvec);
+			if (det == 0.0f) continue;
+			float inv_det = 1.0f / det;
+			float u = glm::dot(tvec, pvec) * inv_det;
+			if (u < 0.0f || u > 1.0f) continue;
+			float v = glm::dot(direction, qvec) * inv_det;
+			if (v < 0.0f || u + v > 1.0f) continue;
+			float t = tri.e2q * inv_det;
+			if (t >= tmin && t < packet.t[r])
+			{
+				packet.t[r] = t;
+				packet.u[r] = u;
+				packet.v[r] = v;
+				packet.prim[r] = tri.prim;
+			}
+		}
+	}
+}
+
+#ifdef CPU_X86
+
+// The vector variants evaluate all lanes branch-free. The rejections of the scalar code become
+// "not less"/"not greater" compares, which like the scalar branches let NaNs through to the t test.
+
+// SSE: two groups of 4 lanes
+
+static inline unsigned lanes_sse(const TriangleBlock& block, int base, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float* t_lanes, float* u_lanes, float* v_lanes)
+{
+	__m128 dx = _mm_set1_ps(direction.x);
+	__m128 dy = _mm_set1_ps(direction.y);
+	__m128 dz = _mm_set1_ps(direction.z);
+	__m128 e1x = _mm_loadu_ps(block.e1[0] + base);
+	__m128 e1y = _mm_loadu_ps(block.e1[1] + base);
+	__m128 e1z = _mm_loadu_ps(block.e1[2] + base);
+	__m128 e2x = _mm_loadu_ps(block.e2[0] + base);
+	__m128 e2y = _mm_loadu_ps(block.e2[1] + base);
+	__m128 e2z = _mm_loadu_ps(block.e2[2] + base);
+
+	// pvec = cross(direction, e2)
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(block.p0[0] + base));
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(block.p0[1] + base));
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(block.p0[2] + base));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+	// qvec = cross(tvec, e1)
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 valid = _mm_cmpneq_ps(det, zero);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(tmin)), _mm_cmplt_ps(t, _mm_set1_ps(tmax))));
+
+	_mm_storeu_ps(t_lanes + base, t);
+	_mm_storeu_ps(u_lanes + base, u);
+	_mm_storeu_ps(v_lanes + base, v);
+	return (unsigned)_mm_movemask_ps(valid) << base;
+}
+
+static int intersect_sse(const TriangleBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& u, float& v)
+{
+	float t_lanes[TRI_BLOCK_SIZE], u_lanes[TRI_BLOCK_SIZE], v_lanes[TRI_BLOCK_SIZE];
+	unsigned mask = lanes_sse(block, 0, origin, direction, tmin, tmax, t_lanes, u_lanes, v_lanes);
+	mask |= lanes_sse(block, 4, origin, direction, tmin, tmax, t_lanes, u_lanes, v_lanes);
+	return pick_lane(mask, t_lanes, u_lanes, v_lanes, t, u, v);
+}
+
+static void intersect_packet_sse(const TriangleBlock& block, int num_triangles, TriRayPacket& packet, float tmin)
+{
+	int num_rays = (packet.num_rays + 3) & ~3;
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 t_min = _mm_set1_ps(tmin);
+	for (int l = 0; l < num_triangles; l++)
+	{
+		PacketTriangle tri;
+		packet_triangle(block, l, packet.origin, tri);
+		__m128 e1x = _mm_set1_ps(tri.e1[0]), e1y = _mm_set1_ps(tri.e1[1]), e1z = _mm_set1_ps(tri.e1[2]);
+		__m128 e2x = _mm_set1_ps(tri.e2[0]), e2y = _mm_set1_ps(tri.e2[1]), e2z = _mm_set1_ps(tri.e2[2]);
+		__m128 tx = _mm_set1_ps(tri.tvec[0]), ty = _mm_set1_ps(tri.tvec[1]), tz = _mm_set1_ps(tri.tvec[2]);
+		__m128 qx = _mm_set1_ps(tri.qvec[0]), qy = _mm_set1_ps(tri.qvec[1]), qz = _mm_set1_ps(tri.qvec[2]);
+		__m128 e2q = _mm_set1_ps(tri.e2q);
+		__m128 prim = _mm_castsi128_ps(_mm_set1_epi32((int)tri.prim));
+		for (int r = 0; r < num_rays; r += 4)
+		{
+			__m128 dx = _mm_loadu_ps(packet.dir[0] + r);
+			__m128 dy = _mm_loadu_ps(packet.dir[1] + r);
+			__m128 dz = _mm_loadu_ps(packet.dir[2] + r);
+			__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+			__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+			__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+			__m128 inv_det = _mm_div_ps(one, det);
+			__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+			__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+			__m128 t = _mm_mul_ps(e2q, inv_det);
+			__m128 t_cur = _mm_loadu_ps(packet.t + r);
+
+			__m128 valid = _mm_cmpneq_ps(det, zero);
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, t_min), _mm_cmplt_ps(t, t_cur)));
+			if (_mm_movemask_ps(valid) == 0) continue;
+
+			_mm_storeu_ps(packet.t + r, _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, t_cur)));
+			_mm_storeu_ps(packet.u + r, _mm_or_ps(_mm_and_ps(valid, u), _mm_andnot_ps(valid, _mm_loadu_ps(packet.u + r))));
+			_mm_storeu_ps(packet.v + r, _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, _mm_loadu_ps(packet.v + r))));
+			__m128 prim_cur = _mm_loadu_ps((const float*)packet.prim + r);
+			_mm_storeu_ps((float*)packet.prim + r, _mm_or_ps(_mm_and_ps(valid, prim), _mm_andnot_ps(valid, prim_cur)));
+		}
+	}
+}
+
+// AVX2: the whole block in one register
+
+TARGET_AVX2 static int intersect_avx2(const TriangleBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t_out, float& u_out, float& v_out)
+{
+	__m256 dx = _mm256_set1_ps(direction.x);
+	__m256 dy = _mm256_set1_ps(direction.y);
+	__m256 dz = _mm256_set1_ps(direction.z);
+	__m256 e1x = _mm256_loadu_ps(block.e1[0]);
+	__m256 e1y = _mm256_loadu_ps(block.e1[1]);
+	__m256 e1z = _mm256_loadu_ps(block.e1[2]);
+	__m256 e2x = _mm256_loadu_ps(block.e2[0]);
+	__m256 e2y = _mm256_loadu_ps(block.e2[1]);
+	__m256 e2z = _mm256_loadu_ps(block.e2[2]);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(block.p0[0]));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(block.p0[1]));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(block.p0[2]));
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_NLT_UQ), _mm256_cmp_ps(u, one, _CMP_NGT_UQ)));
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NLT_UQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_NGT_UQ)));
+	valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(tmin), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+
+	unsigned mask = (unsigned)_mm256_movemask_ps(valid);
+	if (mask == 0) return -1;
+
+	// horizontal minimum of the valid t, the first lane holding it wins
+	__m256 tm = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t, valid);
+	__m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	int lane = lowest_bit(mask & (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(tm, m, _CMP_EQ_OQ)));
+
+	float t_lanes[TRI_BLOCK_SIZE], u_lanes[TRI_BLOCK_SIZE], v_lanes[TRI_BLOCK_SIZE];
+	_mm256_storeu_ps(t_lanes, t);
+	_mm256_storeu_ps(u_lanes, u);
+	_mm256_storeu_ps(v_lanes, v);
+	t_out = t_lanes[lane];
+	u_out = u_lanes[lane];
+	v_out = v_lanes[lane];
+	return lane;
+}
+
+TARGET_AVX2 static void intersect_packet_avx2(const TriangleBlock& block, int num_triangles, TriRayPacket& packet, float tmin)
+{
+	int num_rays = (packet.num_rays + 7) & ~7;
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 t_min = _mm256_set1_ps(tmin);
+	for (int l = 0; l < num_triangles; l++)
+	{
+		PacketTriangle tri;
+		packet_triangle(block, l, packet.origin, tri);
+		__m256 e1x = _mm256_set1_ps(tri.e1[0]), e1y = _mm256_set1_ps(tri.e1[1]), e1z = _mm256_set1_ps(tri.e1[2]);
+		__m256 e2x = _mm256_set1_ps(tri.e2[0]), e2y = _mm256_set1_ps(tri.e2[1]), e2z = _mm256_set1_ps(tri.e2[2]);
+		__m256 tx = _mm256_set1_ps(tri.tvec[0]), ty = _mm256_set1_ps(tri.tvec[1]), tz = _mm256_set1_ps(tri.tvec[2]);
+		__m256 qx = _mm256_set1_ps(tri.qvec[0]), qy = _mm256_set1_ps(tri.qvec[1]), qz = _mm256_set1_ps(tri.qvec[2]);
+		__m256 e2q = _mm256_set1_ps(tri.e2q);
+		__m256 prim = _mm256_castsi256_ps(_mm256_set1_epi32((int)tri.prim));
+		for (int r = 0; r < num_rays; r += 8)
+		{
+			__m256 dx = _mm256_loadu_ps(packet.dir[0] + r);
+			__m256 dy = _mm256_loadu_ps(packet.dir[1] + r);
+			__m256 dz = _mm256_loadu_ps(packet.dir[2] + r);
+			__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+			__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+			__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+			__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+			__m256 inv_det = _mm256_div_ps(one, det);
+			__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+			__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+			__m256 t = _mm256_mul_ps(e2q, inv_det);
+			__m256 t_cur = _mm256_loadu_ps(packet.t + r);
+
+			__m256 valid = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_NLT_UQ), _mm256_cmp_ps(u, one, _CMP_NGT_UQ)));
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NLT_UQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_NGT_UQ)));
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, t_min, _CMP_GE_OQ), _mm256_cmp_ps(t, t_cur, _CMP_LT_OQ)));
+			if (_mm256_movemask_ps(valid) == 0) continue;
+
+			_mm256_storeu_ps(packet.t + r, _mm256_blendv_ps(t_cur, t, valid));
+			_mm256_storeu_ps(packet.u + r, _mm256_blendv_ps(_mm256_loadu_ps(packet.u + r), u, valid));
+			_mm256_storeu_ps(packet.v + r, _mm256_blendv_ps(_mm256_loadu_ps(packet.v + r), v, valid));
+			_mm256_storeu_ps((float*)packet.prim + r, _mm256_blendv_ps(_mm256_loadu_ps((const float*)packet.prim + r), prim, valid));
+		}
+	}
+}
+
+// AVX-512VL: same 8 lanes, the rejections accumulate in a mask register and the result lane is
+// extracted with a compress instead of a round trip through memory
+
+TARGET_AVX512 static int intersect_avx512(const TriangleBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t_out, float& u_out, float& v_out)
+{
+	__m256 dx = _mm256_set1_ps(direction.x);
+	__m256 dy = _mm256_set1_ps(direction.y);
+	__m256 dz = _mm256_set1_ps(direction.z);
+	__m256 e1x = _mm256_loadu_ps(block.e1[0]);
+	__m256 e1y = _mm256_loadu_ps(block.e1[1]);
+	__m256 e1z = _mm256_loadu_ps(block.e1[2]);
+	__m256 e2x = _mm256_loadu_ps(block.e2[0]);
+	__m256 e2y = _mm256_loadu_ps(block.e2[1]);
+	__m256 e2z = _mm256_loadu_ps(block.e2[2]);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	__m256 zero = _mm256_setzero_ps();
+	__mmask8 valid = _mm256_cmp_ps_mask(det, zero, _CMP_NEQ_UQ);
+	__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(origin.x), _mm256_loadu_ps(block.p0[0]));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(origin.y), _mm256_loadu_ps(block.p0[1]));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(origin.z), _mm256_loadu_ps(block.p0[2]));
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+	__m256 one = _mm256_set1_ps(1.0f);
+	valid = _mm256_mask_cmp_ps_mask(valid, u, zero, _CMP_NLT_UQ);
+	valid = _mm256_mask_cmp_ps_mask(valid, u, one, _CMP_NGT_UQ);
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+	valid = _mm256_mask_cmp_ps_mask(valid, v, zero, _CMP_NLT_UQ);
+	valid = _mm256_mask_cmp_ps_mask(valid, _mm256_add_ps(u, v), one, _CMP_NGT_UQ);
+	valid = _mm256_mask_cmp_ps_mask(valid, t, _mm256_set1_ps(tmin), _CMP_GE_OQ);
+	valid = _mm256_mask_cmp_ps_mask(valid, t, _mm256_set1_ps(tmax), _CMP_LT_OQ);
+	if (valid == 0) return -1;
+
+	__m256 tm = _mm256_mask_mov_ps(_mm256_set1_ps(FLT_MAX), valid, t);
+	__m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	int lane = lowest_bit(valid & _mm256_cmp_ps_mask(tm, m, _CMP_EQ_OQ));
+
+	__mmask8 pick = (__mmask8)(1u << lane);
+	t_out = _mm256_cvtss_f32(_mm256_maskz_compress_ps(pick, t));
+	u_out = _mm256_cvtss_f32(_mm256_maskz_compress_ps(pick, u));
+	v_out = _mm256_cvtss_f32(_mm256_maskz_compress_ps(pick, v));
+	return lane;
+}
+
+// AVX-512F packets: 16 rays per register, the updates are masked stores
+
+TARGET_AVX512 static void intersect_packet_avx512(const TriangleBlock& block, int num_triangles, TriRayPacket& packet, float tmin)
+{
+	int num_rays = (packet.num_rays + 15) & ~15;
+	__m512 zero = _mm512_setzero_ps();
+	__m512 one = _mm512_set1_ps(1.0f);
+	__m512 t_min = _mm512_set1_ps(tmin);
+	for (int l = 0; l < num_triangles; l++)
+	{
+		PacketTriangle tri;
+		packet_triangle(block, l, packet.origin, tri);
+		__m512 e1x = _mm512_set1_ps(tri.e1[0]), e1y = _mm512_set1_ps(tri.e1[1]), e1z = _mm512_set1_ps(tri.e1[2]);
+		__m512 e2x = _mm512_set1_ps(tri.e2[0]), e2y = _mm512_set1_ps(tri.e2[1]), e2z = _mm512_set1_ps(tri.e2[2]);
+		__m512 tx = _mm512_set1_ps(tri.tvec[0]), ty = _mm512_set1_ps(tri.tvec[1]), tz = _mm512_set1_ps(tri.tvec[2]);
+		__m512 qx = _mm512_set1_ps(tri.qvec[0]), qy = _mm512_set1_ps(tri.qvec[1]), qz = _mm512_set1_ps(tri.qvec[2]);
+		__m512 e2q = _mm512_set1_ps(tri.e2q);
+		__m512i prim = _mm512_set1_epi32((int)tri.prim);
+		for (int r = 0; r < num_rays; r += 16)
+		{
+			__m512 dx = _mm512_loadu_ps(packet.dir[0] + r);
+			__m512 dy = _mm512_loadu_ps(packet.dir[1] + r);
+			__m512 dz = _mm512_loadu_ps(packet.dir[2] + r);
+			__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(e2y, dz));
+			__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(e2z, dx));
+			__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(e2x, dy));
+			__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+			__mmask16 valid = _mm512_cmp_ps_mask(det, zero, _CMP_NEQ_UQ);
+			__m512 inv_det = _mm512_div_ps(one, det);
+			__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz)), inv_det);
+			__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), inv_det);
+			__m512 t = _mm512_mul_ps(e2q, inv_det);
+			valid = _mm512_mask_cmp_ps_mask(valid, u, zero, _CMP_NLT_UQ);
+			valid = _mm512_mask_cmp_ps_mask(valid, u, one, _CMP_NGT_UQ);
+			valid = _mm512_mask_cmp_ps_mask(valid, v, zero, _CMP_NLT_UQ);
+			valid = _mm512_mask_cmp_ps_mask(valid, _mm512_add_ps(u, v), one, _CMP_NGT_UQ);
+			valid = _mm512_mask_cmp_ps_mask(valid, t, t_min, _CMP_GE_OQ);
+			valid = _mm512_mask_cmp_ps_mask(valid, t, _mm512_loadu_ps(packet.t + r), _CMP_LT_OQ);
+			if (valid == 0) continue;
+
+			_mm512_mask_storeu_ps(packet.t + r, valid, t);
+			_mm512_mask_storeu_ps(packet.u + r, valid, u);
+			_mm512_mask_storeu_ps(packet.v + r, valid, v);
+			_mm512_mask_storeu_epi32(packet.prim + r, valid, prim);
+		}
+	}
+}
+
+#endif
+
+static TriKernels select_kernels()
+{
+	TriKernels scalar = { "scalar", intersect_scalar, intersect_packet_scalar };
+	const char* forced = getenv("TRI_ISA");
+	if (forced != nullptr && strcmp(forced, "scalar") == 0) return scalar;
+
+#ifdef CPU_X86
+	TriKernels sse = { "sse", intersect_sse, intersect_packet_sse };
+	TriKernels avx2 = { "avx2", intersect_avx2, intersect_packet_avx2 };
+	TriKernels avx512 = { "avx512", intersect_avx512, intersect_packet_avx512 };
+
+	bool has_avx2 = cpu_has_avx2();
+	bool has_avx512 = has_avx2 && cpu_has_avx512();
+
+	if (forced != nullptr && strcmp(forced, "sse") == 0) return sse;
+	if (forced != nullptr && strcmp(forced, "avx2") == 0 && has_avx2) return avx2;
+	if (has_avx512) return avx512;
+	if (has_avx2) return avx2;
+	return sse;
+#else
+	return scalar;
+#endif
+}
+
+const TriKernels& tri_kernels()
+{
+	static TriKernels kernels = select_kernels();
+	return kernels;
+}
+
+void tri_kernels_benchmark()
+{
+	const int num_blocks = 1024;  // 320KB, resident in L2 like the leaves of a hot mesh
+	const int num_rays = 256;
+	const int num_rounds = 16;
+
+	BenchRand rng(0x9E3779B9u);
+	std::vector<TriangleBlock> blocks(num_blocks);
+	for (int i = 0; i < num_blocks; i++)
+	{
+		tri_block_clear(blocks[i]);
+		for (int j = 0; j < TRI_BLOCK_SIZE; j++)
+		{
+			glm::vec3 c = glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+			glm::vec3 p0 = c + 0.3f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+			glm::vec3 p1 = c + 0.3f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+			glm::vec3 p2 = c + 0.3f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+			tri_block_set(blocks[i], j, p0, p1, p2, (unsigned)(i * TRI_BLOCK_SIZE + j));
+		}
+	}
+	std::vector<glm::vec3> origins(num_rays), directions(num_rays);
+	for (int i = 0; i < num_rays; i++)
+	{
+		origins[i] = 3.0f * glm::normalize(glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed()));
+		glm::vec3 target = 0.5f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+		directions[i] = glm::normalize(target - origins[i]);
+	}
+
+	std::vector<TriKernels> variants;
+	variants.push_back({ "scalar", intersect_scalar, intersect_packet_scalar });
+#ifdef CPU_X86
+	variants.push_back({ "sse", intersect_sse, intersect_packet_sse });
+	if (cpu_has_avx2()) variants.push_back({ "avx2", intersect_avx2, intersect_packet_avx2 });
+	if (cpu_has_avx2() && cpu_has_avx512()) variants.push_back({ "avx512", intersect_avx512, intersect_packet_avx512 });
+#endif
+
+	std::vector<int> reference_lanes;
+	std::vector<float> reference_t;
+	double scalar_rate = 0.0;
+	for (size_t k = 0; k < variants.size(); k++)
+	{
+		TriBlockIntersect intersect = variants[k].intersect;
+		std::vector<int> lanes((size_t)num_rays * num_blocks);
+		std::vector<float> ts((size_t)num_rays * num_blocks);
+		unsigned long long hits = 0;
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < num_rounds; r++)
+			for (int i = 0; i < num_rays; i++)
+				for (int j = 0; j < num_blocks; j++)
+				{
+					float t = 0.0f, u, v;
+					int lane = intersect(blocks[j], origins[i], directions[i], 0.0001f, 10000.0f, t, u, v);
+					hits += lane >= 0 ? 1 : 0;
+					lanes[(size_t)i * num_blocks + j] = lane;
+					ts[(size_t)i * num_blocks + j] = t;
+				}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		if (k == 0)
+		{
+			reference_lanes = lanes;
+			reference_t = ts;
+		}
+		unsigned mismatches = 0;
+		for (size_t i = 0; i < lanes.size(); i++)
+			if (lanes[i] != reference_lanes[i] || (lanes[i] >= 0 && memcmp(&ts[i], &reference_t[i], sizeof(float)) != 0))
+				mismatches++;
+
+		double tests = (double)num_rounds * num_rays * num_blocks * TRI_BLOCK_SIZE;
+		double rate = tests / ms * 1e-3;
+		if (k == 0) scalar_rate = rate;
+		printf("triangle kernel %-6s: %8.1f M intersections/s (%.2fx scalar), %llu block hits, %u mismatches\n",
+			variants[k].isa, rate, rate / scalar_rate, hits / num_rounds, mismatches);
+	}
+
+	// packets of 64 rays from one origin, checked against the single-ray scalar kernel
+	TriRayPacket packet;
+	packet.origin = origins[0];
+	packet.num_rays = TRI_PACKET_RAYS;
+	std::vector<int> packet_lanes((size_t)num_blocks * TRI_PACKET_RAYS);
+	std::vector<float> packet_t((size_t)num_blocks * TRI_PACKET_RAYS);
+	for (int i = 0; i < TRI_PACKET_RAYS; i++)
+	{
+		glm::vec3 target = 0.5f * glm::vec3(rng.uniform_signed(), rng.uniform_signed(), rng.uniform_signed());
+		glm::vec3 direction = glm::normalize(target - packet.origin);
+		for (int k = 0; k < 3; k++)
+			packet.dir[k][i] = direction[k];
+		for (int j = 0; j < num_blocks; j++)
+		{
+			float t = 0.0f, u, v;
+			packet_lanes[(size_t)j * TRI_PACKET_RAYS + i] = intersect_scalar(blocks[j], packet.origin, direction, 0.0001f, 10000.0f, t, u, v);
+			packet_t[(size_t)j * TRI_PACKET_RAYS + i] = t;
+		}
+	}
+
+	for (size_t k = 0; k < variants.size(); k++)
+	{
+		TriBlockIntersectPacket intersect_packet = variants[k].intersect_packet;
+		unsigned mismatches = 0;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < num_rounds; r++)
+			for (int j = 0; j < num_blocks; j++)
+			{
+				for (int i = 0; i < TRI_PACKET_RAYS; i++)
+					packet.t[i] = 10000.0f;
+				intersect_packet(blocks[j], TRI_BLOCK_SIZE, packet, 0.0001f);
+				if (r > 0) continue;
+				for (int i = 0; i < TRI_PACKET_RAYS; i++)
+				{
+					int lane = packet_lanes[(size_t)j * TRI_PACKET_RAYS + i];
+					bool hit = packet.t[i] < 10000.0f;
+					if (hit != (lane >= 0) || (hit && (packet.prim[i] != blocks[j].prim[lane] || memcmp(&packet.t[i], &packet_t[(size_t)j * TRI_PACKET_RAYS + i], sizeof(float)) != 0)))
+						mismatches++;
+				}
+			}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		double tests = (double)num_rounds * num_blocks * TRI_PACKET_RAYS * TRI_BLOCK_SIZE;
+		double rate = tests / ms * 1e-3;
+		if (k == 0) scalar_rate = rate;
+		printf("packet kernel   %-6s: %8.1f M intersections/s (%.2fx scalar), %u mismatches\n",
+			variants[k].isa, rate, rate / scalar_rate, mismatches);
+	}
+	printf("triangle kernel in use: %s\n", tri_kernels().isa);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glm.hpp>
+
+#define TRI_BLOCK_SIZE 8
+
+// Up to 8 triangles of a BVH leaf in structure-of-arrays layout with the edges precomputed.
+// Unused lanes have zero edges, their determinant is 0 and they are never hit.
+struct TriangleBlock
+{
+	float p0[3][TRI_BLOCK_SIZE];
+	float e1[3][TRI_BLOCK_SIZE]; // p1 - p0
+	float e2[3][TRI_BLOCK_SIZE]; // p2 - p0
+	unsigned prim[TRI_BLOCK_SIZE];
+};
+
+void tri_block_clear(TriangleBlock& block);
+void tri_block_set(TriangleBlock& block, int lane, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, unsigned prim);
+
+// Two-sided Moller-Trumbore of one ray against all lanes of a block. Returns the lane of the closest
+// hit with tmin <= t < tmax (the lowest lane on ties) and its t and barycentrics, or -1.
+// All variants evaluate the same expressions in the same order as the scalar one.
+typedef int(*TriBlockIntersect)(const TriangleBlock& block, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, float& u, float& v);
+
+#define TRI_PACKET_RAYS 64
+#define TRI_PACKET_PAD 16
+
+// Rays with a common origin in structure-of-arrays layout. t holds the closest hit so far, the
+// kernels lower it and record the primitive and barycentrics of the new hit. The lanes from
+// num_rays up to the next multiple of TRI_PACKET_PAD must have t = -FLT_MAX, they are never hit.
+struct TriRayPacket
+{
+	glm::vec3 origin;
+	int num_rays;
+	float dir[3][TRI_PACKET_RAYS];
+	float t[TRI_PACKET_RAYS];
+	float u[TRI_PACKET_RAYS];
+	float v[TRI_PACKET_RAYS];
+	unsigned prim[TRI_PACKET_RAYS];
+};
+
+// The first num_triangles lanes of a block against all rays of a packet, SIMD across the rays.
+// Every ray ends up with the same hit TriBlockIntersect would give it.
+typedef void(*TriBlockIntersectPacket)(const TriangleBlock& block, int num_triangles, TriRayPacket& packet, float tmin);
+
+struct TriKernels
+{
+	const char* isa;
+	TriBlockIntersect intersect;
+	TriBlockIntersectPacket intersect_packet;
+};
+
+// Best kernel for the running CPU, selected once by feature detection.
+// Setting the environment variable TRI_ISA to "scalar", "sse", "avx2" or "avx512" forces a variant
+// (when supported).
+const TriKernels& tri_kernels();
+
+// Runs every variant the CPU supports over random blocks and rays, checks them against the scalar
+// one and prints the ray-triangle tests per second, for single rays and for packets.
+void tri_kernels_benchmark();
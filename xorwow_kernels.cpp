@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "xorwow_kernels.h"
+#include "cpu_features.h"
+#include "bench_rand.h"
+
+// the AVX2 conversion relies on an unfused multiply-add to round exactly once
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+void rng_lanes_load(RNGStateLanes& lanes, const RNGState* states, int count)
+{
+	memset(&lanes, 0, sizeof(RNGStateLanes));
+	for (int i = 0; i < count; i++)
+	{
+		lanes.v[0][i] = states[i].v.v0;
+		lanes.v[1][i] = states[i].v.v1;
+		lanes.v[2][i] = states[i].v.v2;
+		lanes.v[3][i] = states[i].v.v3;
+		lanes.v[4][i] = states[i].v.v4;
+		lanes.d[i] = states[i].d;
+	}
+}
+
+void rng_lanes_store(const RNGStateLanes& lanes, RNGState* states, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		states[i].v.v0 = lanes.v[0][i];
+		states[i].v.v1 = lanes.v[1][i];
+		states[i].v.v2 = lanes.v[2][i];
+		states[i].v.v3 = lanes.v[3][i];
+		states[i].v.v4 = lanes.v[4][i];
+		states[i].d = lanes.d[i];
+	}
+}
+
+// scalar reference, rand_xorwow() and rand01() of rand.shinc one lane at a time
+
+static void uniforms_scalar(RNGStateLanes& lanes, int num_steps, float* out)
+{
+	for (int i = 0; i < XORWOW_LANES; i++)
+	{
+		RNGState state;
+		state.v.v0 = lanes.v[0][i];
+		state.v.v1 = lanes.v[1][i];
+		state.v.v2 = lanes.v[2][i];
+		state.v.v3 = lanes.v[3][i];
+		state.v.v4 = lanes.v[4][i];
+		state.d = lanes.d[i];
+		for (int s = 0; s < num_steps; s++)
+		{
+			unsigned t;
+			t = (state.v.v0 ^ (state.v.v0 >> 2));
+			state.v.v0 = state.v.v1;
+			state.v.v1 = state.v.v2;
+			state.v.v2 = state.v.v3;
+			state.v.v3 = state.v.v4;
+			state.v.v4 = (state.v.v4 ^ (state.v.v4 << 4)) ^ (t ^ (t << 1));
+			state.d += 362437;
+			unsigned long long urand = state.v.v4 + state.d;
+			out[s * XORWOW_LANES + i] = (float)urand / (float)(1ull << 32);
+		}
+		lanes.v[0][i] = state.v.v0;
+		lanes.v[1][i] = state.v.v1;
+		lanes.v[2][i] = state.v.v2;
+		lanes.v[3][i] = state.v.v3;
+		lanes.v[4][i] = state.v.v4;
+		lanes.d[i] = state.d;
+	}
+}
+
+#ifdef CPU_X86
+
+// AVX2: two groups of 8 lanes. There is no unsigned conversion, the high and low 16 bits are
+// converted separately: both products are exact and the sum rounds once, like the scalar conversion.
+// The scaling by 2^-32 is exact as well.
+
+TARGET_AVX2 static void uniforms_avx2(RNGStateLanes& lanes, int num_steps, float* out)
+{
+	const __m256i weyl = _mm256_set1_epi32(362437);
+	const __m256i low16 = _mm256_set1_epi32(0xffff);
+	const __m256 two16 = _mm256_set1_ps(65536.0f);
+	const __m256 two_m32 = _mm256_set1_ps(1.0f / 4294967296.0f);
+	for (int base = 0; base < XORWOW_LANES; base += 8)
+	{
+		__m256i v0 = _mm256_loadu_si256((const __m256i*)(lanes.v[0] + base));
+		__m256i v1 = _mm256_loadu_si256((const __m256i*)(lanes.v[1] + base));
+		__m256i v2 = _mm256_loadu_si256((const __m256i*)(lanes.v[2] + base));
+		__m256i v3 = _mm256_loadu_si256((const __m256i*)(lanes.v[3] + base));
+		__m256i v4 = _mm256_loadu_si256((const __m256i*)(lanes.v[4] + base));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(lanes.d + base));
+		for (int s = 0; s < num_steps; s++)
+		{
+			__m256i t = _mm256_xor_si256(v0, _mm256_srli_epi32(v0, 2));
+			v0 = v1;
+			v1 = v2;
+			v2 = v3;
+			v3 = v4;
+			v4 = _mm256_xor_si256(_mm256_xor_si256(v4, _mm256_slli_epi32(v4, 4)), _mm256_xor_si256(t, _mm256_slli_epi32(t, 1)));
+			d = _mm256_add_epi32(d, weyl);
+			__m256i r = _mm256_add_epi32(v4, d);
+			__m256 hi = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(r, 16)), two16);
+			__m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(r, low16));
+			_mm256_storeu_ps(out + s * XORWOW_LANES + base, _mm256_mul_ps(_mm256_add_ps(hi, lo), two_m32));
+		}
+		_mm256_storeu_si256((__m256i*)(lanes.v[0] + base), v0);
+		_mm256_storeu_si256((__m256i*)(lanes.v[1] + base), v1);
+		_mm256_storeu_si256((__m256i*)(lanes.v[2] + base), v2);
+		_mm256_storeu_si256((__m256i*)(lanes.v[3] + base), v3);
+		_mm256_storeu_si256((__m256i*)(lanes.v[4] + base), v4);
+		_mm256_storeu_si256((__m256i*)(lanes.d + base), d);
+	}
+}
+
+// AVX-512F: all 16 lanes in one register, with the unsigned conversion
+
+TARGET_AVX512 static void uniforms_avx512(RNGStateLanes& lanes, int num_steps, float* out)
+{
+	const __m512i weyl = _mm512_set1_epi32(362437);
+	const __m512 two_m32 = _mm512_set1_ps(1.0f / 4294967296.0f);
+	__m512i v0 = _mm512_loadu_si512(lanes.v[0]);
+	__m512i v1 = _mm512_loadu_si512(lanes.v[1]);
+	__m512i v2 = _mm512_loadu_si512(lanes.v[2]);
+	__m512i v3 = _mm512_loadu_si512(lanes.v[3]);
+	__m512i v4 = _mm512_loadu_si512(lanes.v[4]);
+	__m512i d = _mm512_loadu_si512(lanes.d);
+	for (int s = 0; s < num_steps; s++)
+	{
+		__m512i t = _mm512_xor_si512(v0, _mm512_srli_epi32(v0, 2));
+		v0 = v1;
+		v1 = v2;
+		v2 = v3;
+		v3 = v4;
+		v4 = _mm512_xor_si512(_mm512_xor_si512(v4, _mm512_slli_epi32(v4, 4)), _mm512_xor_si512(t, _mm512_slli_epi32(t, 1)));
+		d = _mm512_add_epi32(d, weyl);
+		__m512i r = _mm512_add_epi32(v4, d);
+		_mm512_storeu_ps(out + s * XORWOW_LANES, _mm512_mul_ps(_mm512_cvtepu32_ps(r), two_m32));
+	}
+	_mm512_storeu_si512(lanes.v[0], v0);
+	_mm512_storeu_si512(lanes.v[1], v1);
+	_mm512_storeu_si512(lanes.v[2], v2);
+	_mm512_storeu_si512(lanes.v[3], v3);
+	_mm512_storeu_si512(lanes.v[4], v4);
+	_mm512_storeu_si512(lanes.d, d);
+}
+
+#endif
+
+static XorwowKernels select_kernels()
+{
+	XorwowKernels scalar = { "scalar", uniforms_scalar };
+	const char* forced = getenv("XORWOW_ISA");
+	if (forced != nullptr && strcmp(forced, "scalar") == 0) return scalar;
+
+#ifdef CPU_X86
+	XorwowKernels avx2 = { "avx2", uniforms_avx2 };
+	XorwowKernels avx512 = { "avx512", uniforms_avx512 };
+
+	bool has_avx2 = cpu_has_avx2();
+	bool has_avx512 = has_avx2 && cpu_has_avx512();
+
+	if (forced != nullptr && strcmp(forced, "avx2") == 0 && has_avx2) return avx2;
+	if (has_avx512) return avx512;
+	if (has_avx2) return avx2;
+#endif
+	return scalar;
+}
+
+const XorwowKernels& xorwow_kernels()
+{
+	static XorwowKernels kernels = select_kernels();
+	return kernels;
+}
+
+void xorwow_kernels_benchmark()
+{
+	const int num_blocks = 4096; // 65536 generators, 1.5MB of state
+	const int num_steps = 64;
+	const int num_rounds = 8;
+
+	// arbitrary distinct states, the generator only needs a nonzero v
+	std::vector<RNGStateLanes> initial(num_blocks);
+	BenchRand rng(0x9E3779B9u);
+	for (int i = 0; i < num_blocks; i++)
+		for (int k = 0; k < 6; k++)
+			for (int j = 0; j < XORWOW_LANES; j++)
+			{
+				unsigned x = rng.next();
+				if (k < 5) initial[i].v[k][j] = x;
+				else initial[i].d[j] = x;
+			}
+
+	std::vector<XorwowKernels> variants;
+	variants.push_back({ "scalar", uniforms_scalar });
+#ifdef CPU_X86
+	if (cpu_has_avx2()) variants.push_back({ "avx2", uniforms_avx2 });
+	if (cpu_has_avx2() && cpu_has_avx512()) variants.push_back({ "avx512", uniforms_avx512 });
+#endif
+
+	std::vector<float> reference;
+	std::vector<RNGStateLanes> reference_states;
+	double scalar_rate = 0.0;
+	for (size_t k = 0; k < variants.size(); k++)
+	{
+		std::vector<RNGStateLanes> lanes = initial;
+		std::vector<float> out((size_t)num_blocks * num_steps * XORWOW_LANES);
+		std::vector<float> first;
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < num_rounds; r++)
+		{
+			for (int i = 0; i < num_blocks; i++)
+				variants[k].uniforms(lanes[i], num_steps, out.data() + (size_t)i * num_steps * XORWOW_LANES);
+			if (r == 0) first = out;
+		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		if (k == 0)
+		{
+			reference = first;
+			reference_states = lanes;
+		}
+		unsigned mismatches = 0;
+		for (size_t i = 0; i < first.size(); i++)
+			if (memcmp(&first[i], &reference[i], sizeof(float)) != 0) mismatches++;
+		for (int i = 0; i < num_blocks; i++)
+			if (memcmp(&lanes[i], &reference_states[i], sizeof(RNGStateLanes)) != 0) mismatches++;
+
+		double uniforms = (double)num_rounds * num_blocks * num_steps * XORWOW_LANES;
+		double rate = uniforms / ms * 1e-3;
+		if (k == 0) scalar_rate = rate;
+		printf("xorwow kernel %-6s: %8.1f M uniforms/s (%.2fx scalar), %u mismatches\n", variants[k].isa, rate, rate / scalar_rate, mismatches);
+	}
+	printf("xorwow kernel in use: %s\n", xorwow_kernels().isa);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "RNGState.h"
+
+#define XORWOW_LANES 16
+
+// The xorwow states of 16 independent generators interleaved word by word, lane i of every array
+// belonging to generator i, so that one vector register holds the same word of 8 or 16 generators.
+struct RNGStateLanes
+{
+	unsigned v[5][XORWOW_LANES];
+	unsigned d[XORWOW_LANES];
+};
+
+// states[0, count) to and from lanes [0, count), the other lanes are zeroed on load and ignored on store
+void rng_lanes_load(RNGStateLanes& lanes, const RNGState* states, int count);
+void rng_lanes_store(const RNGStateLanes& lanes, RNGState* states, int count);
+
+// Advances every lane by num_steps and writes the uniforms of rand01() in rand.shinc,
+// out[step * XORWOW_LANES + lane]. Every lane gives exactly the numbers the scalar generator gives
+// from the same state, so CPU renders follow the same random sequences as the GPU ones.
+typedef void(*XorwowUniforms)(RNGStateLanes& lanes, int num_steps, float* out);
+
+struct XorwowKernels
+{
+	const char* isa;
+	XorwowUniforms uniforms;
+};
+
+// Best kernel for the running CPU, selected once by feature detection.
+// Setting the environment variable XORWOW_ISA to "scalar", "avx2" or "avx512" forces a variant
+// (when supported).
+const XorwowKernels& xorwow_kernels();
+
+// Runs every variant the CPU supports, checks them against the scalar one and prints the uniforms
+// per second.
+void xorwow_kernels_benchmark();